@@ -23,12 +23,17 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <strings.h>
+#include <png.h>
+#include <zlib.h>
 #include "vncsnapshot.h"
 #include "version.h"
 
 static int setNumber(int *argc, char ***argv, void *arg, int value);
 static int setString(int *argc, char ***argv, void *arg, int value);
 static int setFlag(int *argc, char ***argv, void *arg, int value);
+static int setPNGFast(int *argc, char ***argv, void *arg, int value);
+static int lookupName(const char *names[], const int values[], const char *name, size_t len);
 
 static char * rect = NULL;
 
@@ -58,7 +63,31 @@ Options cmdLineOptions[] = {
   {"-verbose",       setFlag,   &appData.quiet, 0, ": output messages"},
   {"-vncQuality",    setNumber, &appData.qualityLevel, 0, " <JPEG-QUALITY-VALUE>: transmission quality level (0..9: 0-low, 9-high)"},
   {"-fps",           setNumber, &appData.fps, 0, " <FPS>: Wait <FPS> seconds between snapshots, default 60"},
-  {"-count",         setNumber, &appData.count, 0, " <COUNT>: Capture <COUNT> images, default 1"},
+  {"-interval",      setNumber, &appData.interval, 0, " <MS>: Wait <MS> milliseconds between snapshots (overrides -fps)"},
+  {"-count",         setNumber, &appData.count, 0, " <COUNT>: Capture <COUNT> images, 0 for no limit, default 1"},
+  {"-queue",         setNumber, &appData.queueLength, 0, " <N>: Hold up to <N> snapshots waiting to be written"},
+  {"-writers",       setNumber, &appData.writerThreads, 0, " <N>: Write snapshots using <N> threads"},
+  {"-pnglevel",      setNumber, &appData.pngLevel, 0, " <LEVEL>: PNG compression level (0..9: 0-fast, 9-best)"},
+  {"-pngfilter",     setString, &appData.pngFilterString, 0, " <FILTERS>: PNG row filters (none, sub, up, avg, paeth or adaptive)"},
+  {"-pngstrategy",   setString, &appData.pngStrategyString, 0, " <STRATEGY>: PNG zlib strategy (default, filtered, rle or huffman)"},
+  {"-pngthreads",    setNumber, &appData.pngThreads, 0, " <N>: Encode each PNG image using <N> threads, 0 for one per CPU"},
+  {"-record",        setString, &appData.recordFile, 0, " <FILE>: record the data received from the server to <FILE>"},
+  {"-replay",        setString, &appData.replayFile, 0, " <FILE>: replay a recorded session instead of connecting to a server"},
+  {"-bench",         setFlag,   &appData.bench, 1, ": with -replay, report decoding and PNG encoding speed"},
+  {"-rgbx",          setFlag,   &appData.rgbxBuffer, 1, ": keep 32-bit pixels in memory (faster decoding, a third more memory)"},
+  {"-unchanged",     setString, &appData.unchangedString, 0, " <MODE>: with -count, for an unchanged screen: write, skip, link or symlink"},
+  {"-minchange",     setNumber, &appData.minChange, 0, " <PIXELS>: treat the screen as unchanged until <PIXELS> pixels change"},
+  {"-stream",        setFlag,   &appData.streamFirst, 1, ": encode the first snapshot while it is received (this is the default)"},
+  {"-nostream",      setFlag,   &appData.streamFirst, 0, ": encode the first snapshot once it has been received"},
+  {"-pngfast",       setPNGFast, NULL, 0, ": fast PNG settings for screen content (-pnglevel 1 -pngfilter up -pngstrategy rle)"},
+  {"-jpegquality",   setNumber, &appData.jpegQuality, 0, " <QUALITY>: JPEG output quality (1..100), default 80"},
+  {"-jpegsubsample", setString, &appData.jpegSubsampleString, 0, " <444|422|420>: JPEG output chroma subsampling, default 420"},
+  {"-jpegfastdct",   setFlag,   &appData.jpegFastDCT, 1, ": use the fast, less accurate DCT for JPEG output"},
+  {"-fbfile",        setString, &appData.frameBufferFile, 0, " <FILE>: keep the frame buffer in <FILE>, mapped into memory"},
+  {"-shm",           setString, &appData.shmName, 0, " <NAME>: publish each snapshot in POSIX shared memory <NAME>; the filename may then be left out"},
+  {"-hosts",         setString, &appData.hostsFile, 0, " <FILE>: capture each server listed in <FILE>, one \"server filename\" per line"},
+  {"-parallel",      setNumber, &appData.parallel, 0, " <N>: with -hosts, capture up to <N> servers at a time"},
+  {"-decodethreads", setNumber, &appData.decodeThreads, 0, " <N>: decode Tight rectangles on a thread per zlib stream and <N> for JPEG, and draw large ZRLE ones on another, 0 for one per CPU"},
   {NULL, NULL, NULL, 0, NULL}
 };
 
@@ -69,7 +98,7 @@ Options cmdLineOptions[] = {
  * from a dialog box.
  */
 
-char vncServerHost[256];
+char vncServerHost[MAX_SERVER_HOST];
 uint16_t vncServerPort = 0;
 char *vncServerName;
 
@@ -94,11 +123,67 @@ AppData appData = {
     0, 0,   /* rectXNegative, rectYNegative */
     0, 0,   /* rect width, height */
     0, 0,   /* rect x, y */
-    0,      /* gotCursorPos (-cursor, -nocursor worked) */
     60,     /* fps */
+    0,      /* interval */
     1,      /* count */
+    2,      /* queueLength */
+    1,      /* writerThreads */
+    Z_BEST_COMPRESSION, /* pngLevel */
+    NULL,   /* pngFilterString */
+    NULL,   /* pngStrategyString */
+    -1,     /* pngFilters */
+    -1,     /* pngStrategy */
+    1,      /* pngThreads */
+    NULL,   /* recordFile */
+    NULL,   /* replayFile */
+    0,      /* bench */
+    0,      /* rgbxBuffer */
+    NULL,   /* unchangedString */
+    UNCHANGED_WRITE, /* unchangedMode */
+    1,      /* minChange */
+    1,      /* streamFirst */
+    80,     /* jpegQuality */
+    NULL,   /* jpegSubsampleString */
+    JPEG_SUBSAMPLE_420, /* jpegSubsample */
+    0,      /* jpegFastDCT */
+    NULL,   /* frameBufferFile */
+    NULL,   /* shmName */
+    NULL,   /* hostsFile */
+    16,     /* parallel */
+    1,      /* decodeThreads */
     };
 
+/* Names accepted by -pngfilter and -pngstrategy */
+static const char *pngFilterNames[] = {
+    "none", "sub", "up", "avg", "paeth", "adaptive", NULL
+};
+static const int pngFilterValues[] = {
+    PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG,
+    PNG_FILTER_PAETH, PNG_ALL_FILTERS
+};
+static const char *pngStrategyNames[] = {
+    "default", "filtered", "rle", "huffman", NULL
+};
+static const int pngStrategyValues[] = {
+    Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE, Z_HUFFMAN_ONLY
+};
+
+/* Names accepted by -unchanged */
+static const char *unchangedNames[] = {
+    "write", "skip", "link", "symlink", NULL
+};
+static const int unchangedValues[] = {
+    UNCHANGED_WRITE, UNCHANGED_SKIP, UNCHANGED_LINK, UNCHANGED_SYMLINK
+};
+
+/* Names accepted by -jpegsubsample */
+static const char *jpegSubsampleNames[] = {
+    "444", "422", "420", NULL
+};
+static const int jpegSubsampleValues[] = {
+    JPEG_SUBSAMPLE_444, JPEG_SUBSAMPLE_422, JPEG_SUBSAMPLE_420
+};
+
 
 /*
  * removeArgs() is used to remove some of command line arguments.
@@ -127,12 +212,15 @@ usage(void)
           "vncsnapshot-png version " VNC_SNAPSHOT_VERSION " (based on TightVNC 1.2.8, RealVNC 3.3.7, vncsnapshot 1.2a)\n"
           "\n"
           "Usage: %s [<OPTIONS>] [<HOST>]:<DISPLAY#> filename\n"
+          "       %s [<OPTIONS>] -shm <NAME> [<HOST>]:<DISPLAY#> [filename]\n"
+          "       %s [<OPTIONS>] -hosts <FILE>\n"
           "       %s [<OPTIONS>] -listen [<DISPLAY#>] filename\n"
           "       %s [<OPTIONS>] -tunnel <HOST>:<DISPLAY#> filename\n"
           "       %s [<OPTIONS>] -via <GATEWAY> [<HOST>]:<DISPLAY#> filename\n"
           "\n"
           "<OPTIONS> are:"
-          "\n", programName, programName, programName, programName);
+          "\n", programName, programName, programName, programName, programName,
+          programName);
     for (i = 0; cmdLineOptions[i].optionstring; i++) {
         fprintf(stderr, 
           "        %s", cmdLineOptions[i].optionstring);
@@ -168,9 +256,7 @@ GetArgsAndResources(int argc, char **argv)
   int   argsleft;
   char **arg;
   int processed;
-  char *vncServerName, *colonPos;
-  size_t len;
-  uint16_t portOffset;
+  char *vncServerName;
 
 
   argsleft = argc;
@@ -183,7 +269,7 @@ GetArgsAndResources(int argc, char **argv)
 
   do {
       processed = 0;
-      for (i = 0; cmdLineOptions[i].optionstring != NULL; i++) {
+      for (i = 0; cmdLineOptions[i].optionstring != NULL && arg[0] != NULL; i++) {
           if (strcmp(cmdLineOptions[i].optionstring, arg[0]) == 0) {
               processed = cmdLineOptions[i].set(&argsleft, &arg, cmdLineOptions[i].arg, cmdLineOptions[i].value);
               argsleft--;
@@ -239,6 +325,73 @@ GetArgsAndResources(int argc, char **argv)
         appData.rectY = (int32_t) y;
     }
 
+    /* Parse PNG options. Filters may be combined, e.g. "none,up", in
+     * which case libpng picks the best of them for each row.
+     */
+    if (appData.pngLevel < 0 || appData.pngLevel > 9) {
+        fprintf(stderr, "%s: invalid PNG compression level %d\n",
+                programName, appData.pngLevel);
+        usage();
+    }
+    if (appData.pngFilterString != NULL) {
+        char *name = appData.pngFilterString;
+        appData.pngFilters = 0;
+        do {
+            size_t len = strcspn(name, ",");
+            int filter = lookupName(pngFilterNames, pngFilterValues, name, len);
+            if (filter < 0) {
+                fprintf(stderr, "%s: unknown PNG filter '%.*s'\n",
+                        programName, (int) len, name);
+                usage();
+            }
+            appData.pngFilters |= filter;
+            name += len;
+        } while (*name++ == ',');
+    }
+    if (appData.pngStrategyString != NULL) {
+        appData.pngStrategy = lookupName(pngStrategyNames, pngStrategyValues,
+                                         appData.pngStrategyString,
+                                         strlen(appData.pngStrategyString));
+        if (appData.pngStrategy < 0) {
+            fprintf(stderr, "%s: unknown PNG strategy '%s'\n",
+                    programName, appData.pngStrategyString);
+            usage();
+        }
+    }
+
+    if (appData.unchangedString != NULL) {
+        appData.unchangedMode = lookupName(unchangedNames, unchangedValues,
+                                           appData.unchangedString,
+                                           strlen(appData.unchangedString));
+        if (appData.unchangedMode < 0) {
+            fprintf(stderr, "%s: unknown -unchanged mode '%s'\n",
+                    programName, appData.unchangedString);
+            usage();
+        }
+    }
+    if (appData.jpegQuality < 1 || appData.jpegQuality > 100) {
+        fprintf(stderr, "%s: invalid JPEG quality %d\n", programName, appData.jpegQuality);
+        usage();
+    }
+    if (appData.jpegSubsampleString != NULL) {
+        appData.jpegSubsample = lookupName(jpegSubsampleNames, jpegSubsampleValues,
+                                           appData.jpegSubsampleString,
+                                           strlen(appData.jpegSubsampleString));
+        if (appData.jpegSubsample < 0) {
+            fprintf(stderr, "%s: unknown JPEG subsampling '%s'\n",
+                    programName, appData.jpegSubsampleString);
+            usage();
+        }
+    }
+    if (appData.count < 0) {
+        fprintf(stderr, "%s: invalid -count %d\n", programName, appData.count);
+        usage();
+    }
+    if (appData.minChange < 0) {
+        fprintf(stderr, "%s: invalid -minchange %d\n", programName, appData.minChange);
+        usage();
+    }
+
     argc = argsleft;
     argv = arg;
 
@@ -247,8 +400,35 @@ GetArgsAndResources(int argc, char **argv)
      server name.  If not given then pop up a dialog box and wait for the
      server name to be entered. */
 
-  if (listenSpecified) {
-    if (argc != 2) {
+  if (appData.bench && !appData.replayFile) {
+    fprintf(stderr,"%s: -bench needs -replay\n", programName);
+    usage();
+  }
+
+  /* With -hosts, servers and filenames are read from the list. Every
+     server would share the one shared memory object, frame buffer file or
+     recording. */
+  if (appData.hostsFile) {
+    if (argc != 1 || listenSpecified || appData.replayFile) {
+      fprintf(stderr,"%s: -hosts takes no server or filename, and no -listen or -replay\n",
+              programName);
+      usage();
+    }
+    if (appData.shmName || appData.frameBufferFile || appData.recordFile) {
+      fprintf(stderr,"%s: -hosts cannot be used with -shm, -fbfile or -record\n",
+              programName);
+      usage();
+    }
+    if (appData.parallel < 1) {
+      fprintf(stderr,"%s: invalid -parallel %d\n", programName, appData.parallel);
+      usage();
+    }
+    return;
+  }
+
+  /* With -shm, no file need be written; the filename is left NULL. */
+  if (listenSpecified || appData.replayFile) {
+    if (argc != 2 && !(argc == 1 && appData.shmName)) {
       fprintf(stderr,"\n%s -listen: invalid command line argument: %s\n",
               programName, argv[0]);
       usage();
@@ -257,7 +437,7 @@ GetArgsAndResources(int argc, char **argv)
     return;
   }
 
-  if (argc != 3) {
+  if (argc != 3 && !(argc == 2 && appData.shmName)) {
     usage();
     return; /* keep gcc -Wall happy */
   } else {
@@ -268,19 +448,48 @@ GetArgsAndResources(int argc, char **argv)
       usage();
   }
 
-  if (strlen(vncServerName) > 255) {
+  if (!SetServerName(vncServerName)) {
+    usage();
+  }
+}
+
+/*
+ * SetServerName() sets vncServerHost and vncServerPort from a server name,
+ * host:display or host::port. It returns false if the name is invalid.
+ */
+
+bool
+SetServerName(const char *name)
+{
+  return ParseServerName(name, vncServerHost, &vncServerPort);
+}
+
+/*
+ * ParseServerName() splits a server name into the host, copied to host,
+ * which must have room for MAX_SERVER_HOST characters, and the port.
+ * It returns false if the name is invalid.
+ */
+
+bool
+ParseServerName(const char *name, char *host, uint16_t *port)
+{
+  const char *colonPos;
+  size_t len;
+  uint16_t portOffset;
+
+  if (strlen(name) >= MAX_SERVER_HOST) {
     fprintf(stderr,"VNC server name too long\n");
-    exit(1);
+    return false;
   }
 
-  colonPos = strchr(vncServerName, ':');
+  colonPos = strchr(name, ':');
   if (colonPos == NULL) {
     /* No colon -- use default port number */
-    strcpy(vncServerHost, vncServerName);
-    vncServerPort = SERVER_PORT_OFFSET;
+    strcpy(host, name);
+    *port = SERVER_PORT_OFFSET;
   } else {
-    memcpy(vncServerHost, vncServerName, (size_t) (colonPos - vncServerName));
-    vncServerHost[colonPos - vncServerName] = '\0';
+    memcpy(host, name, (size_t) (colonPos - name));
+    host[colonPos - name] = '\0';
     len = strlen(colonPos + 1);
     portOffset = SERVER_PORT_OFFSET;
     if (colonPos[1] == ':') {
@@ -290,10 +499,11 @@ GetArgsAndResources(int argc, char **argv)
       portOffset = 0;
     }
     if (!len || strspn(colonPos + 1, "0123456789") != len) {
-      usage();
+      return false;
     }
-    vncServerPort = (uint16_t) (atoi(colonPos + 1) + portOffset);
+    *port = (uint16_t) (atoi(colonPos + 1) + portOffset);
   }
+  return true;
 }
 
 static int setNumber(int *argc, char ***argv, void *arg, int value)
@@ -334,3 +544,33 @@ static int setFlag(int *argc, char ***argv, void *arg, int value)
     *((bool *)arg) = (bool) value;
     return 1;
 }
+
+/*
+ * setPNGFast() selects PNG settings that are several times cheaper than the
+ * defaults. Screen content is mostly flat areas which the "up" filter turns
+ * into long runs of zeros, and run-length matching finds those at a
+ * fraction of the cost of a full match search, for slightly larger files.
+ * Options given after -pngfast override its choices.
+ */
+static int setPNGFast(int *argc, char ***argv, void *arg, int value)
+{
+    (void) argc, (void) argv, (void) arg, (void) value;
+    appData.pngLevel = 1;
+    appData.pngFilterString = "up";
+    appData.pngStrategyString = "rle";
+    return 1;
+}
+
+/*
+ * lookupName() returns the value for the first len characters of name in
+ * the NULL-terminated names table, or -1 if there is no such name.
+ */
+static int lookupName(const char *names[], const int values[], const char *name, size_t len)
+{
+    for (int i = 0; names[i] != NULL; i++) {
+        if (strlen(names[i]) == len && strncasecmp(names[i], name, len) == 0) {
+            return values[i];
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,209 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * bench.c - measure decoding and PNG encoding speed.
+ *
+ * With -bench, a session recorded with -record is replayed from memory:
+ * every framebuffer update in it is decoded, and the whole screen is
+ * written as a PNG image after each one. The time spent decoding each
+ * rectangle is charged to its encoding, so the report shows the speed of
+ * each decoder without any network in the way.
+ */
+
+#ifndef WIN32
+#define _XOPEN_SOURCE 600   /* for clock_gettime() */
+#endif
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "vncsnapshot.h"
+
+typedef struct {
+    uint32_t encoding;
+    const char *name;
+    uint64_t rects;
+    uint64_t pixels;
+    uint64_t bytes;     /* received, excluding rectangle headers */
+    int64_t nanos;
+} EncodingStats;
+
+static EncodingStats encodingStats[] = {
+    { rfbEncodingRaw,      "Raw",      0, 0, 0, 0 },
+    { rfbEncodingCopyRect, "CopyRect", 0, 0, 0, 0 },
+    { rfbEncodingRRE,      "RRE",      0, 0, 0, 0 },
+    { rfbEncodingCoRRE,    "CoRRE",    0, 0, 0, 0 },
+    { rfbEncodingHextile,  "Hextile",  0, 0, 0, 0 },
+    { rfbEncodingZlib,     "Zlib",     0, 0, 0, 0 },
+    { rfbEncodingTight,    "Tight",    0, 0, 0, 0 },
+    { rfbEncodingZRLE,     "ZRLE",     0, 0, 0, 0 },
+};
+#define NUM_ENCODINGS (sizeof(encodingStats) / sizeof(encodingStats[0]))
+
+static uint64_t updates = 0;
+
+static void PrintRate(const char *name, uint64_t count, uint64_t bytes,
+                      double frames, int64_t nanos);
+
+
+/*
+ * BenchNanos() returns a monotonic timestamp in nanoseconds.
+ */
+
+int64_t
+BenchNanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * BenchRect() records that a rectangle of the given encoding and number of
+ * pixels took bytes from the server and nanos to decode.
+ */
+
+void
+BenchRect(uint32_t encoding, uint32_t pixels, size_t bytes, int64_t nanos)
+{
+    for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+        if (encodingStats[i].encoding == encoding) {
+            encodingStats[i].rects++;
+            encodingStats[i].pixels += pixels;
+            encodingStats[i].bytes += bytes;
+            encodingStats[i].nanos += nanos;
+            return;
+        }
+    }
+}
+
+/*
+ * BenchWait() charges time spent waiting for rectangles of an encoding
+ * being decoded on other threads, without counting any rectangles.
+ */
+
+void
+BenchWait(uint32_t encoding, int64_t nanos)
+{
+    for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+        if (encodingStats[i].encoding == encoding) {
+            encodingStats[i].nanos += nanos;
+            return;
+        }
+    }
+}
+
+/*
+ * BenchUpdate() records the end of a framebuffer update.
+ */
+
+void
+BenchUpdate(void)
+{
+    updates++;
+}
+
+/*
+ * RunBenchmark() decodes every update in the recording being replayed,
+ * writing the screen to the output file after each, and reports how fast
+ * that went. It returns the program's exit status.
+ */
+
+int
+RunBenchmark(Session *s)
+{
+    uint32_t width = s->si.framebufferWidth, height = s->si.framebufferHeight;
+    size_t imageSize = (size_t) width * height * 3;
+    uint8_t *image = malloc(imageSize);
+    uint64_t frames = 0;
+    int64_t writeNanos = 0;
+    int64_t start;
+
+    if (image == NULL) {
+        fprintf(stderr, "Failed to allocate memory for snapshot, %" PRIu32 "x%" PRIu32 "\n",
+                width, height);
+        return 1;
+    }
+
+    /* Every update counts, blank or not */
+    appData.ignoreBlank = 0;
+
+    while (!ReplayFinished(s)) {
+        uint64_t before = updates;
+
+        while (!ReplayFinished(s) && HandleRFBServerMessage(s))
+            ;
+        if (updates == before) {
+            if (ReplayFinished(s)) {
+                break;      /* trailing non-update messages */
+            }
+            fprintf(stderr, "%s: cannot decode %s\n", programName, appData.replayFile);
+            free(image);
+            return 1;
+        }
+
+        start = BenchNanos();
+        if (WritesFromScreen(s->outputFormat)) {
+            (void) WriteScreenImage(s, appData.outputFilename, 0, 0, width, height, NULL);
+        } else {
+            CopyScreenToImage(s, image, 0, 0, width, height);
+            WriteImage(appData.outputFilename, s->outputFormat, image, width, height);
+        }
+        writeNanos += BenchNanos() - start;
+        frames++;
+    }
+    free(image);
+
+    printf("%s: %" PRIu64 " updates of %" PRIu32 "x%" PRIu32 "\n",
+           appData.replayFile, updates, width, height);
+    printf("%-9s %8s %10s %10s %10s %10s\n",
+           "", "rects", "MB in", "ms", "MB/s", "frames/s");
+    for (size_t i = 0; i < NUM_ENCODINGS; i++) {
+        EncodingStats *stats = &encodingStats[i];
+        if (stats->rects > 0) {
+            PrintRate(stats->name, stats->rects, stats->bytes,
+                      (double) stats->pixels / ((double) width * height), stats->nanos);
+        }
+    }
+    if (frames > 0) {
+        PrintRate(FormatName(s->outputFormat), frames, frames * imageSize,
+                  (double) frames, writeNanos);
+    }
+    return 0;
+}
+
+/*
+ * PrintRate() prints one line of the report. Decoder frame rates are in
+ * screens' worth of pixels per second; for PNG, MB are of uncompressed
+ * image data.
+ */
+
+static void
+PrintRate(const char *name, uint64_t count, uint64_t bytes, double frames,
+          int64_t nanos)
+{
+    double seconds = (double) nanos / 1e9;
+    double megabytes = (double) bytes / 1e6;
+
+    printf("%-9s %8" PRIu64 " %10.2f %10.1f %10.1f %10.1f\n",
+           name, count, megabytes, seconds * 1000,
+           seconds > 0 ? megabytes / seconds : 0,
+           seconds > 0 ? frames / seconds : 0);
+}
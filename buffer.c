@@ -21,13 +21,22 @@
  * buffer.c - functions to deal with the raw image buffer.
  */
 
+#ifndef WIN32
+#define _XOPEN_SOURCE 600   /* for pwrite(), ftruncate() */
+#endif
+
 #include "vncsnapshot.h"
 
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <jpeglib.h>
 #include <stdio.h>
@@ -35,20 +44,26 @@
 #include <png.h>      /* PNG lib */
 #include <zlib.h>
 
-static void BufferPixelToRGB(uint32_t pixel, uint16_t *r, uint16_t *g, uint16_t *b);
-
-static uint8_t * rawBuffer = NULL;
-static bool bufferBlank = true;
-static bool bufferWritten = false;
+static void BufferPixelToRGB(Session *s, uint32_t pixel, uint16_t *r, uint16_t *g, uint16_t *b);
+static bool ScreenRowIsBlack(Session *s, const uint8_t *row, size_t n);
+static void FillRun(uint8_t *dst, size_t bytes, const uint8_t *pixel, size_t pixelSize);
+static void MarkDamaged(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+static size_t ImageHeader(char *header, size_t size, uint32_t width, uint32_t height,
+                          size_t bytesPerPixel, size_t align);
+static uint8_t *MapBufferFile(Session *s, const char *filename, size_t bytes);
+static void WriteAll(int fd, const void *data, size_t len, off_t offset, const char *filename);
 
 #define RAW_BYTES_PER_PIXEL 3   /* size of pixel in raw buffer */
 #define MY_BYTES_PER_PIXEL 4    /* size of pixel in VNC buffer */
 #define MY_BITS_PER_PIXEL (MY_BYTES_PER_PIXEL*8)
 
+#define IMAGE_HEADER_SIZE 128   /* room for the longest PPM or PAM header */
+#define BUFFER_FILE_ALIGN 64    /* -fbfile pixels start on this boundary */
+
 int
-AllocateBuffer()
+AllocateBuffer(Session *s)
 {
-    uint32_t bytes;
+    size_t bytes;
     static const short testEndian = 1;
 
     /* Determine 'endian' nature of this machine */
@@ -65,143 +80,536 @@ AllocateBuffer()
     /* Format is RGBA. Due to the way we store the pixels,
      * the 'bigEndian' is the *opposite* of the hardware value.
      */
-    myFormat.bitsPerPixel = MY_BITS_PER_PIXEL;
-    myFormat.depth = 24;
-    myFormat.trueColour = 1;
-    myFormat.bigEndian = bigEndian;
+    s->format.bitsPerPixel = MY_BITS_PER_PIXEL;
+    s->format.depth = 24;
+    s->format.trueColour = 1;
+    s->format.bigEndian = bigEndian;
     if (bigEndian) {
-        myFormat.redShift = 24;
-        myFormat.greenShift = 16;
-        myFormat.blueShift = 8;
+        s->format.redShift = 24;
+        s->format.greenShift = 16;
+        s->format.blueShift = 8;
     } else {
-        myFormat.redShift = 0;
-        myFormat.greenShift = 8;
-        myFormat.blueShift = 16;
-    }
-    myFormat.redMax = 0xFF;
-    myFormat.greenMax = 0xFF;
-    myFormat.blueMax = 0xFF;
-
-    assert(SIZE_MAX / (myFormat.depth / 8) / si.framebufferWidth >= si.framebufferHeight);
-    bytes = (uint32_t) (si.framebufferWidth * si.framebufferHeight * myFormat.depth / 8);
-    rawBuffer = malloc(bytes);   /* allocate initialized to 0 */
-    if (rawBuffer == NULL) {
-        fprintf(stderr, "Failed to allocate memory frame buffer, %" PRId32 " bytes\n",
+        s->format.redShift = 0;
+        s->format.greenShift = 8;
+        s->format.blueShift = 16;
+    }
+    s->format.redMax = 0xFF;
+    s->format.greenMax = 0xFF;
+    s->format.blueMax = 0xFF;
+
+    /* The frame buffer holds packed RGB, or with -rgbx the pixels exactly
+     * as the server sends them, which are only packed when an image is
+     * taken. */
+    s->bytesPerPixel = appData.rgbxBuffer ? MY_BYTES_PER_PIXEL : RAW_BYTES_PER_PIXEL;
+    s->blank = true;
+    s->written = false;
+
+    assert(SIZE_MAX / s->bytesPerPixel / s->si.framebufferWidth >= s->si.framebufferHeight);
+    bytes = (size_t)s->si.framebufferWidth * s->si.framebufferHeight * s->bytesPerPixel;
+    if (appData.frameBufferFile != NULL) {
+        s->frameBuffer = MapBufferFile(s, appData.frameBufferFile, bytes);
+        if (s->frameBuffer == NULL) {
+            return 0;
+        }
+    }
+    if (s->frameBuffer == NULL) {
+        s->frameBuffer = malloc(bytes);   /* allocate initialized to 0 */
+    }
+    if (s->frameBuffer == NULL) {
+        fprintf(stderr, "Failed to allocate memory frame buffer, %zu bytes\n",
                 bytes);
         return 0;
     }
 
-    memset(rawBuffer, 0xBA, bytes);
+    memset(s->frameBuffer, 0xBA, bytes);
+
+    s->damageColumns = ((uint32_t)s->si.framebufferWidth + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    s->damageRows = ((uint32_t)s->si.framebufferHeight + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    s->damage = malloc((size_t)s->damageColumns * s->damageRows);
+    if (s->damage == NULL) {
+        fprintf(stderr, "Failed to allocate memory for damage map\n");
+        return 0;
+    }
+    /* Nothing has been captured yet, so all of it is new */
+    memset(s->damage, 1, (size_t)s->damageColumns * s->damageRows);
 
     return 1;
 }
 
+/*
+ * FreeBuffer() frees the session's frame buffer, unmapping it if it is
+ * kept in a file with -fbfile.
+ */
+
 void
-CopyDataToScreen(uint8_t *buffer, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+FreeBuffer(Session *s)
 {
-    size_t start;
-    size_t stride;
-    size_t row, col;
-    assert(si.framebufferWidth > w);
-    stride = (size_t)(si.framebufferWidth * RAW_BYTES_PER_PIXEL - (int32_t)w * RAW_BYTES_PER_PIXEL);
-    start = (x + y * si.framebufferWidth) * RAW_BYTES_PER_PIXEL;
+    if (s->bufferMap != NULL) {
+        (void) munmap(s->bufferMap, s->bufferMapSize);
+    } else {
+        free(s->frameBuffer);
+    }
+    free(s->damage);
+    s->frameBuffer = s->bufferMap = s->damage = NULL;
+}
+
+void
+CopyDataToScreen(Session *s, const uint8_t *buffer, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    ReserveScreenRectangle(s, x, y, w, h);
+    ScreenRectanglePainted(s, PaintDataToScreen(s, buffer, x, y, w, h, s->blank));
+}
+
+/*
+ * ReserveScreenRectangle() records that a rectangle is about to be drawn
+ * with PaintDataToScreen(), perhaps on another thread.
+ */
 
-    bufferWritten = 1;
+void
+ReserveScreenRectangle(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    s->written = 1;
+    MarkDamaged(s, x, y, w, h);
+}
+
+/*
+ * PaintDataToScreen() copies 32-bit pixels into a rectangle reserved with
+ * ReserveScreenRectangle(). It touches nothing else in the session, so
+ * threads may paint rectangles that do not overlap at once. If checkBlack
+ * is set, it returns whether every pixel was black; otherwise false.
+ */
+
+bool
+PaintDataToScreen(Session *s, const uint8_t *buffer, uint32_t x, uint32_t y, uint32_t w,
+                  uint32_t h, bool checkBlack)
+{
+    size_t start;
+    size_t row;
+    size_t rowBytes = (size_t)w * MY_BYTES_PER_PIXEL;
+    size_t lineBytes = (size_t)s->si.framebufferWidth * s->bytesPerPixel;
+    assert(s->si.framebufferWidth >= w);
+    start = (x + y * s->si.framebufferWidth) * s->bytesPerPixel;
 
     for (row = 0; row < h; row++) {
-        for (col = 0; col < w; col++) {
-            bufferBlank &= buffer[0] == 0 &&
-                            buffer[1] == 0 &&
-                            buffer[2] == 0;
-            rawBuffer[start++] = *buffer++;
-            rawBuffer[start++] = *buffer++;
-            rawBuffer[start++] = *buffer++;
-            buffer++;   /* ignore 4th byte */
+        /* Once anything else has been drawn, there is no need to look */
+        if (checkBlack) {
+            checkBlack = IsBlackRGBX(buffer, w);
+        }
+        if (s->bytesPerPixel == MY_BYTES_PER_PIXEL) {
+            memcpy(&s->frameBuffer[start], buffer, rowBytes);
+        } else {
+            PackRGBX(&s->frameBuffer[start], buffer, w);
+        }
+        buffer += rowBytes;
+        start += lineBytes;
+    }
+    return checkBlack;
+}
+
+/*
+ * ScreenRows() sets rows to point at h rows of the frame buffer, from (x, y)
+ * down, for a decoder to draw a rectangle reserved with
+ * ReserveScreenRectangle() in place, in pixels of ScreenBytesPerPixel().
+ */
+
+void
+ScreenRows(Session *s, uint8_t **rows, uint32_t x, uint32_t y, uint32_t h)
+{
+    size_t lineBytes = (size_t)s->si.framebufferWidth * s->bytesPerPixel;
+    uint8_t *line = &s->frameBuffer[((size_t)x + (size_t)y * s->si.framebufferWidth) *
+                                    s->bytesPerPixel];
+    uint32_t row;
+
+    assert(s->si.framebufferWidth > x && s->si.framebufferHeight >= y + h);
+    for (row = 0; row < h; row++, line += lineBytes) {
+        rows[row] = line;
+    }
+}
+
+/*
+ * ScreenRectangleIsBlack() checks whether a rectangle of the frame buffer,
+ * drawn in with ScreenRows(), is all black.
+ */
+
+bool
+ScreenRectangleIsBlack(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    size_t lineBytes = (size_t)s->si.framebufferWidth * s->bytesPerPixel;
+    const uint8_t *line = &s->frameBuffer[((size_t)x + (size_t)y * s->si.framebufferWidth) *
+                                          s->bytesPerPixel];
+    uint32_t row;
+
+    for (row = 0; row < h; row++, line += lineBytes) {
+        if (!ScreenRowIsBlack(s, line, w)) {
+            return false;
         }
-        start += stride;
+    }
+    return true;
+}
+
+/*
+ * ScreenRectanglePainted() is told, back on the thread reading from the
+ * server, whether a rectangle painted was all black.
+ */
+
+void
+ScreenRectanglePainted(Session *s, bool black)
+{
+    if (!black) {
+        s->blank = false;
     }
 }
 
 uint8_t *
-CopyScreenToData(uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+CopyScreenToData(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
     size_t start;
-    size_t stride;
-    size_t row, col;
+    size_t row;
+    size_t rowBytes = (size_t)w * MY_BYTES_PER_PIXEL;
+    size_t lineBytes = (size_t)s->si.framebufferWidth * s->bytesPerPixel;
     uint8_t *buffer;
-    uint8_t *cp;
 
-    assert(si.framebufferWidth > w);
-    stride = (size_t)(si.framebufferWidth * RAW_BYTES_PER_PIXEL - (int32_t)w * RAW_BYTES_PER_PIXEL);
-    start = (x + y * si.framebufferWidth) * RAW_BYTES_PER_PIXEL;
+    assert(s->si.framebufferWidth >= w);
+    start = (x + y * s->si.framebufferWidth) * s->bytesPerPixel;
 
     assert(SIZE_MAX / w / MY_BYTES_PER_PIXEL >= (size_t) h);  /* Overflow check */
 
     /* Allocate a buffer at the VNC size, not the raw size */
     buffer = malloc((size_t)(h * w * MY_BYTES_PER_PIXEL));
-    cp = buffer;
 
     for (row = 0; row < h; row++) {
-        for (col = 0; col < w; col++) {
-            *cp++ = rawBuffer[start++];
-            *cp++ = rawBuffer[start++];
-            *cp++ = rawBuffer[start++];
-            *cp++ = 0;
+        if (s->bytesPerPixel == MY_BYTES_PER_PIXEL) {
+            memcpy(buffer + row * rowBytes, &s->frameBuffer[start], rowBytes);
+        } else {
+            UnpackRGB(buffer + row * rowBytes, &s->frameBuffer[start], w);
         }
-        start += stride;
+        start += lineBytes;
     }
 
     return buffer;
 }
 
+/*
+ * CopyScreenRectangle() copies a w x h rectangle of the frame buffer at
+ * (srcX, srcY) to (x, y), as for a CopyRect. The rectangles may overlap:
+ * rows are copied bottom up when moving down, and each row with memmove.
+ */
+
 void
-FillBufferRectangle(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t pixel)
+CopyScreenRectangle(Session *s, uint32_t srcX, uint32_t srcY, uint32_t x, uint32_t y,
+                    uint32_t w, uint32_t h)
 {
-    uint16_t r, g, b;
-    size_t start;
-    size_t stride;
-    size_t row, col;
+    size_t rowBytes = (size_t)w * s->bytesPerPixel;
+    size_t lineBytes = (size_t)s->si.framebufferWidth * s->bytesPerPixel;
+    uint8_t *src = &s->frameBuffer[(srcX + srcY * s->si.framebufferWidth) * s->bytesPerPixel];
+    uint8_t *dst = &s->frameBuffer[(x + y * s->si.framebufferWidth) * s->bytesPerPixel];
+    size_t row;
+
+    assert(s->si.framebufferWidth >= srcX + w && s->si.framebufferWidth >= x + w);
+    assert(s->si.framebufferHeight >= srcY + h && s->si.framebufferHeight >= y + h);
+
+    s->written = 1;
+    MarkDamaged(s, x, y, w, h);
+
+    /* Only pixels never drawn, or drawn black, can be copied while the
+     * buffer is blank, so look for the former. */
+    for (row = 0; s->blank && row < h; row++) {
+        s->blank = ScreenRowIsBlack(s, src + row * lineBytes, w);
+    }
 
-    BufferPixelToRGB(pixel, &r, &g, &b);
+    if (y > srcY) {
+        for (row = h; row-- > 0; ) {
+            memmove(dst + row * lineBytes, src + row * lineBytes, rowBytes);
+        }
+    } else {
+        for (row = 0; row < h; row++) {
+            memmove(dst + row * lineBytes, src + row * lineBytes, rowBytes);
+        }
+    }
+}
+
+/*
+ * ScreenRowIsBlack() checks whether n pixels of the frame buffer at row
+ * are all black.
+ */
+
+static bool
+ScreenRowIsBlack(Session *s, const uint8_t *row, size_t n)
+{
+    size_t i;
+
+    if (s->bytesPerPixel == MY_BYTES_PER_PIXEL) {
+        return IsBlackRGBX(row, n);
+    }
+    for (i = 0; i < n * RAW_BYTES_PER_PIXEL; i++) {
+        if (row[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * CopyScreenToImage() copies a rectangle of the frame buffer into image as
+ * packed RGB rows, ready to be written out.
+ */
 
-    bufferBlank &= r == 0 && g == 0 && b == 0;
-    bufferWritten = 1;
+void
+CopyScreenToImage(Session *s, uint8_t *image, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    size_t row;
+    size_t bytesPerLine = (size_t)w * RAW_BYTES_PER_PIXEL;
 
-    stride = (size_t)(si.framebufferWidth * RAW_BYTES_PER_PIXEL - (int32_t)w * RAW_BYTES_PER_PIXEL);
-    start = (x + y * si.framebufferWidth) * RAW_BYTES_PER_PIXEL;
+    assert(s->si.framebufferWidth >= x + w);
     for (row = 0; row < h; row++) {
-        for (col = 0; col < w; col++) {
-            rawBuffer[start++] = (uint8_t) r;
-            rawBuffer[start++] = (uint8_t) g;
-            rawBuffer[start++] = (uint8_t) b;
+        const uint8_t *line =
+            &s->frameBuffer[((y + row) * s->si.framebufferWidth + x) * s->bytesPerPixel];
+        if (s->bytesPerPixel == MY_BYTES_PER_PIXEL) {
+            PackRGBX(image + row * bytesPerLine, line, w);
+        } else {
+            memcpy(image + row * bytesPerLine, line, bytesPerLine);
         }
-        start += stride;
     }
 }
 
+/*
+ * CopyScreenToFrame() copies a rectangle of the frame buffer, pixels as
+ * they are, to the same place in frame, a copy of the whole screen with
+ * rows stride bytes apart.
+ */
+
+void
+CopyScreenToFrame(Session *s, uint8_t *frame, size_t stride, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    size_t lineBytes = (size_t)s->si.framebufferWidth * s->bytesPerPixel;
+    size_t row;
+
+    assert(s->si.framebufferWidth >= x + w && s->si.framebufferHeight >= y + h);
+    for (row = y; row < (size_t)y + h; row++) {
+        memcpy(frame + row * stride + x * s->bytesPerPixel,
+               &s->frameBuffer[row * lineBytes + x * s->bytesPerPixel],
+               (size_t)w * s->bytesPerPixel);
+    }
+}
+
+/*
+ * ScreenBytesPerPixel() returns the size of a pixel in the frame buffer.
+ */
+
+size_t
+ScreenBytesPerPixel(Session *s)
+{
+    return s->bytesPerPixel;
+}
+
+/*
+ * FillBufferRectangle() fills a rectangle with a single pixel value.
+ */
+
+void
+FillBufferRectangle(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t pixel)
+{
+    if (w == 0 || h == 0) {
+        return;
+    }
+    ReserveScreenRectangle(s, x, y, w, h);
+    ScreenRectanglePainted(s, PaintFillToScreen(s, x, y, w, h, pixel));
+}
+
+/*
+ * PaintFillToScreen() is FillBufferRectangle() for a rectangle reserved with
+ * ReserveScreenRectangle(), on any thread, returning whether the pixel is
+ * black. The first row is filled by copying ever larger runs of pixels
+ * already written, and the others are copied from it; a rectangle the full
+ * width of the screen is one contiguous run filled the same way.
+ */
+
+bool
+PaintFillToScreen(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t pixel)
+{
+    uint16_t r, g, b;
+    uint8_t colour[MY_BYTES_PER_PIXEL];
+    uint8_t *first;
+    size_t rowBytes = (size_t)w * s->bytesPerPixel;
+    size_t lineBytes = (size_t)s->si.framebufferWidth * s->bytesPerPixel;
+    size_t row;
+
+    BufferPixelToRGB(s, pixel, &r, &g, &b);
+    if (w == 0 || h == 0) {
+        return r == 0 && g == 0 && b == 0;
+    }
+
+    colour[0] = (uint8_t) r;
+    colour[1] = (uint8_t) g;
+    colour[2] = (uint8_t) b;
+    colour[3] = 0;
+
+    first = &s->frameBuffer[(x + y * s->si.framebufferWidth) * s->bytesPerPixel];
+    if (w == s->si.framebufferWidth) {
+        FillRun(first, rowBytes * h, colour, s->bytesPerPixel);
+    } else {
+        FillRun(first, rowBytes, colour, s->bytesPerPixel);
+        for (row = 1; row < h; row++) {
+            memcpy(first + row * lineBytes, first, rowBytes);
+        }
+    }
+    return r == 0 && g == 0 && b == 0;
+}
+
+/*
+ * FillRun() fills bytes bytes (a whole number of pixels) at dst with
+ * copies of a pixelSize-byte pixel.
+ */
+
+static void
+FillRun(uint8_t *dst, size_t bytes, const uint8_t *pixel, size_t pixelSize)
+{
+    size_t done;
+
+    if (memcmp(pixel, pixel + 1, pixelSize - 1) == 0) {
+        memset(dst, pixel[0], bytes);
+        return;
+    }
+    /* Short runs are written directly; longer ones start with four pixels */
+    for (done = 0; done < bytes && done < 4 * pixelSize; done += pixelSize) {
+        memcpy(dst + done, pixel, pixelSize);
+    }
+    while (done < bytes) {
+        size_t n = done < bytes - done ? done : bytes - done;
+        memcpy(dst + done, dst, n);
+        done += n;
+    }
+}
+
+/*
+ * HashScreenRectangle() returns a 64-bit hash of the pixels in a rectangle
+ * of the frame buffer, for telling whether they have changed.
+ */
+
+uint64_t
+HashScreenRectangle(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    size_t rowBytes = (size_t)w * s->bytesPerPixel;
+    size_t lineBytes = (size_t)s->si.framebufferWidth * s->bytesPerPixel;
+    const uint8_t *line = &s->frameBuffer[(x + y * s->si.framebufferWidth) * s->bytesPerPixel];
+    uint64_t hash = 0xcbf29ce484222325;
+    size_t row, i;
+
+    assert(s->si.framebufferWidth >= x + w && s->si.framebufferHeight >= y + h);
+    for (row = 0; row < h; row++, line += lineBytes) {
+        for (i = 0; i + 8 <= rowBytes; i += 8) {
+            uint64_t word;
+            memcpy(&word, line + i, 8);
+            hash = (hash ^ word) * 0x9e3779b97f4a7c15;
+            hash ^= hash >> 32;
+        }
+        for (; i < rowBytes; i++) {
+            hash = (hash ^ line[i]) * 0x100000001b3;
+        }
+    }
+    return hash;
+}
+
+/*
+ * MarkDamaged() records that a rectangle of the frame buffer is about to
+ * be drawn.
+ */
+
+static void
+MarkDamaged(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    uint32_t column, row;
+
+    if (w == 0 || h == 0) {
+        return;
+    }
+    StreamScreenWritten(s, x, y, w, h);
+    for (row = y / DAMAGE_TILE_SIZE; row <= (y + h - 1) / DAMAGE_TILE_SIZE; row++) {
+        for (column = x / DAMAGE_TILE_SIZE; column <= (x + w - 1) / DAMAGE_TILE_SIZE; column++) {
+            s->damage[row * s->damageColumns + column] = 1;
+        }
+    }
+}
+
+/*
+ * ScreenTileDamaged() tells whether anything has been drawn in the tile at
+ * the given column and row, counted in DAMAGE_TILE_SIZE squares, since the
+ * last ClearScreenDamage().
+ */
+
+bool
+ScreenTileDamaged(Session *s, uint32_t column, uint32_t row)
+{
+    assert(column < s->damageColumns && row < s->damageRows);
+    return s->damage[row * s->damageColumns + column] != 0;
+}
+
+/*
+ * CountScreenDamage() counts the tiles overlapping a rectangle of the screen
+ * that have been drawn in since the last ClearScreenDamage(), and if tiles is
+ * not NULL sets it to the number of tiles the rectangle overlaps.
+ */
+
+uint32_t
+CountScreenDamage(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t *tiles)
+{
+    uint32_t column, row;
+    uint32_t damaged = 0, total = 0;
+
+    if (w > 0 && h > 0) {
+        for (row = y / DAMAGE_TILE_SIZE; row <= (y + h - 1) / DAMAGE_TILE_SIZE; row++) {
+            for (column = x / DAMAGE_TILE_SIZE; column <= (x + w - 1) / DAMAGE_TILE_SIZE; column++) {
+                damaged += s->damage[row * s->damageColumns + column];
+                total++;
+            }
+        }
+    }
+    if (tiles != NULL) {
+        *tiles = total;
+    }
+    return damaged;
+}
+
+/*
+ * ClearScreenDamage() forgets what has been drawn, typically once a
+ * snapshot has been taken.
+ */
+
+void
+ClearScreenDamage(Session *s)
+{
+    memset(s->damage, 0, (size_t)s->damageColumns * s->damageRows);
+}
+
 int
-BufferIsBlank()
+BufferIsBlank(Session *s)
 {
-    return bufferBlank;
+    return s->blank;
 }
 
 int
-BufferWritten()
+BufferWritten(Session *s)
 {
-    return bufferWritten;
+    return s->written;
 }
 
-extern void write_PNG(char *filename, int interlace, uint32_t width, uint32_t height)
+extern void write_PNG(char *filename, int interlace, uint8_t *image,
+                      uint32_t width, uint32_t height)
 {
     int bit_depth=0, color_type;
     png_bytep row_pointers[height];
     png_structp png_ptr;
     png_infop info_ptr;
+    int threads = PNGThreads();
+
+    if (threads > 1 && !interlace) {
+        write_PNG_strips(filename, image, width, height, threads);
+        return;
+    }
 
     for (uint32_t i=0; i<height; i++)
     {
-        //row_pointers[i] = rawBuffer + i * 4 * width; //XXX
-        row_pointers[i] = & rawBuffer[i * 3 * width];
+        row_pointers[i] = & image[(size_t)i * width * RAW_BYTES_PER_PIXEL];
     }
 
     FILE *outfile = fopen(filename, "wb");
@@ -222,7 +630,13 @@ extern void write_PNG(char *filename, int interlace, uint32_t width, uint32_t he
 
     png_init_io(png_ptr, outfile);
 
-    png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+    png_set_compression_level(png_ptr, appData.pngLevel);
+    if (appData.pngFilters >= 0) {
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, appData.pngFilters);
+    }
+    if (appData.pngStrategy >= 0) {
+        png_set_compression_strategy(png_ptr, appData.pngStrategy);
+    }
 
     bit_depth = 8;
     color_type = PNG_COLOR_TYPE_RGB;
@@ -235,7 +649,9 @@ extern void write_PNG(char *filename, int interlace, uint32_t width, uint32_t he
 
     png_write_info(png_ptr, info_ptr);
 
-    printf ("Now writing PNG file\n");
+    if (!appData.quiet) {
+        printf ("Now writing PNG file\n");
+    }
 
     png_write_image(png_ptr, row_pointers);
 
@@ -248,49 +664,307 @@ extern void write_PNG(char *filename, int interlace, uint32_t width, uint32_t he
     /*@i2@*/ } /* tell splint to ignore false warning for not
                   released memory of png_ptr and info_ptr */
 
+/*
+ * StartJPEG() sets up cinfo to compress a width x height image to outfile
+ * with the -jpeg* settings, taking rows of the given pixel format.
+ */
+
 static void
-BufferPixelToRGB(uint32_t pixel, uint16_t *r, uint16_t *g, uint16_t *b)
+StartJPEG(struct jpeg_compress_struct *cinfo, struct jpeg_error_mgr *jerr,
+          FILE *outfile, uint32_t width, uint32_t height,
+          J_COLOR_SPACE colorSpace, int components)
 {
-    *r = (uint16_t) ((pixel >> myFormat.redShift) & myFormat.redMax);
-    *b = (uint16_t) ((pixel >> myFormat.blueShift) & myFormat.blueMax);
-    *g = (uint16_t) ((pixel >> myFormat.greenShift) & myFormat.greenMax);
+    cinfo->err = jpeg_std_error(jerr);
+    jpeg_create_compress(cinfo);
+    jpeg_stdio_dest(cinfo, outfile);
+
+    cinfo->image_width = width;
+    cinfo->image_height = height;
+    cinfo->in_color_space = colorSpace;
+    cinfo->input_components = components;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, appData.jpegQuality, TRUE);
+
+    /* Chroma is subsampled through the luma component's sampling factors */
+    cinfo->comp_info[0].h_samp_factor = appData.jpegSubsample == JPEG_SUBSAMPLE_444 ? 1 : 2;
+    cinfo->comp_info[0].v_samp_factor = appData.jpegSubsample == JPEG_SUBSAMPLE_420 ? 2 : 1;
+    if (appData.jpegFastDCT) {
+        cinfo->dct_method = JDCT_IFAST;
+    }
+
+    jpeg_start_compress(cinfo, TRUE);
 }
 
+/*
+ * write_JPEG() writes a packed RGB image to filename as a JPEG file.
+ */
+
 void
-ShrinkBuffer(uint32_t x, uint32_t y, uint32_t req_width, uint32_t req_height)
+write_JPEG(char *filename, uint8_t *image, uint32_t width, uint32_t height)
 {
-    size_t start;
-    size_t stride;
-    size_t row, col;
-    uint8_t *cp;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    FILE *outfile = fopen(filename, "wb");
 
+    if (!outfile) err(1, "couldn't fopen %s", filename);
 
-    /*
-     * Don't bother if x and y are zero and the width is the same.
-     */
-    if (x == 0 && y == 0 && req_width == si.framebufferWidth) {
-        return;
+    StartJPEG(&cinfo, &jerr, outfile, width, height, JCS_RGB, RAW_BYTES_PER_PIXEL);
+    while (cinfo.next_scanline < height) {
+        JSAMPROW row = &image[(size_t)cinfo.next_scanline * width * RAW_BYTES_PER_PIXEL];
+        (void) jpeg_write_scanlines(&cinfo, &row, 1);
     }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    (void) fclose(outfile);
+}
 
-    /*
-     * Rather than creating a copy, we just move in-place. Since we are
-     * doing this from the start of the image, there is no problem
-     * with overlapping moves.
-     */
+/*
+ * WriteScreenJPEG() writes a rectangle of the frame buffer to filename as a
+ * JPEG file, handing libjpeg the frame buffer's own rows rather than a
+ * packed copy. If rowsReady is not NULL, it is called before a row is
+ * read and may wait for the row to be drawn; it returns how many rows of
+ * the rectangle may be read, or 0 to stop encoding, leaving the file
+ * incomplete.
+ */
 
-    stride = (size_t)(si.framebufferWidth * RAW_BYTES_PER_PIXEL - (int32_t)req_width * RAW_BYTES_PER_PIXEL);
-    start = (x + y * si.framebufferWidth) * RAW_BYTES_PER_PIXEL;
+bool
+WriteScreenJPEG(Session *s, const char *filename, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                uint32_t (*rowsReady)(Session *s, uint32_t row))
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    J_COLOR_SPACE colorSpace = JCS_RGB;
+    int components = RAW_BYTES_PER_PIXEL;
+    uint8_t *packed = NULL;
+    bool complete = true;
+    FILE *outfile;
+
+    assert(s->si.framebufferWidth >= x + w && s->si.framebufferHeight >= y + h);
+
+    if (s->bytesPerPixel == MY_BYTES_PER_PIXEL) {
+#ifdef JCS_EXTENSIONS
+        /* libjpeg-turbo reads the 32-bit pixels as they are */
+        colorSpace = JCS_EXT_RGBX;
+        components = MY_BYTES_PER_PIXEL;
+#else
+        packed = malloc((size_t)w * RAW_BYTES_PER_PIXEL);
+        if (packed == NULL) errx(1, "couldn't allocate JPEG row");
+#endif
+    }
 
+    outfile = fopen(filename, "wb");
+    if (!outfile) err(1, "couldn't fopen %s", filename);
 
-    cp = rawBuffer;
+    StartJPEG(&cinfo, &jerr, outfile, w, h, colorSpace, components);
+    while (cinfo.next_scanline < h) {
+        JSAMPROW row;
 
-    for (row = 0; row < req_height; row++) {
-        for (col = 0; col < req_width; col++) {
-            *cp++ = rawBuffer[start++];
-            *cp++ = rawBuffer[start++];
-            *cp++ = rawBuffer[start++];
+        if (rowsReady != NULL && rowsReady(s, cinfo.next_scanline) <= cinfo.next_scanline) {
+            complete = false;
+            break;
+        }
+        row = &s->frameBuffer[((size_t)(y + cinfo.next_scanline) * s->si.framebufferWidth + x) *
+                         s->bytesPerPixel];
+        if (packed != NULL) {
+            PackRGBX(packed, row, w);
+            row = packed;
         }
-        start += stride;
+        (void) jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    if (complete) {
+        jpeg_finish_compress(&cinfo);
+    }
+    jpeg_destroy_compress(&cinfo);
+    (void) fclose(outfile);
+    free(packed);
+    return complete;
+}
+
+/*
+ * ImageHeader() formats the PPM header of a width x height image, or with
+ * 4 bytes per pixel a PAM header, into header and returns its length. If
+ * align is not 0, the header is padded with a comment to a multiple of it.
+ */
+
+static size_t
+ImageHeader(char *header, size_t size, uint32_t width, uint32_t height,
+            size_t bytesPerPixel, size_t align)
+{
+    size_t len, pad = 0;
+
+    if (bytesPerPixel == RAW_BYTES_PER_PIXEL) {
+        len = (size_t) snprintf(header, size, "P6\n%" PRIu32 " %" PRIu32 "\n255\n",
+                                width, height);
+    } else {
+        /* The fourth byte of each pixel is padding, whatever the server sent */
+        len = (size_t) snprintf(header, size,
+                                "P7\nWIDTH %" PRIu32 "\nHEIGHT %" PRIu32 "\nDEPTH 4\n"
+                                "MAXVAL 255\nTUPLTYPE RGBX\nENDHDR\n", width, height);
     }
+    if (align > 0) {
+        /* A comment line after the magic number: '#', spaces and '\n' */
+        pad = (len + 2 + align - 1) / align * align - len;
+        assert(len + pad <= size);
+        memmove(header + 3 + pad, header + 3, len - 3);
+        header[3] = '#';
+        memset(header + 4, ' ', pad - 2);
+        header[3 + pad - 1] = '\n';
+    }
+    return len + pad;
+}
 
+/*
+ * MapBufferFile() makes filename hold an image of the frame buffer, a PPM
+ * file or with -rgbx a PAM file, and maps it into memory. It returns the
+ * start of the image's pixels, to be used as the frame buffer, so that
+ * other programs can read the screen from the file as it is drawn.
+ */
+
+static uint8_t *
+MapBufferFile(Session *s, const char *filename, size_t bytes)
+{
+    char header[IMAGE_HEADER_SIZE];
+    size_t headerLen = ImageHeader(header, sizeof(header), s->si.framebufferWidth,
+                                   s->si.framebufferHeight, s->bytesPerPixel,
+                                   BUFFER_FILE_ALIGN);
+    uint8_t *map;
+    int fd;
+
+    fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Cannot open %s: %s\n", programName, filename, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)(headerLen + bytes)) != 0) {
+        fprintf(stderr, "%s: Cannot resize %s: %s\n", programName, filename, strerror(errno));
+        (void) close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, headerLen + bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    (void) close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: Cannot map %s: %s\n", programName, filename, strerror(errno));
+        return NULL;
+    }
+    memcpy(map, header, headerLen);
+    s->bufferMap = map;
+    s->bufferMapSize = headerLen + bytes;
+    return map + headerLen;
+}
+
+/*
+ * write_PPM() writes a packed RGB image to filename as a PPM file, in a
+ * single system call.
+ */
+
+void
+write_PPM(char *filename, uint8_t *image, uint32_t width, uint32_t height)
+{
+    char header[IMAGE_HEADER_SIZE];
+    struct iovec iov[2];
+    size_t len;
+    ssize_t written;
+    int fd;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = ImageHeader(header, sizeof(header), width, height, RAW_BYTES_PER_PIXEL, 0);
+    iov[1].iov_base = image;
+    iov[1].iov_len = (size_t)width * height * RAW_BYTES_PER_PIXEL;
+    len = iov[0].iov_len + iov[1].iov_len;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) err(1, "couldn't open %s", filename);
+    written = writev(fd, iov, 2);
+    if (written < 0) err(1, "couldn't write %s", filename);
+    if ((size_t)written < len) {
+        /* Only on a full disk or the like; finish the job the slow way */
+        size_t done = (size_t)written;
+        if (done < iov[0].iov_len) {
+            WriteAll(fd, header + done, iov[0].iov_len - done, (off_t)done, filename);
+            done = iov[0].iov_len;
+        }
+        WriteAll(fd, image + (done - iov[0].iov_len), len - done, (off_t)done, filename);
+    }
+    (void) close(fd);
+}
+
+/*
+ * WriteScreenPPM() writes a rectangle of the frame buffer to filename as a
+ * PPM file. Rows are written straight from the frame buffer unless it has
+ * to be packed, and a rectangle the full width of the screen in a packed
+ * frame buffer is contiguous, so written in one pwrite(). If rowsReady is
+ * not NULL, it is called as for WriteScreenJPEG(), and each group of rows
+ * is written as soon as it is ready.
+ */
+
+bool
+WriteScreenPPM(Session *s, const char *filename, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+               uint32_t (*rowsReady)(Session *s, uint32_t row))
+{
+    char header[IMAGE_HEADER_SIZE];
+    size_t headerLen = ImageHeader(header, sizeof(header), w, h, RAW_BYTES_PER_PIXEL, 0);
+    size_t rowBytes = (size_t)w * RAW_BYTES_PER_PIXEL;
+    bool contiguous = s->bytesPerPixel == RAW_BYTES_PER_PIXEL && w == s->si.framebufferWidth;
+    uint8_t *packed = NULL;
+    uint32_t row = 0, ready;
+    int fd;
+
+    assert(s->si.framebufferWidth >= x + w && s->si.framebufferHeight >= y + h);
+
+    if (s->bytesPerPixel == MY_BYTES_PER_PIXEL) {
+        packed = malloc(rowBytes);
+        if (packed == NULL) errx(1, "couldn't allocate PPM row");
+    }
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) err(1, "couldn't open %s", filename);
+    WriteAll(fd, header, headerLen, 0, filename);
+
+    while (row < h) {
+        ready = rowsReady != NULL ? rowsReady(s, row) : h;
+        if (ready <= row) {
+            break;
+        }
+        if (contiguous) {
+            WriteAll(fd, &s->frameBuffer[(size_t)(y + row) * rowBytes], (ready - row) * rowBytes,
+                     (off_t)(headerLen + row * rowBytes), filename);
+            row = ready;
+            continue;
+        }
+        for (; row < ready; row++) {
+            uint8_t *line = &s->frameBuffer[((size_t)(y + row) * s->si.framebufferWidth + x) *
+                                       s->bytesPerPixel];
+            if (packed != NULL) {
+                PackRGBX(packed, line, w);
+                line = packed;
+            }
+            WriteAll(fd, line, rowBytes, (off_t)(headerLen + row * rowBytes), filename);
+        }
+    }
+
+    (void) close(fd);
+    free(packed);
+    return row == h;
+}
+
+static void
+WriteAll(int fd, const void *data, size_t len, off_t offset, const char *filename)
+{
+    const uint8_t *p = data;
+
+    while (len > 0) {
+        ssize_t written = pwrite(fd, p, len, offset);
+        if (written <= 0) err(1, "couldn't write %s", filename);
+        p += written;
+        len -= (size_t)written;
+        offset += written;
+    }
+}
+
+static void
+BufferPixelToRGB(Session *s, uint32_t pixel, uint16_t *r, uint16_t *g, uint16_t *b)
+{
+    *r = (uint16_t) ((pixel >> s->format.redShift) & s->format.redMax);
+    *b = (uint16_t) ((pixel >> s->format.blueShift) & s->format.blueMax);
+    *g = (uint16_t) ((pixel >> s->format.greenShift) & s->format.greenMax);
 }
@@ -32,25 +32,29 @@
 #define OPER_RESTORE  1
 
 #define RGB24_TO_PIXEL(bpp,r,g,b)                                       \
-   ((((uint##bpp##_t)(r) & 0xFF) * myFormat.redMax + 127) / 255             \
-    << myFormat.redShift |                                              \
-    (((uint##bpp##_t)(g) & 0xFF) * myFormat.greenMax + 127) / 255           \
-    << myFormat.greenShift |                                            \
-    (((uint##bpp##_t)(b) & 0xFF) * myFormat.blueMax + 127) / 255            \
-    << myFormat.blueShift)
-
-
-static bool prevSoftCursorSet = false;
-static uint8_t *rcSavedArea, *rcSource, *rcMask;
-static int rcHotX, rcHotY, rcWidth, rcHeight;
-static int rcCursorX = 0, rcCursorY = 0;
-static int rcLockX, rcLockY, rcLockWidth, rcLockHeight;
-static bool rcCursorHidden, rcLockSet;
-
-static bool SoftCursorInLockedArea(void);
-static void SoftCursorCopyArea(int oper);
-static void SoftCursorDraw(void);
-static void FreeSoftCursor(void);
+   ((((uint##bpp##_t)(r) & 0xFF) * s->format.redMax + 127) / 255        \
+    << s->format.redShift |                                             \
+    (((uint##bpp##_t)(g) & 0xFF) * s->format.greenMax + 127) / 255      \
+    << s->format.greenShift |                                           \
+    (((uint##bpp##_t)(b) & 0xFF) * s->format.blueMax + 127) / 255       \
+    << s->format.blueShift)
+
+
+/* A session's cursor: its shape, where it is and what is under it. */
+struct SoftCursor {
+  bool shapeSet;
+  uint8_t *savedArea, *source, *mask;
+  int hotX, hotY, width, height;
+  int cursorX, cursorY;
+  int lockX, lockY, lockWidth, lockHeight;
+  bool cursorHidden, lockSet;
+};
+
+static struct SoftCursor *GetSoftCursor(Session *s);
+static bool SoftCursorInLockedArea(struct SoftCursor *rc);
+static void SoftCursorCopyArea(Session *s, int oper);
+static void SoftCursorDraw(Session *s);
+static void ForgetCursorShape(Session *s);
 
 
 /*********************************************************************
@@ -59,8 +63,9 @@ static void FreeSoftCursor(void);
  * why we call it "software cursor").
  ********************************************************************/
 
-bool HandleCursorShape(int xhot, int yhot, int width, int height, uint32_t enc)
+bool HandleCursorShape(Session *s, int xhot, int yhot, int width, int height, uint32_t enc)
 {
+  struct SoftCursor *rc;
   int bytesPerPixel;
   size_t bytesPerRow, bytesMaskData;
 /*  Drawable dr;*/
@@ -70,25 +75,29 @@ bool HandleCursorShape(int xhot, int yhot, int width, int height, uint32_t enc)
   assert(height >= 0);
   assert(SIZE_MAX / (size_t) width >= (size_t) height);  /* Overflow check for safety since we malloc this */
 
-  bytesPerPixel = myFormat.bitsPerPixel / 8;
+  bytesPerPixel = s->format.bitsPerPixel / 8;
   bytesPerRow = (size_t) ((width + 7) / 8);
   bytesMaskData = bytesPerRow * (size_t) height;
 /*  dr = DefaultRootWindow(dpy);*/
 
-  FreeSoftCursor();
+  ForgetCursorShape(s);
 
   if (width * height == 0)
     return true;
 
+  rc = GetSoftCursor(s);
+  if (rc == NULL)
+    return false;
+
   /* Allocate memory for pixel data and temporary mask data. */
 
-  rcSource = malloc((size_t) (width * height * bytesPerPixel));
-  if (rcSource == NULL)
+  rc->source = malloc((size_t) (width * height * bytesPerPixel));
+  if (rc->source == NULL)
     return false;
 
   uint8_t *buf = malloc(bytesMaskData);
   if (buf == NULL) {
-    free(rcSource);
+    free(rc->source);
     return false;
   }
 
@@ -97,8 +106,8 @@ bool HandleCursorShape(int xhot, int yhot, int width, int height, uint32_t enc)
   if (enc == rfbEncodingXCursor) {
 
     /* Read and convert background and foreground colors. */
-    if (!ReadFromRFBServer((uint8_t *)&rgb, sz_rfbXCursorColors)) {
-      free(rcSource);
+    if (!ReadFromRFBServer(s, (uint8_t *)&rgb, sz_rfbXCursorColors)) {
+      free(rc->source);
       free(buf);
       return false;
     }
@@ -108,14 +117,14 @@ bool HandleCursorShape(int xhot, int yhot, int width, int height, uint32_t enc)
     };
 
     /* Read 1bpp pixel data into a temporary buffer. */
-    if (!ReadFromRFBServer(buf, bytesMaskData)) {
-      free(rcSource);
+    if (!ReadFromRFBServer(s, buf, bytesMaskData)) {
+      free(rc->source);
       free(buf);
       return false;
     }
 
     /* Convert 1bpp data to byte-wide color indices. */
-    uint8_t *ptr = rcSource;
+    uint8_t *ptr = rc->source;
     for (size_t y = 0; y < (size_t) height; y++) {
       size_t x;
       for (x = 0; x < (size_t) width / 8; x++) {
@@ -134,22 +143,22 @@ bool HandleCursorShape(int xhot, int yhot, int width, int height, uint32_t enc)
     switch (bytesPerPixel) {
     case 1:
       for (size_t x = 0; x < (size_t)(width * height); x++)
-        rcSource[x] = (uint8_t) colors[rcSource[x]];
+        rc->source[x] = (uint8_t) colors[rc->source[x]];
       break;
     case 2:
       for (size_t x = 0; x < (size_t)(width * height); x++)
-        ((uint16_t *)rcSource)[x] = (uint16_t) colors[rcSource[x * 2]];
+        ((uint16_t *)rc->source)[x] = (uint16_t) colors[rc->source[x * 2]];
       break;
     case 4:
       for (size_t x = 0; x < (size_t)(width * height); x++)
-        ((uint32_t *)rcSource)[x] = colors[rcSource[x * 4]];
+        ((uint32_t *)rc->source)[x] = colors[rc->source[x * 4]];
       break;
     }
 
   } else {                      /* enc == rfbEncodingRichCursor */
 
-    if (!ReadFromRFBServer((uint8_t *)rcSource, (size_t)(width * height * bytesPerPixel))) {
-      free(rcSource);
+    if (!ReadFromRFBServer(s, (uint8_t *)rc->source, (size_t)(width * height * bytesPerPixel))) {
+      free(rc->source);
       free(buf);
       return false;
     }
@@ -158,21 +167,21 @@ bool HandleCursorShape(int xhot, int yhot, int width, int height, uint32_t enc)
 
   /* Read and decode mask data. */
 
-  if (!ReadFromRFBServer(buf, bytesMaskData)) {
-    free(rcSource);
+  if (!ReadFromRFBServer(s, buf, bytesMaskData)) {
+    free(rc->source);
     free(buf);
     return false;
   }
 
   // Overflow checked earlier in the function
-  rcMask = malloc((size_t)(width * height));
-  if (rcMask == NULL) {
-    free(rcSource);
+  rc->mask = malloc((size_t)(width * height));
+  if (rc->mask == NULL) {
+    free(rc->source);
     free(buf);
     return false;
   }
 
-  uint8_t *ptr = rcMask;
+  uint8_t *ptr = rc->mask;
   for (size_t y = 0; y < (size_t)height; y++) {
     size_t x;
     for (x = 0; x < (size_t)width / 8; x++) {
@@ -190,19 +199,19 @@ bool HandleCursorShape(int xhot, int yhot, int width, int height, uint32_t enc)
   /* Set remaining data associated with cursor. */
 
 /*  dr = DefaultRootWindow(dpy);
-  rcSavedArea = XCreatePixmap(dpy, dr, width, height, visdepth);*/
-  rcHotX = xhot;
-  rcHotY = yhot;
-  rcWidth = width;
-  rcHeight = height;
+  rc->savedArea = XCreatePixmap(dpy, dr, width, height, visdepth);*/
+  rc->hotX = xhot;
+  rc->hotY = yhot;
+  rc->width = width;
+  rc->height = height;
   /* Do not draw. Only draw when we have the position. */
-  SoftCursorCopyArea(OPER_SAVE);
-  /*SoftCursorDraw();*/
+  SoftCursorCopyArea(s, OPER_SAVE);
+  /*SoftCursorDraw(s);*/
 
-  rcCursorHidden = false;
-  rcLockSet = false;
+  rc->cursorHidden = false;
+  rc->lockSet = false;
 
-  prevSoftCursorSet = true;
+  rc->shapeSet = true;
   return true;
 }
 
@@ -212,15 +221,15 @@ bool HandleCursorShape(int xhot, int yhot, int width, int height, uint32_t enc)
  * PointerPos encoding is used together with cursor shape updates.
  ********************************************************************/
 
-bool HandleCursorPos(int x, int y)
+bool HandleCursorPos(Session *s, int x, int y)
 {
 
-  if (x >= si.framebufferWidth)
-    x = si.framebufferWidth - 1;
-  if (y >= si.framebufferHeight)
-    y = si.framebufferHeight - 1;
+  if (x >= s->si.framebufferWidth)
+    x = s->si.framebufferWidth - 1;
+  if (y >= s->si.framebufferHeight)
+    y = s->si.framebufferHeight - 1;
 
-  SoftCursorMove(x, y);
+  SoftCursorMove(s, x, y);
   return true;
 }
 
@@ -233,37 +242,38 @@ bool HandleCursorPos(int x, int y)
  * previous locks remain active.
  ********************************************************************/
 
-void SoftCursorLockArea(int x, int y, int w, int h)
+void SoftCursorLockArea(Session *s, int x, int y, int w, int h)
 {
+  struct SoftCursor *rc = s->cursor;
   int newX, newY;
 
-  if (!BufferWritten()) {
+  if (!BufferWritten(s)) {
       return;    /* no cursor to hide */
   }
 
-  if (!prevSoftCursorSet)
+  if (rc == NULL || !rc->shapeSet)
     return;
 
-  if (!rcLockSet) {
-    rcLockX = x;
-    rcLockY = y;
-    rcLockWidth = w;
-    rcLockHeight = h;
-    rcLockSet = true;
+  if (!rc->lockSet) {
+    rc->lockX = x;
+    rc->lockY = y;
+    rc->lockWidth = w;
+    rc->lockHeight = h;
+    rc->lockSet = true;
   } else {
-    newX = (x < rcLockX) ? x : rcLockX;
-    newY = (y < rcLockY) ? y : rcLockY;
-    rcLockWidth = (x + w > rcLockX + rcLockWidth) ?
-      (x + w - newX) : (rcLockX + rcLockWidth - newX);
-    rcLockHeight = (y + h > rcLockY + rcLockHeight) ?
-      (y + h - newY) : (rcLockY + rcLockHeight - newY);
-    rcLockX = newX;
-    rcLockY = newY;
+    newX = (x < rc->lockX) ? x : rc->lockX;
+    newY = (y < rc->lockY) ? y : rc->lockY;
+    rc->lockWidth = (x + w > rc->lockX + rc->lockWidth) ?
+      (x + w - newX) : (rc->lockX + rc->lockWidth - newX);
+    rc->lockHeight = (y + h > rc->lockY + rc->lockHeight) ?
+      (y + h - newY) : (rc->lockY + rc->lockHeight - newY);
+    rc->lockX = newX;
+    rc->lockY = newY;
   }
 
-  if (!rcCursorHidden && SoftCursorInLockedArea()) {
-    SoftCursorCopyArea(OPER_RESTORE);
-    rcCursorHidden = true;
+  if (!rc->cursorHidden && SoftCursorInLockedArea(rc)) {
+    SoftCursorCopyArea(s, OPER_RESTORE);
+    rc->cursorHidden = true;
   }
 }
 
@@ -272,19 +282,21 @@ void SoftCursorLockArea(int x, int y, int w, int h)
  * performed since previous SoftCursorUnlockScreen() call.
  ********************************************************************/
 
-void SoftCursorUnlockScreen(void)
+void SoftCursorUnlockScreen(Session *s)
 {
-  if (!prevSoftCursorSet)
+  struct SoftCursor *rc = s->cursor;
+
+  if (rc == NULL || !rc->shapeSet)
     return;
 
-  if (rcCursorHidden) {
-    SoftCursorCopyArea(OPER_SAVE);
+  if (rc->cursorHidden) {
+    SoftCursorCopyArea(s, OPER_SAVE);
     if (appData.useRemoteCursor == 1) {
-    SoftCursorDraw();
+    SoftCursorDraw(s);
     }
-    rcCursorHidden = false;
+    rc->cursorHidden = false;
   }
-  rcLockSet = false;
+  rc->lockSet = false;
 }
 
 /*********************************************************************
@@ -294,22 +306,47 @@ void SoftCursorUnlockScreen(void)
  * SoftCursorUnlock() functions is called.
  ********************************************************************/
 
-void SoftCursorMove(int x, int y)
+void SoftCursorMove(Session *s, int x, int y)
 {
-  if (prevSoftCursorSet && !rcCursorHidden) {
-    SoftCursorCopyArea(OPER_RESTORE);
-    rcCursorHidden = true;
+  struct SoftCursor *rc = GetSoftCursor(s);
+
+  if (rc == NULL)
+    return;
+
+  if (rc->shapeSet && !rc->cursorHidden) {
+    SoftCursorCopyArea(s, OPER_RESTORE);
+    rc->cursorHidden = true;
   }
 
-  rcCursorX = x;
-  rcCursorY = y;
+  rc->cursorX = x;
+  rc->cursorY = y;
 
-  if (prevSoftCursorSet && !(rcLockSet && SoftCursorInLockedArea())) {
-    SoftCursorCopyArea(OPER_SAVE);
+  if (rc->shapeSet && !(rc->lockSet && SoftCursorInLockedArea(rc))) {
+    SoftCursorCopyArea(s, OPER_SAVE);
    if (appData.useRemoteCursor == 1) {
-    SoftCursorDraw();
+    SoftCursorDraw(s);
    }
-    rcCursorHidden = false;
+    rc->cursorHidden = false;
+  }
+}
+
+/*********************************************************************
+ * FreeSoftCursor(). Frees the session's cursor, leaving the frame
+ * buffer as it is.
+ ********************************************************************/
+
+void FreeSoftCursor(Session *s)
+{
+  struct SoftCursor *rc = s->cursor;
+
+  if (rc != NULL) {
+    free(rc->savedArea);
+    if (rc->shapeSet) {
+      free(rc->source);
+      free(rc->mask);
+    }
+    free(rc);
+    s->cursor = NULL;
   }
 }
 
@@ -318,67 +355,69 @@ void SoftCursorMove(int x, int y)
  * Internal (static) low-level functions.
  ********************************************************************/
 
-static bool SoftCursorInLockedArea(void)
+static bool SoftCursorInLockedArea(struct SoftCursor *rc)
 {
-  return (rcLockX < rcCursorX - rcHotX + rcWidth &&
-          rcLockY < rcCursorY - rcHotY + rcHeight &&
-          rcLockX + rcLockWidth > rcCursorX - rcHotX &&
-          rcLockY + rcLockHeight > rcCursorY - rcHotY);
+  return (rc->lockX < rc->cursorX - rc->hotX + rc->width &&
+          rc->lockY < rc->cursorY - rc->hotY + rc->height &&
+          rc->lockX + rc->lockWidth > rc->cursorX - rc->hotX &&
+          rc->lockY + rc->lockHeight > rc->cursorY - rc->hotY);
 }
 
-static void SoftCursorCopyArea(int oper)
+static void SoftCursorCopyArea(Session *s, int oper)
 {
-  int32_t x = rcCursorX - rcHotX;
-  int32_t y = rcCursorY - rcHotY;
-  if (x >= si.framebufferWidth || y >= si.framebufferHeight)
+  struct SoftCursor *rc = s->cursor;
+  int32_t x = rc->cursorX - rc->hotX;
+  int32_t y = rc->cursorY - rc->hotY;
+  if (x >= s->si.framebufferWidth || y >= s->si.framebufferHeight)
     return;
 
-  int32_t w = rcWidth;
-  int32_t h = rcHeight;
+  int32_t w = rc->width;
+  int32_t h = rc->height;
   if (x < 0) {
     w += x;
     x = 0;
-  } else if (x + w > si.framebufferWidth) {
-    w = si.framebufferWidth - x;
+  } else if (x + w > s->si.framebufferWidth) {
+    w = s->si.framebufferWidth - x;
   }
   if (y < 0) {
     h += y;
     y = 0;
-  } else if (y + h > si.framebufferHeight) {
-    h = si.framebufferHeight - y;
+  } else if (y + h > s->si.framebufferHeight) {
+    h = s->si.framebufferHeight - y;
   }
 
   if (oper == OPER_SAVE) {
     /* Save screen area in memory. */
-    if (rcSavedArea != NULL) {
-        free(rcSavedArea);
-        rcSavedArea = NULL;
+    if (rc->savedArea != NULL) {
+        free(rc->savedArea);
+        rc->savedArea = NULL;
     }
-    rcSavedArea = CopyScreenToData((uint32_t)x, (uint32_t)y, (uint32_t)w, (uint32_t)h);
+    rc->savedArea = CopyScreenToData(s, (uint32_t)x, (uint32_t)y, (uint32_t)w, (uint32_t)h);
   } else {
     /* Restore screen area. */
-    CopyDataToScreen(rcSavedArea, (uint32_t)x, (uint32_t)y, (uint32_t)w, (uint32_t)h);
+    CopyDataToScreen(s, rc->savedArea, (uint32_t)x, (uint32_t)y, (uint32_t)w, (uint32_t)h);
   }
 }
 
-static void SoftCursorDraw(void)
+static void SoftCursorDraw(Session *s)
 {
+  struct SoftCursor *rc = s->cursor;
   uint_fast8_t bytesPerPixel;
   uint8_t *pos;
 
-  bytesPerPixel = myFormat.bitsPerPixel / 8;
+  bytesPerPixel = s->format.bitsPerPixel / 8;
 
   /* FIXME: Speed optimization is possible. */
-  for (int32_t y = 0; y < rcHeight; y++) {
-    int32_t y0 = rcCursorY - rcHotY + y;
-    if (y0 >= 0 && y0 < si.framebufferHeight) {
-      for (int32_t x = 0; x < rcWidth; x++) {
-        int32_t x0 = rcCursorX - rcHotX + x;
-        if (x0 >= 0 && x0 < si.framebufferWidth) {
-          size_t offset = (size_t)(y * rcWidth + x);
-          if (rcMask[offset]) {
-            pos = &rcSource[offset * bytesPerPixel];
-            CopyDataToScreen(pos, (uint32_t)x0, (uint32_t)y0, 1, 1);
+  for (int32_t y = 0; y < rc->height; y++) {
+    int32_t y0 = rc->cursorY - rc->hotY + y;
+    if (y0 >= 0 && y0 < s->si.framebufferHeight) {
+      for (int32_t x = 0; x < rc->width; x++) {
+        int32_t x0 = rc->cursorX - rc->hotX + x;
+        if (x0 >= 0 && x0 < s->si.framebufferWidth) {
+          size_t offset = (size_t)(y * rc->width + x);
+          if (rc->mask[offset]) {
+            pos = &rc->source[offset * bytesPerPixel];
+            CopyDataToScreen(s, pos, (uint32_t)x0, (uint32_t)y0, 1, 1);
           }
         }
       }
@@ -386,17 +425,36 @@ static void SoftCursorDraw(void)
   }
 }
 
-static void FreeSoftCursor(void)
+/*
+ * ForgetCursorShape() takes the cursor off the screen and forgets its
+ * shape, keeping its position.
+ */
+
+static void ForgetCursorShape(Session *s)
 {
-  if (prevSoftCursorSet) {
-    SoftCursorCopyArea(OPER_RESTORE);
-    if (rcSavedArea != NULL) {
-        free(rcSavedArea);
-        rcSavedArea = NULL;
+  struct SoftCursor *rc = s->cursor;
+
+  if (rc != NULL && rc->shapeSet) {
+    SoftCursorCopyArea(s, OPER_RESTORE);
+    if (rc->savedArea != NULL) {
+        free(rc->savedArea);
+        rc->savedArea = NULL;
     }
-    free(rcSource);
-    free(rcMask);
-    prevSoftCursorSet = false;
+    free(rc->source);
+    free(rc->mask);
+    rc->shapeSet = false;
   }
 }
 
+/*
+ * GetSoftCursor() returns the session's cursor, allocating it the first
+ * time the server sends its shape or position.
+ */
+
+static struct SoftCursor *GetSoftCursor(Session *s)
+{
+  if (s->cursor == NULL) {
+    s->cursor = calloc(1, sizeof(struct SoftCursor));
+  }
+  return s->cursor;
+}
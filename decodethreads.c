@@ -0,0 +1,429 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * decodethreads.c - decode rectangles on worker threads.
+ *
+ * Some rectangles can be decoded apart from the rest of the update: each
+ * of Tight's four zlib streams depends only on the rectangles sent before
+ * on the same stream, and its JPEG rectangles depend on nothing at all.
+ * Once the thread reading from the server has such a rectangle's data in
+ * memory, it can queue it for a worker thread and read on. ZRLE has only
+ * one stream, but a worker can draw the tiles of a rectangle as the
+ * reading thread inflates them (zrle.cxx).
+ *
+ * A session has a number of queues, each with its own worker threads and
+ * scratch space per worker. A queue with one worker decodes its jobs in
+ * the order they were queued; a queue with none decodes each at once, on
+ * the reading thread. Workers only draw pixels. The reading thread keeps
+ * the damage map, the blank screen check and the streamed snapshot up to
+ * date, reserving a job's rectangle when it is queued and accounting for
+ * what was drawn in FinishDecodeJobs(). It must call that before drawing
+ * anything that overlaps a queued rectangle, and at the end of an update.
+ */
+
+#ifndef WIN32
+#define _XOPEN_SOURCE 600   /* for sysconf() */
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "vncsnapshot.h"
+
+#define MAX_DECODE_QUEUES 8
+
+typedef struct DecodeJob DecodeJob;
+
+struct DecodeJob {
+    DecodeJob *next;            /* in its queue */
+    DecodeJob *nextQueued;      /* in the order queued, on any queue */
+    DecodeFn decode;
+    void *data;                 /* freed once decoded */
+    uint32_t x, y, w, h;
+    bool black;                 /* nothing but black drawn, if checked */
+    bool ok;
+};
+
+typedef struct {
+    struct DecodeQueues *queues;
+    int queue;
+    pthread_t thread;
+    void *scratch;
+} Worker;
+
+typedef struct {
+    DecodeJob *head, *tail;
+    pthread_cond_t jobQueued;
+    Worker *workers;
+    int numWorkers;             /* 0 to decode on the reading thread */
+    void *scratch;              /* for decoding on the reading thread */
+    void (*freeScratch)(void *scratch);
+} DecodeQueue;
+
+struct DecodeQueues {
+    Session *session;
+    pthread_mutex_t lock;
+    pthread_cond_t jobDone;
+    DecodeQueue queues[MAX_DECODE_QUEUES];
+    int numQueues;
+    uint32_t outstanding;       /* queued and not yet decoded */
+    bool stopping;
+
+    /* Only the reading thread follows these */
+    DecodeJob *first, *last;    /* queued since FinishDecodeJobs() */
+    uint32_t rects;             /* of those, the ones drawing anything */
+};
+
+static void *DecodeWorker(void *arg);
+static void FreeScratch(DecodeQueue *q, void *scratch);
+
+
+/*
+ * DecodeThreads() returns the number of threads to decode JPEG rectangles
+ * with, or 1 to decode everything on the reading thread.
+ */
+
+int
+DecodeThreads(void)
+{
+    long cpus;
+
+    if (appData.decodeThreads > 0) {
+        return appData.decodeThreads;
+    }
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int) cpus : 1;
+}
+
+/*
+ * AddDecodeQueue() adds a queue decoded by the given number of worker
+ * threads, or on the reading thread if that is 0, each with scratchSize
+ * bytes of zeroed scratch space. freeScratch, if not NULL, releases what
+ * a decoder keeps in the scratch space before it is freed. It returns the
+ * queue's number, or -1 on failure.
+ */
+
+int
+AddDecodeQueue(Session *s, int threads, size_t scratchSize,
+               void (*freeScratch)(void *scratch))
+{
+    struct DecodeQueues *dq = s->decodeQueues;
+    DecodeQueue *q;
+    int i;
+
+    if (dq == NULL) {
+        dq = calloc(1, sizeof(struct DecodeQueues));
+        if (dq == NULL) {
+            fprintf(stderr, "Failed to allocate memory for decoder threads\n");
+            return -1;
+        }
+        dq->session = s;
+        pthread_mutex_init(&dq->lock, NULL);
+        pthread_cond_init(&dq->jobDone, NULL);
+        s->decodeQueues = dq;
+    }
+    if (dq->numQueues == MAX_DECODE_QUEUES) {
+        fprintf(stderr, "Too many decoder queues\n");
+        return -1;
+    }
+
+    q = &dq->queues[dq->numQueues];
+    pthread_cond_init(&q->jobQueued, NULL);
+    q->freeScratch = freeScratch;
+    if (threads > 0) {
+        q->workers = calloc((size_t) threads, sizeof(Worker));
+        if (q->workers == NULL) {
+            threads = 0;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        Worker *worker = &q->workers[q->numWorkers];
+
+        worker->queues = dq;
+        worker->queue = dq->numQueues;
+        worker->scratch = calloc(1, scratchSize);
+        if (worker->scratch == NULL) {
+            break;
+        }
+        if (pthread_create(&worker->thread, NULL, DecodeWorker, worker) != 0) {
+            free(worker->scratch);
+            break;
+        }
+        q->numWorkers++;
+    }
+
+    /* Without any workers, fall back to decoding on this thread */
+    if (q->numWorkers == 0) {
+        q->scratch = calloc(1, scratchSize);
+        if (q->scratch == NULL) {
+            fprintf(stderr, "Failed to allocate memory for decoder\n");
+            free(q->workers);
+            q->workers = NULL;
+            pthread_cond_destroy(&q->jobQueued);
+            return -1;
+        }
+    }
+    return dq->numQueues++;
+}
+
+/*
+ * DecodeQueueThreaded() tells whether a queue has worker threads, rather
+ * than decoding on the reading thread.
+ */
+
+bool
+DecodeQueueThreaded(Session *s, int queue)
+{
+    return s->decodeQueues->queues[queue].numWorkers > 0;
+}
+
+/*
+ * DispatchDecodeJob() has decode draw data, which it frees, in a rectangle
+ * of the screen; an empty rectangle if it draws nothing. With workers, the
+ * job is queued and true returned; otherwise it is decoded at once and
+ * whether that succeeded returned.
+ */
+
+bool
+DispatchDecodeJob(Session *s, int queue, DecodeFn decode, void *data,
+                  uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    struct DecodeQueues *dq = s->decodeQueues;
+    DecodeQueue *q = &dq->queues[queue];
+    DecodeJob *job;
+    bool black = BufferIsBlank(s);
+    bool ok;
+
+    if (w > 0 && h > 0) {
+        ReserveScreenRectangle(s, x, y, w, h);
+    }
+
+    if (q->numWorkers == 0) {
+        ok = decode(s, data, q->scratch, &black);
+        free(data);
+        ScreenRectanglePainted(s, black);
+        return ok;
+    }
+
+    job = malloc(sizeof(DecodeJob));
+    if (job == NULL) {
+        fprintf(stderr, "Failed to allocate memory for decoder job\n");
+        free(data);
+        return false;
+    }
+    job->next = job->nextQueued = NULL;
+    job->decode = decode;
+    job->data = data;
+    job->x = x;
+    job->y = y;
+    job->w = w;
+    job->h = h;
+    job->black = black;
+    job->ok = false;
+
+    if (dq->last != NULL) {
+        dq->last->nextQueued = job;
+    } else {
+        dq->first = job;
+    }
+    dq->last = job;
+    if (w > 0 && h > 0) {
+        dq->rects++;
+    }
+
+    pthread_mutex_lock(&dq->lock);
+    if (q->tail != NULL) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+    dq->outstanding++;
+    pthread_cond_signal(&q->jobQueued);
+    pthread_mutex_unlock(&dq->lock);
+    return true;
+}
+
+/*
+ * DecodeJobsOverlap() tells whether a rectangle overlaps any queued since
+ * the last FinishDecodeJobs().
+ */
+
+bool
+DecodeJobsOverlap(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    struct DecodeQueues *dq = s->decodeQueues;
+    DecodeJob *job;
+
+    if (dq == NULL) {
+        return false;
+    }
+    for (job = dq->first; job != NULL; job = job->nextQueued) {
+        if (x < job->x + job->w && job->x < x + w &&
+            y < job->y + job->h && job->y < y + h) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * DecodeJobsQueued() returns the number of rectangles queued to be drawn
+ * since the last FinishDecodeJobs().
+ */
+
+uint32_t
+DecodeJobsQueued(Session *s)
+{
+    return s->decodeQueues != NULL ? s->decodeQueues->rects : 0;
+}
+
+/*
+ * FinishDecodeJobs() waits for every queued job to be decoded, and then
+ * accounts for what each one drew. It returns false if any failed.
+ */
+
+bool
+FinishDecodeJobs(Session *s)
+{
+    struct DecodeQueues *dq = s->decodeQueues;
+    DecodeJob *job;
+    bool ok = true;
+
+    if (dq == NULL || dq->first == NULL) {
+        return true;
+    }
+
+    pthread_mutex_lock(&dq->lock);
+    while (dq->outstanding > 0) {
+        pthread_cond_wait(&dq->jobDone, &dq->lock);
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    while ((job = dq->first) != NULL) {
+        dq->first = job->nextQueued;
+        if (!job->ok) {
+            ok = false;
+        } else if (job->w > 0 && job->h > 0) {
+            ScreenRectanglePainted(s, job->black);
+            StreamRectDecoded(s, job->x, job->y, job->w, job->h);
+        }
+        free(job);
+    }
+    dq->last = NULL;
+    dq->rects = 0;
+    return ok;
+}
+
+/*
+ * StopDecodeThreads() stops a session's worker threads, dropping any jobs
+ * not yet decoded, and frees its queues.
+ */
+
+void
+StopDecodeThreads(Session *s)
+{
+    struct DecodeQueues *dq = s->decodeQueues;
+    DecodeJob *job;
+    int i, j;
+
+    if (dq == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&dq->lock);
+    dq->stopping = true;
+    for (i = 0; i < dq->numQueues; i++) {
+        pthread_cond_broadcast(&dq->queues[i].jobQueued);
+    }
+    pthread_mutex_unlock(&dq->lock);
+
+    for (i = 0; i < dq->numQueues; i++) {
+        DecodeQueue *q = &dq->queues[i];
+
+        for (j = 0; j < q->numWorkers; j++) {
+            pthread_join(q->workers[j].thread, NULL);
+            FreeScratch(q, q->workers[j].scratch);
+        }
+        FreeScratch(q, q->scratch);
+        free(q->workers);
+        pthread_cond_destroy(&q->jobQueued);
+    }
+
+    while ((job = dq->first) != NULL) {
+        dq->first = job->nextQueued;
+        free(job->data);
+        free(job);
+    }
+    pthread_cond_destroy(&dq->jobDone);
+    pthread_mutex_destroy(&dq->lock);
+    free(dq);
+    s->decodeQueues = NULL;
+}
+
+static void
+FreeScratch(DecodeQueue *q, void *scratch)
+{
+    if (scratch != NULL && q->freeScratch != NULL) {
+        q->freeScratch(scratch);
+    }
+    free(scratch);
+}
+
+/*
+ * DecodeWorker() is a worker thread, decoding jobs from its queue until
+ * the session's threads are stopped.
+ */
+
+static void *
+DecodeWorker(void *arg)
+{
+    Worker *worker = arg;
+    struct DecodeQueues *dq = worker->queues;
+    DecodeQueue *q = &dq->queues[worker->queue];
+    DecodeJob *job;
+
+    pthread_mutex_lock(&dq->lock);
+    for (;;) {
+        while (q->head == NULL && !dq->stopping) {
+            pthread_cond_wait(&q->jobQueued, &dq->lock);
+        }
+        if (dq->stopping) {
+            break;
+        }
+        job = q->head;
+        q->head = job->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        pthread_mutex_unlock(&dq->lock);
+
+        job->ok = job->decode(dq->session, job->data, worker->scratch, &job->black);
+        free(job->data);
+        job->data = NULL;
+
+        pthread_mutex_lock(&dq->lock);
+        if (--dq->outstanding == 0) {
+            pthread_cond_broadcast(&dq->jobDone);
+        }
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return NULL;
+}
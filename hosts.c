@@ -0,0 +1,239 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * hosts.c - capture many servers from one command.
+ *
+ * With -hosts, the servers to capture are read from a file, one per line
+ * followed by the file to save it in, and up to -parallel of them are
+ * captured at a time. Each capture is a Session of its own, run by a
+ * thread of this process once the options have been parsed, so a long
+ * list costs one program start, and the number of connections open at
+ * once is capped.
+ */
+
+#ifndef WIN32
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "vncsnapshot.h"
+
+#define MAX_HOST_LINE 1024
+
+typedef struct {
+    bool running;           /* false if the slot is free */
+    bool finished;          /* the thread is done and may be joined */
+    int status;             /* its exit status, once finished */
+    pthread_t thread;
+    char *server;
+    char *filename;
+} Capture;
+
+static pthread_mutex_t captureLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t captureFinished = PTHREAD_COND_INITIALIZER;
+
+static void *CaptureThread(void *arg);
+static int CaptureHost(const char *server, const char *filename);
+static bool ParseHostLine(char *line, char **server, char **filename);
+
+
+/*
+ * RunHostList() captures each server listed in appData.hostsFile, and
+ * returns once every capture has finished, with the program's exit status:
+ * 0 if all of them succeeded.
+ */
+
+int
+RunHostList(void)
+{
+    FILE *list = fopen(appData.hostsFile, "r");
+    Capture *captures = calloc((size_t) appData.parallel, sizeof(Capture));
+    char line[MAX_HOST_LINE];
+    char *server, *filename;
+    int running = 0, listed = 0, captured = 0, lineNumber = 0, i;
+    bool more = true;
+
+    if (list == NULL) {
+        fprintf(stderr, "%s: Cannot open %s: %s\n", programName, appData.hostsFile,
+                strerror(errno));
+        return 1;
+    }
+    if (captures == NULL) {
+        fprintf(stderr, "Failed to allocate memory for captures\n");
+        return 1;
+    }
+
+    pthread_mutex_lock(&captureLock);
+    while (more || running > 0) {
+        /* Start captures until the list ends or the limit is reached */
+        while (more && running < appData.parallel) {
+            if (fgets(line, sizeof(line), list) == NULL) {
+                more = false;
+                break;
+            }
+            lineNumber++;
+            if (!ParseHostLine(line, &server, &filename)) {
+                fprintf(stderr, "%s: %s:%d: expected a server and a filename\n",
+                        programName, appData.hostsFile, lineNumber);
+                listed++;
+                continue;
+            }
+            if (server == NULL) {
+                continue;       /* blank or comment */
+            }
+            listed++;
+
+            for (i = 0; captures[i].running; i++)
+                ;
+            captures[i].server = strdup(server);
+            captures[i].filename = strdup(filename);
+            captures[i].finished = false;
+            if (captures[i].server == NULL || captures[i].filename == NULL ||
+                pthread_create(&captures[i].thread, NULL, CaptureThread, &captures[i]) != 0) {
+                fprintf(stderr, "%s: Cannot start capture of %s\n", programName, server);
+                free(captures[i].server);
+                free(captures[i].filename);
+                continue;
+            }
+            captures[i].running = true;
+            running++;
+        }
+
+        /* Wait for one to finish */
+        if (running > 0) {
+            for (i = 0; i < appData.parallel && !(captures[i].running && captures[i].finished);
+                 i++)
+                ;
+            if (i == appData.parallel) {
+                pthread_cond_wait(&captureFinished, &captureLock);
+                continue;
+            }
+            pthread_join(captures[i].thread, NULL);
+            if (captures[i].status == 0) {
+                captured++;
+            } else {
+                fprintf(stderr, "%s: capture of %s failed\n", programName, captures[i].server);
+            }
+            free(captures[i].server);
+            free(captures[i].filename);
+            captures[i].running = false;
+            running--;
+        }
+    }
+    pthread_mutex_unlock(&captureLock);
+
+    fclose(list);
+    free(captures);
+    if (!appData.quiet) {
+        fprintf(stderr, "%d of %d servers captured\n", captured, listed);
+    }
+    return captured == listed ? 0 : 1;
+}
+
+static void *
+CaptureThread(void *arg)
+{
+    Capture *capture = arg;
+    int status = CaptureHost(capture->server, capture->filename);
+
+    pthread_mutex_lock(&captureLock);
+    capture->status = status;
+    capture->finished = true;
+    pthread_cond_signal(&captureFinished);
+    pthread_mutex_unlock(&captureLock);
+    return NULL;
+}
+
+/*
+ * CaptureHost() connects to a server and captures it to filename, as if
+ * they had been given on the command line. It returns the exit status that
+ * would give.
+ */
+
+static int
+CaptureHost(const char *server, const char *filename)
+{
+    char host[MAX_SERVER_HOST];
+    uint16_t port;
+    Session *s;
+
+    if (!ParseServerName(server, host, &port)) {
+        fprintf(stderr, "%s: invalid server name %s\n", programName, server);
+        return 1;
+    }
+    s = NewSession();
+    if (s == NULL) {
+        fprintf(stderr, "Failed to allocate memory for session\n");
+        return 1;
+    }
+    s->serverName = server;
+    if (!ConnectToRFBServer(s, host, port) || !InitialiseRFBConnection(s)) {
+        FreeSession(s);
+        return 1;
+    }
+    return CaptureScreen(s, filename);
+}
+
+/*
+ * ParseHostLine() splits a line of the host list into the server and the
+ * filename, in place. A blank line or a comment, starting with '#', gives
+ * a NULL server. It returns false if the line is malformed.
+ */
+
+static bool
+ParseHostLine(char *line, char **server, char **filename)
+{
+    char *p = line;
+
+    *server = *filename = NULL;
+    if (strchr(line, '\n') == NULL && strlen(line) == MAX_HOST_LINE - 1) {
+        return false;       /* too long */
+    }
+    while (isspace((unsigned char) *p)) {
+        p++;
+    }
+    if (*p == '\0' || *p == '#') {
+        return true;
+    }
+
+    *server = p;
+    while (*p != '\0' && !isspace((unsigned char) *p)) {
+        p++;
+    }
+    if (*p != '\0') {
+        *p++ = '\0';
+    }
+    while (isspace((unsigned char) *p)) {
+        p++;
+    }
+    *filename = p;
+    while (*p != '\0' && !isspace((unsigned char) *p)) {
+        p++;
+    }
+    if (*p != '\0') {
+        *p++ = '\0';
+    }
+    while (isspace((unsigned char) *p)) {
+        p++;
+    }
+    return **filename != '\0' && *p == '\0';
+}
@@ -47,6 +47,7 @@ typedef int SOCKET;
 
 bool listenSpecified = false;
 uint16_t listenPort = 0, flashPort = 0;
+int acceptedSock = -1;          /* the server that connected to us */
 
 
 
@@ -114,8 +115,8 @@ listenForIncomingConnections(int *argc, char **argv, int listenArgIndex)
     }
 
     if (FD_ISSET(listenSocket, &fds)) {
-      rfbsock = AcceptTcpConnection(listenSocket);
-      if (rfbsock < 0) exit(1);
+      acceptedSock = AcceptTcpConnection(listenSocket);
+      if (acceptedSock < 0) exit(1);
 
       /* Unlike a standard VNC client, we don't continue to listen. */
       /* Return to caller. */
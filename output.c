@@ -0,0 +1,607 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * output.c - save snapshots in the background.
+ *
+ * Encoding a snapshot takes far longer than receiving an incremental
+ * update, so rather than leave the connection idle while an image is
+ * compressed, the requested rectangle is copied out of the frame buffer
+ * into one of a fixed number of snapshot buffers and queued for a pool of
+ * writer threads. The main thread can then request and decode the next
+ * update into the frame buffer while earlier snapshots are still being
+ * encoded. When every buffer is in use, queueing a snapshot blocks until a
+ * writer frees one, which in turn holds off further update requests.
+ *
+ * With -unchanged, a hash of each tile of the captured rectangle is kept
+ * from the last snapshot written, and tiles drawn in since are hashed
+ * again to see whether their contents really changed. If too little of
+ * the screen has, the snapshot is skipped or linked to the last one
+ * written instead of being encoded again.
+ */
+
+#ifndef WIN32
+#define _XOPEN_SOURCE 600   /* for strdup(), symlink() */
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "vncsnapshot.h"
+
+typedef struct {
+    char *filename;
+    uint32_t x, y;
+    uint32_t width, height;
+    uint16_t screenWidth, screenHeight;
+    uint8_t *image;     /* packed RGB copy of the rectangle */
+    uint32_t changedTiles, tiles;   /* damage since the previous snapshot */
+    bool busy;          /* queued or being written */
+    char **links;       /* hard links to make once the file is written */
+    int numLinks;
+} Snapshot;
+
+/* A session's snapshots and the threads writing them */
+struct Output {
+    Session *session;       /* whose snapshots these are */
+
+    Snapshot *snapshots;
+    int numSnapshots;
+
+    /* Indices of snapshot buffers: a stack of free ones, and a FIFO of
+     * those waiting to be written. */
+    int *freeList;
+    int numFree;
+    int *queue;
+    int queueHead, queueLength;
+
+    bool finishing;         /* no further snapshots will be queued */
+
+    pthread_t *writerThreads;
+    int numWriters;         /* started */
+    pthread_mutex_t lock;
+    pthread_cond_t snapshotFreed;
+    pthread_cond_t snapshotQueued;
+
+    /* The snapshot last queued to be written, for linking unchanged ones
+     * to; lastIndex is -1 if it was written without being queued. */
+    char *lastFilename;
+    int lastIndex;
+
+    /* Per tile of the screen, the hash when last written and now, and
+     * whether they differ. */
+    uint64_t *writtenHashes;
+    uint64_t *currentHashes;
+    bool *tileChanged;
+};
+
+/* Output formats, by file name extension */
+static const struct {
+    const char *extension;
+    const char *name;
+    int format;
+} outputFormats[] = {
+    { "png", "PNG", FORMAT_PNG },
+    { "qoi", "QOI", FORMAT_QOI },
+    { "jpg", "JPEG", FORMAT_JPEG },
+    { "jpeg", "JPEG", FORMAT_JPEG },
+    { "ppm", "PPM", FORMAT_PPM },
+};
+#define NUM_FORMATS (sizeof(outputFormats) / sizeof(outputFormats[0]))
+
+static void *WriterThread(void *arg);
+static void WriteSnapshot(Session *s, Snapshot *snapshot);
+static void ReportSnapshot(Session *s, const Snapshot *snapshot);
+static bool SnapshotChanged(Session *s, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+static void LinkUnchanged(Session *s, const char *filename);
+static void MakeLink(const char *target, const char *filename, bool symbolic);
+
+
+/*
+ * StartOutput() allocates a session's snapshot buffers for its capture
+ * rectangle and starts its writer threads. If it fails, FinishOutput()
+ * frees what it did allocate.
+ */
+
+bool
+StartOutput(Session *s)
+{
+    struct Output *out;
+    int writers = appData.writerThreads > 0 ? appData.writerThreads : 1;
+    int i;
+
+    out = calloc(1, sizeof(struct Output));
+    if (out == NULL) {
+        fprintf(stderr, "Failed to allocate memory for snapshot queue\n");
+        return false;
+    }
+    out->session = s;
+    out->numSnapshots = appData.queueLength > 0 ? appData.queueLength : 1;
+    out->lastIndex = -1;
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->snapshotFreed, NULL);
+    pthread_cond_init(&out->snapshotQueued, NULL);
+    s->output = out;
+
+    out->snapshots = calloc((size_t) out->numSnapshots, sizeof(Snapshot));
+    out->freeList = malloc((size_t) out->numSnapshots * sizeof(int));
+    out->queue = malloc((size_t) out->numSnapshots * sizeof(int));
+    out->writerThreads = malloc((size_t) writers * sizeof(pthread_t));
+    if (out->snapshots == NULL || out->freeList == NULL || out->queue == NULL ||
+        out->writerThreads == NULL) {
+        fprintf(stderr, "Failed to allocate memory for snapshot queue\n");
+        return false;
+    }
+
+    assert(SIZE_MAX / 3 / s->rectWidth >= s->rectHeight);
+    for (i = 0; i < out->numSnapshots; i++) {
+        out->snapshots[i].image = malloc((size_t) s->rectWidth * s->rectHeight * 3);
+        if (out->snapshots[i].image == NULL) {
+            fprintf(stderr, "Failed to allocate memory for snapshot, %" PRIu32 "x%" PRIu32 "\n",
+                    s->rectWidth, s->rectHeight);
+            return false;
+        }
+        out->freeList[out->numFree++] = i;
+    }
+
+    for (i = 0; i < writers; i++) {
+        if (pthread_create(&out->writerThreads[i], NULL, WriterThread, out) != 0) {
+            fprintf(stderr, "%s: Cannot start writer thread\n", programName);
+            return false;
+        }
+        out->numWriters++;
+    }
+    return true;
+}
+
+/*
+ * QueueSnapshot() copies a rectangle of the frame buffer and queues it to
+ * be written to filename, noting how much of it has been damaged since the
+ * damage map was last cleared. If all snapshot buffers are waiting to be
+ * written, it waits for a writer thread to finish one first. With
+ * -unchanged, a snapshot that has not changed enough since the last one
+ * written is skipped or linked instead.
+ */
+
+void
+QueueSnapshot(Session *s, const char *filename, uint32_t x, uint32_t y,
+              uint32_t width, uint32_t height)
+{
+    struct Output *out = s->output;
+    Snapshot *snapshot;
+    int index;
+
+    if (appData.unchangedMode != UNCHANGED_WRITE && !SnapshotChanged(s, x, y, width, height)) {
+        LinkUnchanged(s, filename);
+        return;
+    }
+
+    pthread_mutex_lock(&out->lock);
+    while (out->numFree == 0) {
+        pthread_cond_wait(&out->snapshotFreed, &out->lock);
+    }
+    index = out->freeList[--out->numFree];
+    pthread_mutex_unlock(&out->lock);
+
+    /* The buffer is ours until it is queued, so fill it unlocked. */
+    snapshot = &out->snapshots[index];
+    CopyScreenToImage(s, snapshot->image, x, y, width, height);
+    snapshot->changedTiles = CountScreenDamage(s, x, y, width, height, &snapshot->tiles);
+    snapshot->filename = strdup(filename);
+    snapshot->x = x;
+    snapshot->y = y;
+    snapshot->width = width;
+    snapshot->height = height;
+    snapshot->screenWidth = s->si.framebufferWidth;
+    snapshot->screenHeight = s->si.framebufferHeight;
+
+    pthread_mutex_lock(&out->lock);
+    snapshot->busy = true;
+    out->queue[(out->queueHead + out->queueLength++) % out->numSnapshots] = index;
+    pthread_cond_signal(&out->snapshotQueued);
+    pthread_mutex_unlock(&out->lock);
+
+    free(out->lastFilename);
+    out->lastFilename = strdup(filename);
+    out->lastIndex = index;
+}
+
+/*
+ * SnapshotStreamed() does the bookkeeping for a snapshot that has been
+ * written by the streaming encoder instead of being queued.
+ */
+
+void
+SnapshotStreamed(Session *s, const char *filename, uint32_t x, uint32_t y,
+                 uint32_t width, uint32_t height)
+{
+    Snapshot snapshot;
+
+    if (appData.unchangedMode != UNCHANGED_WRITE) {
+        (void) SnapshotChanged(s, x, y, width, height);
+    }
+
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.filename = (char *) filename;
+    snapshot.x = x;
+    snapshot.y = y;
+    snapshot.width = width;
+    snapshot.height = height;
+    snapshot.screenWidth = s->si.framebufferWidth;
+    snapshot.screenHeight = s->si.framebufferHeight;
+    snapshot.changedTiles = CountScreenDamage(s, x, y, width, height, &snapshot.tiles);
+    ReportSnapshot(s, &snapshot);
+
+    free(s->output->lastFilename);
+    s->output->lastFilename = strdup(filename);
+    s->output->lastIndex = -1;
+}
+
+/*
+ * SnapshotChanged() tells whether enough of a rectangle of the screen has
+ * changed since the last snapshot written for it to be written again.
+ */
+
+static bool
+SnapshotChanged(Session *s, uint32_t x, uint32_t y, uint32_t width, uint32_t height)
+{
+    uint32_t columns = ((uint32_t)s->si.framebufferWidth + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    uint32_t rows = ((uint32_t)s->si.framebufferHeight + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    uint32_t firstColumn = x / DAMAGE_TILE_SIZE, lastColumn = (x + width - 1) / DAMAGE_TILE_SIZE;
+    uint32_t firstRow = y / DAMAGE_TILE_SIZE, lastRow = (y + height - 1) / DAMAGE_TILE_SIZE;
+    uint32_t column, row;
+    uint64_t changedPixels = 0;
+    struct Output *out = s->output;
+    bool first = out->writtenHashes == NULL;
+
+    if (first) {
+        out->writtenHashes = calloc((size_t)columns * rows, sizeof(uint64_t));
+        out->currentHashes = calloc((size_t)columns * rows, sizeof(uint64_t));
+        out->tileChanged = calloc((size_t)columns * rows, sizeof(bool));
+        if (out->writtenHashes == NULL || out->currentHashes == NULL || out->tileChanged == NULL) {
+            fprintf(stderr, "Failed to allocate memory for tile hashes\n");
+            exit(1);
+        }
+    }
+
+    /* Hash the part of each tile inside the rectangle. Only tiles drawn in
+     * since the last snapshot can have changed since it was hashed, but a
+     * tile may differ from the last snapshot written through earlier
+     * changes too small to write. */
+    for (row = firstRow; row <= lastRow; row++) {
+        uint32_t top = row == firstRow ? y : row * DAMAGE_TILE_SIZE;
+        uint32_t bottom = row == lastRow ? y + height : (row + 1) * DAMAGE_TILE_SIZE;
+        for (column = firstColumn; column <= lastColumn; column++) {
+            uint32_t left = column == firstColumn ? x : column * DAMAGE_TILE_SIZE;
+            uint32_t right = column == lastColumn ? x + width : (column + 1) * DAMAGE_TILE_SIZE;
+            size_t tile = (size_t)row * columns + column;
+
+            if (first || ScreenTileDamaged(s, column, row)) {
+                out->currentHashes[tile] = HashScreenRectangle(s, left, top,
+                                                               right - left, bottom - top);
+                out->tileChanged[tile] = first ||
+                                         out->currentHashes[tile] != out->writtenHashes[tile];
+            }
+            if (out->tileChanged[tile]) {
+                changedPixels += (uint64_t)(right - left) * (bottom - top);
+            }
+        }
+    }
+
+    if (!first && changedPixels < (uint64_t)appData.minChange) {
+        return false;
+    }
+    for (row = firstRow; row <= lastRow; row++) {
+        for (column = firstColumn; column <= lastColumn; column++) {
+            size_t tile = (size_t)row * columns + column;
+            out->writtenHashes[tile] = out->currentHashes[tile];
+            out->tileChanged[tile] = false;
+        }
+    }
+    return true;
+}
+
+/*
+ * LinkUnchanged() does what -unchanged asks for in place of writing an
+ * unchanged snapshot to filename. A hard link to a file still waiting to
+ * be written is left to the writer thread to make once it has been.
+ */
+
+static void
+LinkUnchanged(Session *s, const char *filename)
+{
+    struct Output *out = s->output;
+
+    if (appData.unchangedMode == UNCHANGED_SKIP || out->lastFilename == NULL) {
+        if (!appData.quiet) {
+            fprintf(stderr, "Screen unchanged, %s not written\n", filename);
+        }
+        return;
+    }
+    if (appData.unchangedMode == UNCHANGED_LINK && out->lastIndex >= 0) {
+        Snapshot *last = &out->snapshots[out->lastIndex];
+        bool later = false;
+
+        pthread_mutex_lock(&out->lock);
+        if (last->busy) {
+            char **links = realloc(last->links, (size_t)(last->numLinks + 1) * sizeof(char *));
+            if (links == NULL) {
+                fprintf(stderr, "Failed to allocate memory for snapshot link\n");
+                exit(1);
+            }
+            last->links = links;
+            last->links[last->numLinks++] = strdup(filename);
+            later = true;
+        }
+        pthread_mutex_unlock(&out->lock);
+        if (later) {
+            return;
+        }
+    }
+    MakeLink(out->lastFilename, filename, appData.unchangedMode == UNCHANGED_SYMLINK);
+}
+
+/*
+ * MakeLink() replaces filename with a link to target, which is in the same
+ * directory.
+ */
+
+static void
+MakeLink(const char *target, const char *filename, bool symbolic)
+{
+    int result;
+
+    (void) unlink(filename);
+    if (symbolic) {
+        /* Relative, so the files can be moved together */
+        const char *base = strrchr(target, '/');
+        result = symlink(base ? base + 1 : target, filename);
+    } else {
+        result = link(target, filename);
+    }
+    if (result != 0) {
+        fprintf(stderr, "%s: Cannot link %s to %s: %s\n",
+                programName, filename, target, strerror(errno));
+    } else if (!appData.quiet) {
+        fprintf(stderr, "Screen unchanged, %s linked to %s\n", filename, target);
+    }
+}
+
+/*
+ * FinishOutput() waits for all of a session's queued snapshots to be
+ * written, and frees its output. It does nothing if there is none.
+ */
+
+void
+FinishOutput(Session *s)
+{
+    struct Output *out = s->output;
+    int i;
+
+    if (out == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&out->lock);
+    out->finishing = true;
+    pthread_cond_broadcast(&out->snapshotQueued);
+    pthread_mutex_unlock(&out->lock);
+
+    for (i = 0; i < out->numWriters; i++) {
+        pthread_join(out->writerThreads[i], NULL);
+    }
+    if (out->snapshots != NULL) {
+        for (i = 0; i < out->numSnapshots; i++) {
+            free(out->snapshots[i].image);
+            free(out->snapshots[i].links);
+        }
+    }
+    free(out->snapshots);
+    free(out->freeList);
+    free(out->queue);
+    free(out->writerThreads);
+    free(out->lastFilename);
+    free(out->writtenHashes);
+    free(out->currentHashes);
+    free(out->tileChanged);
+    pthread_mutex_destroy(&out->lock);
+    pthread_cond_destroy(&out->snapshotFreed);
+    pthread_cond_destroy(&out->snapshotQueued);
+    free(out);
+    s->output = NULL;
+}
+
+/*
+ * FormatForFilename() returns the FORMAT_* for filename's extension, or -1
+ * if it has none that we know.
+ */
+
+int
+FormatForFilename(const char *filename)
+{
+    const char *extension = strrchr(filename, '.');
+    size_t i;
+
+    if (extension == NULL || strchr(extension, '/') != NULL) {
+        return -1;
+    }
+    for (i = 0; i < NUM_FORMATS; i++) {
+        if (strcasecmp(extension + 1, outputFormats[i].extension) == 0) {
+            return outputFormats[i].format;
+        }
+    }
+    return -1;
+}
+
+/*
+ * FormatName() returns the name of a FORMAT_*, for messages.
+ */
+
+const char *
+FormatName(int format)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_FORMATS; i++) {
+        if (outputFormats[i].format == format) {
+            return outputFormats[i].name;
+        }
+    }
+    return "image";
+}
+
+/*
+ * WriteImage() writes a packed RGB image to filename in a FORMAT_*.
+ */
+
+void
+WriteImage(char *filename, int format, uint8_t *image, uint32_t width, uint32_t height)
+{
+    switch (format) {
+    case FORMAT_QOI:
+        write_QOI(filename, image, width, height);
+        break;
+    case FORMAT_JPEG:
+        write_JPEG(filename, image, width, height);
+        break;
+    case FORMAT_PPM:
+        write_PPM(filename, image, width, height);
+        break;
+    default:
+        write_PNG(filename, 0 /* don't interlace */, image, width, height);
+        break;
+    }
+}
+
+/*
+ * WritesFromScreen() tells whether WriteScreenImage() can write a format.
+ */
+
+bool
+WritesFromScreen(int format)
+{
+    return format == FORMAT_JPEG || format == FORMAT_PPM;
+}
+
+/*
+ * WriteScreenImage() writes a rectangle of the frame buffer to filename in
+ * the session's output format, reading it straight from the frame buffer,
+ * as WriteScreenJPEG() does. The format must be one WritesFromScreen().
+ */
+
+bool
+WriteScreenImage(Session *s, const char *filename, uint32_t x, uint32_t y,
+                 uint32_t width, uint32_t height,
+                 uint32_t (*rowsReady)(Session *s, uint32_t row))
+{
+    assert(WritesFromScreen(s->outputFormat));
+    if (s->outputFormat == FORMAT_PPM) {
+        return WriteScreenPPM(s, filename, x, y, width, height, rowsReady);
+    }
+    return WriteScreenJPEG(s, filename, x, y, width, height, rowsReady);
+}
+
+static void *
+WriterThread(void *arg)
+{
+    struct Output *out = arg;
+    Snapshot *snapshot;
+    char *filename;
+    char **links;
+    int index, numLinks, i;
+
+    pthread_mutex_lock(&out->lock);
+    while (true) {
+        while (out->queueLength == 0 && !out->finishing) {
+            pthread_cond_wait(&out->snapshotQueued, &out->lock);
+        }
+        if (out->queueLength == 0) {
+            break;
+        }
+        index = out->queue[out->queueHead];
+        out->queueHead = (out->queueHead + 1) % out->numSnapshots;
+        out->queueLength--;
+
+        /* Nothing else touches a snapshot between leaving the queue and
+         * returning to the free list, so encode it without the lock. */
+        pthread_mutex_unlock(&out->lock);
+        WriteSnapshot(out->session, &out->snapshots[index]);
+        pthread_mutex_lock(&out->lock);
+
+        /* Links to it may have been asked for while it was written. They
+         * are made without the lock; once it is no longer busy,
+         * LinkUnchanged() makes any others itself. */
+        snapshot = &out->snapshots[index];
+        filename = snapshot->filename;
+        links = snapshot->links;
+        numLinks = snapshot->numLinks;
+        snapshot->filename = NULL;
+        snapshot->links = NULL;
+        snapshot->numLinks = 0;
+        snapshot->busy = false;
+        pthread_mutex_unlock(&out->lock);
+
+        for (i = 0; i < numLinks; i++) {
+            MakeLink(filename, links[i], false);
+            free(links[i]);
+        }
+        free(links);
+        free(filename);
+
+        pthread_mutex_lock(&out->lock);
+        out->freeList[out->numFree++] = index;
+        pthread_cond_signal(&out->snapshotFreed);
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    return NULL;
+}
+
+static void
+WriteSnapshot(Session *s, Snapshot *snapshot)
+{
+    WriteImage(snapshot->filename, s->outputFormat, snapshot->image,
+               snapshot->width, snapshot->height);
+    ReportSnapshot(s, snapshot);
+}
+
+static void
+ReportSnapshot(Session *s, const Snapshot *snapshot)
+{
+    if (!appData.quiet) {
+        fprintf(stderr, "Image saved from %s %" PRId16 "x%" PRId16 " screen to ",
+                s->serverName ? s->serverName : "(local host)",
+                snapshot->screenWidth, snapshot->screenHeight);
+        if (strcmp(snapshot->filename, "-") == 0) {
+            fprintf(stderr, "- (stdout)");
+        } else {
+            fprintf(stderr, "%s", snapshot->filename);
+        }
+        fprintf(stderr, " using %" PRIu32 "x%" PRIu32 "+%" PRIu32 "+%" PRIu32 " rectangle",
+                snapshot->width, snapshot->height, snapshot->x, snapshot->y);
+        if (appData.count > 1) {
+            fprintf(stderr, ", %" PRIu32 " of %" PRIu32 " tiles changed",
+                    snapshot->changedTiles, snapshot->tiles);
+        }
+        fprintf(stderr, "\n");
+    }
+}
@@ -0,0 +1,271 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * pixels.c - convert runs of pixels between the server's 32-bit format and
+ * the frame buffer's packed RGB.
+ *
+ * We ask the server for pixels with red, green and blue in the first three
+ * bytes in memory and an unused fourth byte, on either byte order, so
+ * converting is only a matter of dropping or adding that fourth byte. Each
+ * conversion has a plain C version and, where the compiler supports them,
+ * SSSE3 and AVX2 versions picked at run time on x86, or a NEON version on
+ * ARM.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vncsnapshot.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#define HAVE_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+static void PackRGBXScalar(uint8_t *dst, const uint8_t *src, size_t n);
+static void UnpackRGBScalar(uint8_t *dst, const uint8_t *src, size_t n);
+static bool IsBlackRGBXScalar(const uint8_t *src, size_t n);
+
+void (*PackRGBX)(uint8_t *dst, const uint8_t *src, size_t n) = PackRGBXScalar;
+void (*UnpackRGB)(uint8_t *dst, const uint8_t *src, size_t n) = UnpackRGBScalar;
+bool (*IsBlackRGBX)(const uint8_t *src, size_t n) = IsBlackRGBXScalar;
+
+
+static void
+PackRGBXScalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    while (n-- > 0) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst += 3;
+        src += 4;
+    }
+}
+
+static void
+UnpackRGBScalar(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    while (n-- > 0) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 0;
+        dst += 4;
+        src += 3;
+    }
+}
+
+static bool
+IsBlackRGBXScalar(const uint8_t *src, size_t n)
+{
+    uint8_t any = 0;
+
+    while (n-- > 0) {
+        any |= src[0] | src[1] | src[2];
+        src += 4;
+    }
+    return any == 0;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Byte shuffles that drop, or make room for, every fourth byte. -1 makes
+ * a zero byte. */
+#define PACK_SHUFFLE   0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+#define UNPACK_SHUFFLE 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+
+/*
+ * The vector loops store, or load, a whole register where only part of it
+ * holds pixels, so they stop while enough pixels remain that this stays
+ * within the buffers, and leave the rest to a narrower version. The AVX2
+ * versions clear the upper halves of the registers before handing over,
+ * since GCC does not when it turns the call into a jump, and mixing in the
+ * older instructions with them dirty is very slow on some CPUs.
+ */
+
+TARGET("ssse3") static void
+PackRGBXSSSE3(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    const __m128i shuffle = _mm_setr_epi8(PACK_SHUFFLE);
+
+    for (; n >= 8; n -= 4, src += 16, dst += 12) {
+        __m128i v = _mm_loadu_si128((const __m128i *) src);
+        _mm_storeu_si128((__m128i *) dst, _mm_shuffle_epi8(v, shuffle));
+    }
+    PackRGBXScalar(dst, src, n);
+}
+
+TARGET("ssse3") static void
+UnpackRGBSSSE3(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    const __m128i shuffle = _mm_setr_epi8(UNPACK_SHUFFLE);
+
+    for (; n >= 6; n -= 4, src += 12, dst += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) src);
+        _mm_storeu_si128((__m128i *) dst, _mm_shuffle_epi8(v, shuffle));
+    }
+    UnpackRGBScalar(dst, src, n);
+}
+
+TARGET("sse2") static bool
+IsBlackRGBXSSE2(const uint8_t *src, size_t n)
+{
+    const __m128i rgb = _mm_set1_epi32(0x00ffffff);
+    __m128i any = _mm_setzero_si128();
+
+    /* The unused byte is the last of each pixel on either byte order */
+    for (; n >= 4; n -= 4, src += 16) {
+        any = _mm_or_si128(any, _mm_loadu_si128((const __m128i *) src));
+    }
+    any = _mm_and_si128(any, rgb);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) == 0xffff &&
+           IsBlackRGBXScalar(src, n);
+}
+
+TARGET("avx2") static void
+PackRGBXAVX2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    const __m256i shuffle = _mm256_setr_epi8(PACK_SHUFFLE, PACK_SHUFFLE);
+    /* Bring the 12 bytes of each half together */
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+    for (; n >= 11; n -= 8, src += 32, dst += 24) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) src);
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle), compact);
+        _mm256_storeu_si256((__m256i *) dst, v);
+    }
+    _mm256_zeroupper();
+    PackRGBXSSSE3(dst, src, n);
+}
+
+TARGET("avx2") static void
+UnpackRGBAVX2(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    const __m256i shuffle = _mm256_setr_epi8(UNPACK_SHUFFLE, UNPACK_SHUFFLE);
+    /* Put bytes 0-11 in the low half and 12-23 in the high half */
+    const __m256i spread = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+
+    for (; n >= 11; n -= 8, src += 24, dst += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) src);
+        v = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(v, spread), shuffle);
+        _mm256_storeu_si256((__m256i *) dst, v);
+    }
+    _mm256_zeroupper();
+    UnpackRGBSSSE3(dst, src, n);
+}
+
+TARGET("avx2") static bool
+IsBlackRGBXAVX2(const uint8_t *src, size_t n)
+{
+    __m256i any = _mm256_setzero_si256();
+    int black;
+
+    for (; n >= 8; n -= 8, src += 32) {
+        any = _mm256_or_si256(any, _mm256_loadu_si256((const __m256i *) src));
+    }
+    any = _mm256_and_si256(any, _mm256_set1_epi32(0x00ffffff));
+    black = _mm256_testz_si256(any, any);
+    _mm256_zeroupper();
+    return black && IsBlackRGBXSSE2(src, n);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef HAVE_NEON_KERNELS
+
+static void
+PackRGBXNEON(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    for (; n >= 16; n -= 16, src += 64, dst += 48) {
+        uint8x16x4_t rgbx = vld4q_u8(src);
+        uint8x16x3_t rgb;
+        rgb.val[0] = rgbx.val[0];
+        rgb.val[1] = rgbx.val[1];
+        rgb.val[2] = rgbx.val[2];
+        vst3q_u8(dst, rgb);
+    }
+    PackRGBXScalar(dst, src, n);
+}
+
+static void
+UnpackRGBNEON(uint8_t *dst, const uint8_t *src, size_t n)
+{
+    for (; n >= 16; n -= 16, src += 48, dst += 64) {
+        uint8x16x3_t rgb = vld3q_u8(src);
+        uint8x16x4_t rgbx;
+        rgbx.val[0] = rgb.val[0];
+        rgbx.val[1] = rgb.val[1];
+        rgbx.val[2] = rgb.val[2];
+        rgbx.val[3] = vdupq_n_u8(0);
+        vst4q_u8(dst, rgbx);
+    }
+    UnpackRGBScalar(dst, src, n);
+}
+
+static bool
+IsBlackRGBXNEON(const uint8_t *src, size_t n)
+{
+    uint32x4_t any = vdupq_n_u32(0);
+
+    for (; n >= 4; n -= 4, src += 16) {
+        any = vorrq_u32(any, vreinterpretq_u32_u8(vld1q_u8(src)));
+    }
+    any = vandq_u32(any, vdupq_n_u32(0x00ffffff));
+    any = vorrq_u32(any, vextq_u32(any, any, 2));
+    any = vorrq_u32(any, vextq_u32(any, any, 1));
+    return vgetq_lane_u32(any, 0) == 0 && IsBlackRGBXScalar(src, n);
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+/*
+ * InitPixelKernels() picks the fastest conversions this CPU can run.
+ */
+
+void
+InitPixelKernels(void)
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        IsBlackRGBX = IsBlackRGBXSSE2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        PackRGBX = PackRGBXSSSE3;
+        UnpackRGB = UnpackRGBSSSE3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        PackRGBX = PackRGBXAVX2;
+        UnpackRGB = UnpackRGBAVX2;
+        IsBlackRGBX = IsBlackRGBXAVX2;
+    }
+#endif
+#ifdef HAVE_NEON_KERNELS
+    PackRGBX = PackRGBXNEON;
+    UnpackRGB = UnpackRGBNEON;
+    IsBlackRGBX = IsBlackRGBXNEON;
+#endif
+}
@@ -0,0 +1,377 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * pngwrite.c - write a PNG file using several threads.
+ *
+ * libpng filters and deflates an image one row at a time on a single
+ * thread, which for a large screen takes far longer than receiving it. Here
+ * the image is cut into horizontal strips, one per thread. Each thread
+ * first applies the PNG row filters to its strip, then, once every strip
+ * is filtered, deflates its strip as a raw deflate stream primed with the
+ * last 32K of the strip before it, ending on a byte boundary. As in pigz,
+ * the strips then concatenate into one zlib stream; its Adler-32 check
+ * value is combined from those of the strips. Each strip is written as
+ * its own IDAT chunk.
+ */
+
+#ifndef WIN32
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <png.h>
+#include <zlib.h>
+
+#include "vncsnapshot.h"
+
+#define BYTES_PER_PIXEL 3
+#define WINDOW_SIZE 32768
+
+static const uint8_t pngSignature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+typedef struct {
+    const uint8_t *image;
+    uint32_t width;
+    uint32_t y0, y1;            /* rows y0 to y1-1 of the image */
+    uint8_t *filtered;          /* filter type byte and filtered row, per row */
+    size_t filteredLen;
+    const uint8_t *dictionary;  /* filtered data preceding this strip */
+    size_t dictionaryLen;
+    bool first, last;
+    uint8_t *deflated;
+    size_t deflatedLen;
+    uLong adler;
+} Strip;
+
+static void *FilterStrip(void *arg);
+static void *DeflateStrip(void *arg);
+static void RunStrips(void *(*fn)(void *), Strip *strips, int numStrips);
+static void WriteChunk(FILE *file, const char *type, const uint8_t *data, size_t len);
+static void PutUint32(uint8_t *p, uint32_t value);
+
+
+/*
+ * PNGThreads() returns the number of threads to encode each PNG file with.
+ */
+
+int
+PNGThreads(void)
+{
+    long cpus;
+
+    if (appData.pngThreads > 0) {
+        return appData.pngThreads;
+    }
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int) cpus : 1;
+}
+
+/*
+ * write_PNG_strips() writes a packed RGB image to filename, encoding it
+ * in horizontal strips on up to threads threads.
+ */
+
+void
+write_PNG_strips(char *filename, uint8_t *image, uint32_t width, uint32_t height,
+                 int threads)
+{
+    size_t stride = (size_t) width * BYTES_PER_PIXEL + 1;
+    uint8_t *filtered;
+    Strip *strips;
+    int numStrips, i;
+    uint8_t header[13], trailer[4];
+    uLong adler;
+    FILE *outfile;
+
+    assert(threads > 0 && width > 0 && height > 0);
+    numStrips = (uint32_t) threads < height ? threads : (int) height;
+
+    assert(SIZE_MAX / stride >= height);
+    filtered = malloc(stride * height);
+    strips = calloc((size_t) numStrips, sizeof(Strip));
+    if (filtered == NULL || strips == NULL) {
+        errx(1, "couldn't allocate memory to encode %s", filename);
+    }
+
+    for (i = 0; i < numStrips; i++) {
+        Strip *strip = &strips[i];
+        strip->image = image;
+        strip->width = width;
+        strip->y0 = (uint32_t) ((uint64_t) height * (uint32_t) i / (uint32_t) numStrips);
+        strip->y1 = (uint32_t) ((uint64_t) height * (uint32_t) (i + 1) / (uint32_t) numStrips);
+        strip->filtered = filtered + strip->y0 * stride;
+        strip->filteredLen = (strip->y1 - strip->y0) * stride;
+        strip->dictionaryLen = strip->y0 * stride < WINDOW_SIZE ? strip->y0 * stride : WINDOW_SIZE;
+        strip->dictionary = strip->filtered - strip->dictionaryLen;
+        strip->first = i == 0;
+        strip->last = i == numStrips - 1;
+    }
+
+    /* Each strip's dictionary is the end of the strip before, so every
+     * strip must be filtered before any is deflated. */
+    RunStrips(FilterStrip, strips, numStrips);
+    RunStrips(DeflateStrip, strips, numStrips);
+
+    outfile = fopen(filename, "wb");
+    if (!outfile) err(1, "couldn't fopen %s", filename);
+
+    (void) fwrite(pngSignature, 1, sizeof(pngSignature), outfile);
+    PutUint32(header, width);
+    PutUint32(header + 4, height);
+    header[8] = 8;                      /* bit depth */
+    header[9] = PNG_COLOR_TYPE_RGB;
+    header[10] = PNG_COMPRESSION_TYPE_BASE;
+    header[11] = PNG_FILTER_TYPE_BASE;
+    header[12] = PNG_INTERLACE_NONE;
+    WriteChunk(outfile, "IHDR", header, sizeof(header));
+
+    adler = adler32(0L, Z_NULL, 0);
+    for (i = 0; i < numStrips; i++) {
+        adler = adler32_combine(adler, strips[i].adler, (z_off_t) strips[i].filteredLen);
+    }
+    PutUint32(trailer, (uint32_t) adler);
+    for (i = 0; i < numStrips; i++) {
+        if (strips[i].last) {
+            /* DeflateStrip() left room for the check value */
+            memcpy(strips[i].deflated + strips[i].deflatedLen, trailer, sizeof(trailer));
+            strips[i].deflatedLen += sizeof(trailer);
+        }
+        WriteChunk(outfile, "IDAT", strips[i].deflated, strips[i].deflatedLen);
+        free(strips[i].deflated);
+    }
+    WriteChunk(outfile, "IEND", NULL, 0);
+
+    if (ferror(outfile) || fclose(outfile) != 0) {
+        err(1, "couldn't write %s", filename);
+    }
+    free(strips);
+    free(filtered);
+}
+
+/*
+ * RunStrips() calls fn on every strip, each on its own thread, and waits
+ * for all of them. The first strip is done on the calling thread.
+ */
+
+static void
+RunStrips(void *(*fn)(void *), Strip *strips, int numStrips)
+{
+    pthread_t threads[numStrips];
+    bool started[numStrips];
+    int i;
+
+    for (i = 1; i < numStrips; i++) {
+        started[i] = pthread_create(&threads[i], NULL, fn, &strips[i]) == 0;
+        if (!started[i]) {
+            fn(&strips[i]);
+        }
+    }
+    fn(&strips[0]);
+    for (i = 1; i < numStrips; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+/*
+ * FilterStrip() applies the PNG row filters to a strip. With more than one
+ * filter allowed, each row gets the one whose output has the smallest sum
+ * of absolute values, as libpng does.
+ */
+
+static void *
+FilterStrip(void *arg)
+{
+    static const int filterTypes[] = {
+        PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH
+    };
+    Strip *strip = arg;
+    size_t rowBytes = (size_t) strip->width * BYTES_PER_PIXEL;
+    int filters = appData.pngFilters >= 0 ? appData.pngFilters : PNG_ALL_FILTERS;
+    uint8_t candidate[rowBytes];
+    uint32_t y;
+
+    if ((filters & PNG_ALL_FILTERS) == 0) {
+        filters = PNG_FILTER_NONE;
+    }
+
+    for (y = strip->y0; y < strip->y1; y++) {
+        const uint8_t *row = strip->image + y * rowBytes;
+        const uint8_t *prior = y > 0 ? row - rowBytes : NULL;
+        uint8_t *out = strip->filtered + (y - strip->y0) * (rowBytes + 1);
+        uint64_t bestSum = UINT64_MAX;
+
+        for (int type = 0; type < 5; type++) {
+            uint8_t *dest;
+            uint64_t sum = 0;
+
+            if (!(filters & filterTypes[type])) {
+                continue;
+            }
+            /* Filter straight into the output when there's no choice */
+            dest = (filters & ~filterTypes[type] & PNG_ALL_FILTERS) ? candidate : out + 1;
+
+            for (size_t i = 0; i < rowBytes; i++) {
+                int a = i >= BYTES_PER_PIXEL ? row[i - BYTES_PER_PIXEL] : 0;
+                int b = prior ? prior[i] : 0;
+                int c = prior && i >= BYTES_PER_PIXEL ? prior[i - BYTES_PER_PIXEL] : 0;
+                int predictor;
+
+                switch (type) {
+                case 0: predictor = 0; break;
+                case 1: predictor = a; break;
+                case 2: predictor = b; break;
+                case 3: predictor = (a + b) / 2; break;
+                default: {
+                    int p = a + b - c;
+                    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+                    predictor = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                    break;
+                }
+                }
+                dest[i] = (uint8_t) (row[i] - predictor);
+                sum += (uint64_t) abs((int8_t) dest[i]);
+            }
+
+            if (dest != candidate) {
+                out[0] = (uint8_t) type;
+                break;
+            }
+            if (sum < bestSum) {
+                bestSum = sum;
+                out[0] = (uint8_t) type;
+                memcpy(out + 1, candidate, rowBytes);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * DeflateStrip() compresses a filtered strip. The first strip starts with
+ * the zlib header and the last ends the deflate stream; the others end
+ * with a sync flush so that the next strip's output can follow directly.
+ */
+
+static void *
+DeflateStrip(void *arg)
+{
+    Strip *strip = arg;
+    int level = appData.pngLevel;
+    int strategy = appData.pngStrategy;
+    size_t capacity, start = 0;
+    z_stream zs;
+    int result;
+
+    /* Pick the strategy the way libpng would */
+    if (strategy < 0) {
+        strategy = appData.pngFilters == PNG_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) {
+        errx(1, "couldn't initialise deflate");
+    }
+    if (strip->dictionaryLen > 0) {
+        deflateSetDictionary(&zs, strip->dictionary, (uInt) strip->dictionaryLen);
+    }
+
+    /* Room for the zlib header, the sync flush marker and the check value */
+    assert(strip->filteredLen <= UINT32_MAX);
+    capacity = deflateBound(&zs, (uLong) strip->filteredLen) + 16;
+    strip->deflated = malloc(capacity);
+    if (strip->deflated == NULL) {
+        errx(1, "couldn't allocate memory to deflate");
+    }
+
+    if (strip->first) {
+        int levelFlags = level < 2 || strategy >= Z_HUFFMAN_ONLY ? 0 :
+                         level < 6 ? 1 : level == 6 ? 2 : 3;
+        strip->deflated[0] = 0x78;      /* deflate, 32K window */
+        strip->deflated[1] = (uint8_t) (levelFlags << 6);
+        strip->deflated[1] = (uint8_t) (strip->deflated[1] + 31 - (0x7800 + strip->deflated[1]) % 31);
+        start = 2;
+    }
+
+    zs.next_in = strip->filtered;
+    zs.avail_in = (uInt) strip->filteredLen;
+    zs.next_out = strip->deflated + start;
+    zs.avail_out = (uInt) (capacity - start - 4);
+    while (true) {
+        result = deflate(&zs, strip->last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (result == Z_STREAM_ERROR || (result == Z_BUF_ERROR && zs.avail_out != 0)) {
+            errx(1, "deflate failed: %s", zs.msg ? zs.msg : "unknown error");
+        }
+        /* A flush is only complete if it left some output space unused */
+        if (strip->last ? result == Z_STREAM_END : zs.avail_out != 0) {
+            break;
+        }
+        if (zs.avail_out == 0) {
+            size_t used = (size_t) (zs.next_out - strip->deflated);
+            capacity *= 2;
+            strip->deflated = realloc(strip->deflated, capacity);
+            if (strip->deflated == NULL) {
+                errx(1, "couldn't allocate memory to deflate");
+            }
+            zs.next_out = strip->deflated + used;
+            zs.avail_out = (uInt) (capacity - used - 4);
+        }
+    }
+
+    strip->deflatedLen = (size_t) (zs.next_out - strip->deflated);
+    strip->adler = adler32(adler32(0L, Z_NULL, 0), strip->filtered, (uInt) strip->filteredLen);
+    deflateEnd(&zs);
+    return NULL;
+}
+
+static void
+WriteChunk(FILE *file, const char *type, const uint8_t *data, size_t len)
+{
+    uint8_t word[4];
+    uLong crc;
+
+    assert(len <= PNG_UINT_31_MAX);
+    PutUint32(word, (uint32_t) len);
+    (void) fwrite(word, 1, 4, file);
+    (void) fwrite(type, 1, 4, file);
+    crc = crc32(0L, (const Bytef *) type, 4);
+    if (len > 0) {
+        (void) fwrite(data, 1, len, file);
+        crc = crc32(crc, data, (uInt) len);
+    }
+    PutUint32(word, (uint32_t) crc);
+    (void) fwrite(word, 1, 4, file);
+}
+
+static void
+PutUint32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t) (value >> 24);
+    p[1] = (uint8_t) (value >> 16);
+    p[2] = (uint8_t) (value >> 8);
+    p[3] = (uint8_t) value;
+}
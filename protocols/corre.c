@@ -35,24 +35,25 @@
 #endif
 
 static bool
-HandleCoRREBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
+HandleCoRREBPP (Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
 {
+    struct Decoders *d = s->decoders;
     rfbRREHeader hdr;
-    if (!ReadFromRFBServer((uint8_t *)&hdr, sz_rfbRREHeader))
+    if (!ReadFromRFBServer(s, (uint8_t *)&hdr, sz_rfbRREHeader))
         return false;
 
     hdr.nSubrects = Swap32IfLE(hdr.nSubrects);
 
     CARDBPP pix;
-    if (!ReadFromRFBServer((uint8_t *)&pix, sizeof(pix)))
+    if (!ReadFromRFBServer(s, (uint8_t *)&pix, sizeof(pix)))
         return false;
 
-    FillBufferRectangle(rx, ry, rw, rh, pix);
+    FillBufferRectangle(s, rx, ry, rw, rh, pix);
 
-    if (!ReadFromRFBServer(buffer, hdr.nSubrects * (4 + (BPP / 8))))
+    if (!ReadFromRFBServer(s, d->buffer, hdr.nSubrects * (4 + (BPP / 8))))
         return false;
 
-    uint8_t *ptr = buffer;
+    uint8_t *ptr = d->buffer;
 
     for (uint32_t i = 0; i < hdr.nSubrects; i++) {
         pix = *(CARDBPP *)ptr;
@@ -62,7 +63,7 @@ HandleCoRREBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
         uint32_t w = *ptr++;
         uint32_t h = *ptr++;
 
-        FillBufferRectangle(rx + x, ry + y, w, h, pix);
+        FillBufferRectangle(s, rx + x, ry + y, w, h, pix);
     }
 
     return true;
@@ -36,8 +36,9 @@
 #define GET_PIXEL CONCAT2E(GET_PIXEL,BPP)
 
 static bool
-HandleHextileBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
+HandleHextileBPP (Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
 {
+  struct Decoders *d = s->decoders;
   CARDBPP bg, fg;
   uint32_t x, y, w, h;
   uint32_t sx, sy, sw, sh;
@@ -51,25 +52,25 @@ HandleHextileBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
         h = ry+rh - y;
 
       uint8_t subencoding;
-      if (!ReadFromRFBServer((uint8_t *)&subencoding, 1))
+      if (!ReadFromRFBServer(s, (uint8_t *)&subencoding, 1))
         return false;
 
       if (subencoding & rfbHextileRaw) {
-        if (!ReadFromRFBServer(buffer, (size_t)(w * h * (BPP / 8))))
+        if (!ReadFromRFBServer(s, d->buffer, (size_t)(w * h * (BPP / 8))))
           return false;
 
-        CopyDataToScreen(buffer, x, y, w, h);
+        CopyDataToScreen(s, d->buffer, x, y, w, h);
         continue;
       }
 
       if (subencoding & rfbHextileBackgroundSpecified)
-        if (!ReadFromRFBServer((uint8_t *)&bg, sizeof(bg)))
+        if (!ReadFromRFBServer(s, (uint8_t *)&bg, sizeof(bg)))
           return false;
 
-      FillBufferRectangle(x, y, w, h, bg);
+      FillBufferRectangle(s, x, y, w, h, bg);
 
       if (subencoding & rfbHextileForegroundSpecified)
-        if (!ReadFromRFBServer((uint8_t *)&fg, sizeof(fg)))
+        if (!ReadFromRFBServer(s, (uint8_t *)&fg, sizeof(fg)))
           return false;
 
       if (!(subencoding & rfbHextileAnySubrects)) {
@@ -77,13 +78,13 @@ HandleHextileBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
       }
 
       uint8_t nSubrects;
-      if (!ReadFromRFBServer((uint8_t *)&nSubrects, 1))
+      if (!ReadFromRFBServer(s, (uint8_t *)&nSubrects, 1))
         return false;
 
-      uint8_t *ptr = buffer;
+      uint8_t *ptr = d->buffer;
 
       if (subencoding & rfbHextileSubrectsColoured) {
-        if (!ReadFromRFBServer(buffer, (size_t)nSubrects * (2 + (BPP / 8))))
+        if (!ReadFromRFBServer(s, d->buffer, (size_t)nSubrects * (2 + (BPP / 8))))
           return false;
 
         for (uint_fast8_t i = 0; i < nSubrects; i++) {
@@ -94,11 +95,11 @@ HandleHextileBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
           sw = (uint32_t)rfbHextileExtractW(*ptr);
           sh = (uint32_t)rfbHextileExtractH(*ptr);
           ptr++;
-          FillBufferRectangle(x+sx, y+sy, sw, sh, fg);
+          FillBufferRectangle(s, x+sx, y+sy, sw, sh, fg);
         }
 
       } else {
-        if (!ReadFromRFBServer(buffer, (size_t)nSubrects * 2))
+        if (!ReadFromRFBServer(s, d->buffer, (size_t)nSubrects * 2))
           return false;
 
 
@@ -109,7 +110,7 @@ HandleHextileBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
           sw = (uint32_t)rfbHextileExtractW(*ptr);
           sh = (uint32_t)rfbHextileExtractH(*ptr);
           ptr++;
-          FillBufferRectangle(x+sx, y+sy, sw, sh, fg);
+          FillBufferRectangle(s, x+sx, y+sy, sw, sh, fg);
         }
       }
     }
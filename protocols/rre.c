@@ -32,27 +32,27 @@
 #define CARDBPP CONCAT2E(CONCAT2E(uint,BPP),_t)
 
 static bool
-HandleRREBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
+HandleRREBPP (Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
 {
   rfbRREHeader hdr;
   CARDBPP pix;
   rfbRectangle subrect;
 
-  if (!ReadFromRFBServer((uint8_t *)&hdr, sz_rfbRREHeader))
+  if (!ReadFromRFBServer(s, (uint8_t *)&hdr, sz_rfbRREHeader))
     return false;
 
   hdr.nSubrects = Swap32IfLE(hdr.nSubrects);
 
-  if (!ReadFromRFBServer((uint8_t *)&pix, sizeof(pix)))
+  if (!ReadFromRFBServer(s, (uint8_t *)&pix, sizeof(pix)))
     return false;
 
-  FillBufferRectangle(rx, ry, rw, rh, pix);
+  FillBufferRectangle(s, rx, ry, rw, rh, pix);
 
   for (uint32_t i = 0; i < hdr.nSubrects; i++) {
-    if (!ReadFromRFBServer((uint8_t *)&pix, sizeof(pix)))
+    if (!ReadFromRFBServer(s, (uint8_t *)&pix, sizeof(pix)))
       return false;
 
-    if (!ReadFromRFBServer((uint8_t *)&subrect, sz_rfbRectangle))
+    if (!ReadFromRFBServer(s, (uint8_t *)&subrect, sz_rfbRectangle))
       return false;
 
     subrect.x = Swap16IfLE(subrect.x);
@@ -60,7 +60,7 @@ HandleRREBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
     subrect.w = Swap16IfLE(subrect.w);
     subrect.h = Swap16IfLE(subrect.h);
 
-    FillBufferRectangle(rx + subrect.x, ry + subrect.y,
+    FillBufferRectangle(s, rx + subrect.x, ry + subrect.y,
                    subrect.w, subrect.h, pix);
   }
 
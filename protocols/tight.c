@@ -41,93 +41,113 @@
 #define FilterPaletteBPP CONCAT2E(FilterPalette,BPP)
 #define FilterGradientBPP CONCAT2E(FilterGradient,BPP)
 
+#define TightRectBPP CONCAT2E(TightRect,BPP)
+#define DecodeTightRectBPP CONCAT2E(DecodeTightRect,BPP)
+
 #if BPP != 8
+#define QueueJpegRectBPP CONCAT2E(QueueJpegRect,BPP)
 #define DecompressJpegRectBPP CONCAT2E(DecompressJpegRect,BPP)
 #endif
 
 #ifndef RGB_TO_PIXEL
 
 #define RGB_TO_PIXEL(bpp,r,g,b)                                         \
-  (((CARD##bpp)(r) & myFormat.redMax) << myFormat.redShift |            \
-   ((CARD##bpp)(g) & myFormat.greenMax) << myFormat.greenShift |        \
-   ((CARD##bpp)(b) & myFormat.blueMax) << myFormat.blueShift)
-
-#define RGB24_TO_PIXEL(bpp,r,g,b)                                       \
-   ((((CARD##bpp)(r) & 0xFF) * myFormat.redMax + 127) / 255             \
-    << myFormat.redShift |                                              \
-    (((CARD##bpp)(g) & 0xFF) * myFormat.greenMax + 127) / 255           \
-    << myFormat.greenShift |                                            \
-    (((CARD##bpp)(b) & 0xFF) * myFormat.blueMax + 127) / 255            \
-    << myFormat.blueShift)
+  (((CARD##bpp)(r) & s->format.redMax) << s->format.redShift |          \
+   ((CARD##bpp)(g) & s->format.greenMax) << s->format.greenShift |      \
+   ((CARD##bpp)(b) & s->format.blueMax) << s->format.blueShift)
 
 #define RGB24_TO_PIXEL32(r,g,b)                                         \
-  (((uint32_t)(r) & 0xFF) << myFormat.redShift |                          \
-   ((uint32_t)(g) & 0xFF) << myFormat.greenShift |                        \
-   ((uint32_t)(b) & 0xFF) << myFormat.blueShift)
+  (((uint32_t)(r) & 0xFF) << s->format.redShift |                       \
+   ((uint32_t)(g) & 0xFF) << s->format.greenShift |                     \
+   ((uint32_t)(b) & 0xFF) << s->format.blueShift)
 
 #endif
 
 /* Type declarations */
 
-typedef void (*filterPtrBPP)(size_t, CARDBPP *);
+typedef void (*filterPtrBPP)(Session *, struct TightFilter *, const uint8_t *, size_t,
+                             CARDBPP *);
+
+/* A rectangle's zlib data, queued for the thread decoding its stream */
+struct TightRectBPP {
+  uint32_t x, y, w, h;
+  filterPtrBPP filterFn;
+  uint_fast8_t bitsPixel;
+  struct TightFilter filter;
+  size_t length;
+  uint8_t data[];
+};
 
 /* Prototypes */
 
-static uint_fast8_t InitFilterCopyBPP (uint32_t rw, uint32_t rh);
-static uint_fast8_t InitFilterPaletteBPP (uint32_t rw, uint32_t rh);
-static uint_fast8_t InitFilterGradientBPP (uint32_t rw, uint32_t rh);
-static void FilterCopyBPP (size_t numRows, CARDBPP *destBuffer);
-static void FilterPaletteBPP (size_t numRows, CARDBPP *destBuffer);
-static void FilterGradientBPP (size_t numRows, CARDBPP *destBuffer);
+static uint_fast8_t InitFilterCopyBPP (Session *s, struct TightFilter *f, uint32_t rw,
+                                       uint32_t rh);
+static uint_fast8_t InitFilterPaletteBPP (Session *s, struct TightFilter *f, uint32_t rw,
+                                          uint32_t rh);
+static uint_fast8_t InitFilterGradientBPP (Session *s, struct TightFilter *f, uint32_t rw,
+                                           uint32_t rh);
+static void FilterCopyBPP (Session *s, struct TightFilter *f, const uint8_t *src,
+                           size_t numRows, CARDBPP *destBuffer);
+static void FilterPaletteBPP (Session *s, struct TightFilter *f, const uint8_t *src,
+                              size_t numRows, CARDBPP *destBuffer);
+static void FilterGradientBPP (Session *s, struct TightFilter *f, const uint8_t *src,
+                               size_t numRows, CARDBPP *destBuffer);
+
+static bool DecodeTightRectBPP(Session *s, void *data, void *scratch, bool *black);
 
-static bool DecompressJpegRectBPP(uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+#if BPP != 8
+static bool QueueJpegRectBPP(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+static bool DecompressJpegRectBPP(Session *s, void *data, void *scratch, bool *black);
+#endif
 
 /* Definitions */
 
 static bool
-HandleTightBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
+HandleTightBPP (Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
 {
+  struct Decoders *d = s->decoders;
+  struct TightRectBPP *r;
   CARDBPP fill_colour;
   uint8_t comp_ctl;
   uint8_t filter_id;
   filterPtrBPP filterFn;
-  z_streamp zs;
   uint8_t *buffer2;
-  int err, stream_id, compressedLen;
+  int stream_id, compressedLen;
   uint_fast8_t bitsPixel;
 
-  if (!ReadFromRFBServer((uint8_t *)&comp_ctl, 1))
+  if (!d->tightQueuesStarted && !StartTightQueues(s))
+    return false;
+
+  if (!ReadFromRFBServer(s, (uint8_t *)&comp_ctl, 1))
     return false;
 
-  /* Flush zlib streams if we are told by the server to do so. */
+  /* Flush zlib streams if we are told by the server to do so, once the
+     rectangles already queued on them have been decoded. */
   for (stream_id = 0; stream_id < 4; stream_id++) {
-    if ((comp_ctl & 1) && zlibStreamActive[stream_id]) {
-      if (inflateEnd (&zlibStream[stream_id]) != Z_OK &&
-          zlibStream[stream_id].msg != NULL)
-        fprintf(stderr, "inflateEnd: %s\n", zlibStream[stream_id].msg);
-      zlibStreamActive[stream_id] = false;
-    }
+    if ((comp_ctl & 1) &&
+        !DispatchDecodeJob(s, d->tightQueues[stream_id], ResetTightStream, NULL, 0, 0, 0, 0))
+      return false;
     comp_ctl >>= 1;
   }
 
   /* Handle solid rectangles. */
   if (comp_ctl == rfbTightFill) {
 #if BPP == 32
-    if (myFormat.depth == 24 && myFormat.redMax == 0xFF &&
-        myFormat.greenMax == 0xFF && myFormat.blueMax == 0xFF) {
-      if (!ReadFromRFBServer(buffer, 3))
+    if (s->format.depth == 24 && s->format.redMax == 0xFF &&
+        s->format.greenMax == 0xFF && s->format.blueMax == 0xFF) {
+      if (!ReadFromRFBServer(s, d->buffer, 3))
         return false;
-      fill_colour = RGB24_TO_PIXEL32(buffer[0], buffer[1], buffer[2]);
+      fill_colour = RGB24_TO_PIXEL32(d->buffer[0], d->buffer[1], d->buffer[2]);
     } else {
-      if (!ReadFromRFBServer((uint8_t*)&fill_colour, sizeof(fill_colour)))
+      if (!ReadFromRFBServer(s, (uint8_t*)&fill_colour, sizeof(fill_colour)))
         return false;
     }
 #else
-    if (!ReadFromRFBServer((uint8_t*)&fill_colour, sizeof(fill_colour)))
+    if (!ReadFromRFBServer(s, (uint8_t*)&fill_colour, sizeof(fill_colour)))
         return false;
 #endif
 
-    FillBufferRectangle(rx, ry, rw, rh, fill_colour);
+    FillBufferRectangle(s, rx, ry, rw, rh, fill_colour);
     return true;
   }
 
@@ -138,7 +158,7 @@ HandleTightBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
   }
 #else
   if (comp_ctl == rfbTightJpeg) {
-    return DecompressJpegRectBPP(rx, ry, rw, rh);
+    return QueueJpegRectBPP(s, rx, ry, rw, rh);
   }
 #endif
 
@@ -155,21 +175,21 @@ HandleTightBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
 
   /* First, we should identify a filter to use. */
   if ((comp_ctl & rfbTightExplicitFilter) != 0) {
-    if (!ReadFromRFBServer((uint8_t*)&filter_id, 1))
+    if (!ReadFromRFBServer(s, (uint8_t*)&filter_id, 1))
       return false;
 
     switch (filter_id) {
     case rfbTightFilterCopy:
       filterFn = FilterCopyBPP;
-      bitsPixel = InitFilterCopyBPP(rw, rh);
+      bitsPixel = InitFilterCopyBPP(s, &d->tightFilter, rw, rh);
       break;
     case rfbTightFilterPalette:
       filterFn = FilterPaletteBPP;
-      bitsPixel = InitFilterPaletteBPP(rw, rh);
+      bitsPixel = InitFilterPaletteBPP(s, &d->tightFilter, rw, rh);
       break;
     case rfbTightFilterGradient:
       filterFn = FilterGradientBPP;
-      bitsPixel = InitFilterGradientBPP(rw, rh);
+      bitsPixel = InitFilterGradientBPP(s, &d->tightFilter, rw, rh);
       break;
     default:
       fprintf(stderr, "Tight encoding: unknown filter code received.\n");
@@ -177,7 +197,7 @@ HandleTightBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
     }
   } else {
     filterFn = FilterCopyBPP;
-    bitsPixel = InitFilterCopyBPP(rw, rh);
+    bitsPixel = InitFilterCopyBPP(s, &d->tightFilter, rw, rh);
   }
   if (bitsPixel == 0) {
     fprintf(stderr, "Tight encoding: error receiving palette.\n");
@@ -187,27 +207,64 @@ HandleTightBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
   /* Determine if the data should be decompressed or just copied. */
   size_t rowSize = (size_t) (rw * bitsPixel + 7) / 8;
   if ((size_t)rh * rowSize < TIGHT_MIN_TO_COMPRESS) {
-    if (!ReadFromRFBServer((uint8_t*)buffer, (size_t)rh * rowSize))
+    if (!ReadFromRFBServer(s, (uint8_t*)d->buffer, (size_t)rh * rowSize))
       return false;
 
-    buffer2 = &buffer[TIGHT_MIN_TO_COMPRESS * 4];
-    filterFn(rh, (CARDBPP *)buffer2);
-    CopyDataToScreen(buffer2, rx, ry, rw, rh);
+    buffer2 = &d->buffer[TIGHT_MIN_TO_COMPRESS * 4];
+    filterFn(s, &d->tightFilter, d->buffer, rh, (CARDBPP *)buffer2);
+    CopyDataToScreen(s, buffer2, rx, ry, rw, rh);
 
     return true;
   }
 
   /* Read the length (1..3 bytes) of compressed data following. */
-  compressedLen = (int)ReadCompactLen();
+  compressedLen = (int)ReadCompactLen(s);
   if (compressedLen <= 0) {
     fprintf(stderr, "Incorrect data received from the server.\n");
     return false;
   }
 
-  /* Now let's initialize compression stream if needed. */
+  /* Read all the compressed data, and queue it to be decoded after the
+     rectangles before it on the same stream. */
+  r = malloc(sizeof(struct TightRectBPP) + (size_t)compressedLen);
+  if (r == NULL) {
+    fprintf(stderr, "Memory allocation error.\n");
+    return false;
+  }
+  r->x = rx;
+  r->y = ry;
+  r->w = rw;
+  r->h = rh;
+  r->filterFn = filterFn;
+  r->bitsPixel = bitsPixel;
+  memcpy(&r->filter, &d->tightFilter, sizeof(struct TightFilter));
+  r->length = (size_t)compressedLen;
+  if (!ReadFromRFBServer(s, r->data, r->length)) {
+    free(r);
+    return false;
+  }
+
   stream_id = comp_ctl & 0x03;
-  zs = &zlibStream[stream_id];
-  if (!zlibStreamActive[stream_id]) {
+  return DispatchDecodeJob(s, d->tightQueues[stream_id], DecodeTightRectBPP, r,
+                           rx, ry, rw, rh);
+}
+
+/*
+ * DecodeTightRectBPP() inflates a rectangle's data with its stream's
+ * state, filters it and draws it.
+ */
+
+static bool
+DecodeTightRectBPP(Session *s, void *data, void *scratch, bool *black)
+{
+  struct TightRectBPP *r = data;
+  struct TightStream *ts = scratch;
+  z_streamp zs = &ts->zs;
+  uint8_t *buffer2;
+  int err;
+
+  /* Now let's initialize compression stream if needed. */
+  if (!ts->active) {
     zs->zalloc = Z_NULL;
     zs->zfree = Z_NULL;
     zs->opaque = Z_NULL;
@@ -217,13 +274,14 @@ HandleTightBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
         fprintf(stderr, "InflateInit error: %s.\n", zs->msg);
       return false;
     }
-    zlibStreamActive[stream_id] = true;
+    ts->active = true;
   }
 
-  /* Read, decode and draw actual pixel data in a loop. */
+  /* Decode and draw actual pixel data in a loop. */
 
-  size_t bufferSize = BUFFER_SIZE * (size_t)bitsPixel / ((size_t)bitsPixel + BPP) & 0xFFFFFFFC;
-  buffer2 = &buffer[bufferSize];
+  size_t rowSize = (size_t) (r->w * r->bitsPixel + 7) / 8;
+  size_t bufferSize = BUFFER_SIZE * (size_t)r->bitsPixel / ((size_t)r->bitsPixel + BPP) & 0xFFFFFFFC;
+  buffer2 = &ts->buffer[bufferSize];
   if (rowSize > bufferSize) {
     /* Should be impossible when BUFFER_SIZE >= 16384 */
     fprintf(stderr, "Internal error: incorrect buffer size.\n");
@@ -233,57 +291,44 @@ HandleTightBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
   size_t rowsProcessed = 0;
   size_t extraBytes = 0;
 
-  while (compressedLen > 0) {
-    size_t portionLen;
-    if (compressedLen > ZLIB_BUFFER_SIZE)
-      portionLen = ZLIB_BUFFER_SIZE;
-    else
-      portionLen = (size_t) compressedLen;
-
-    if (!ReadFromRFBServer((uint8_t*)zlib_buffer, portionLen))
-      return false;
+  zs->next_in = (Bytef *)r->data;
+  zs->avail_in = (uInt) r->length;
 
-    assert((size_t)compressedLen > portionLen);
-    compressedLen -= (int) portionLen;
+  do {
+    zs->next_out = (Bytef *)&ts->buffer[extraBytes];
+    zs->avail_out = (uInt) (bufferSize - extraBytes);
 
-    zs->next_in = (Bytef *)zlib_buffer;
-    zs->avail_in = (uInt) portionLen;
-
-    do {
-      zs->next_out = (Bytef *)&buffer[extraBytes];
-      zs->avail_out = (uInt) (bufferSize - extraBytes);
-
-      err = inflate(zs, Z_SYNC_FLUSH);
-      if (err == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
-        break;
-      if (err != Z_OK && err != Z_STREAM_END) {
-        if (zs->msg != NULL) {
-          fprintf(stderr, "Inflate error: %s.\n", zs->msg);
-        } else {
-          fprintf(stderr, "Inflate error: %d.\n", err);
-        }
-        return false;
+    err = inflate(zs, Z_SYNC_FLUSH);
+    if (err == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
+      break;
+    if (err != Z_OK && err != Z_STREAM_END) {
+      if (zs->msg != NULL) {
+        fprintf(stderr, "Inflate error: %s.\n", zs->msg);
+      } else {
+        fprintf(stderr, "Inflate error: %d.\n", err);
       }
+      return false;
+    }
 
-      size_t numRows = (bufferSize - zs->avail_out) / rowSize;
+    size_t numRows = (bufferSize - zs->avail_out) / rowSize;
 
-      assert(rowsProcessed <= UINT32_MAX);
-      assert(ry + rowsProcessed <= SIZE_MAX);
-      assert(numRows <= UINT32_MAX);
+    assert(rowsProcessed <= UINT32_MAX);
+    assert(r->y + rowsProcessed <= SIZE_MAX);
+    assert(numRows <= UINT32_MAX);
 
-      filterFn(numRows, (CARDBPP *)buffer2);
+    r->filterFn(s, &r->filter, ts->buffer, numRows, (CARDBPP *)buffer2);
 
-      extraBytes = bufferSize - zs->avail_out - numRows * rowSize;
-      if (extraBytes > 0)
-        memcpy(buffer, &buffer[numRows * rowSize], extraBytes);
+    extraBytes = bufferSize - zs->avail_out - numRows * rowSize;
+    if (extraBytes > 0)
+      memcpy(ts->buffer, &ts->buffer[numRows * rowSize], extraBytes);
 
-      CopyDataToScreen(buffer2, rx, ry + (uint32_t)rowsProcessed, rw, (uint32_t)numRows);
-      rowsProcessed += numRows;
-    }
-    while (zs->avail_out == 0);
+    *black = PaintDataToScreen(s, buffer2, r->x, r->y + (uint32_t)rowsProcessed, r->w,
+                               (uint32_t)numRows, *black);
+    rowsProcessed += numRows;
   }
+  while (zs->avail_out == 0);
 
-  if (rowsProcessed != rh) {
+  if (rowsProcessed != r->h) {
     fprintf(stderr, "Incorrect number of scan lines after decompression.\n");
     return false;
   }
@@ -298,64 +343,67 @@ HandleTightBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
  */
 
 /*
-   The following variables are defined in rfbproto.c:
-     static bool cutZeros;
-     static uint32_t rectWidth, rectColors;
-     static uint8_t tightPalette[256*4];
-     static uint8_t tightPrevRow[2048*3*sizeof(uint16_t)];
+   The filters keep their state in a struct TightFilter: the session's
+   while a rectangle's filter is read, and the rectangle's own copy once
+   it is queued to be decoded.
 */
 
 static uint_fast8_t
-InitFilterCopyBPP (uint32_t rw, uint32_t rh)
+InitFilterCopyBPP (Session *s, struct TightFilter *f, uint32_t rw, uint32_t rh)
 {
   (void) rh;
-  rectWidth = rw;
+  f->rectWidth = rw;
 
 #if BPP == 32
-  if (myFormat.depth == 24 && myFormat.redMax == 0xFF &&
-      myFormat.greenMax == 0xFF && myFormat.blueMax == 0xFF) {
-    cutZeros = true;
+  if (s->format.depth == 24 && s->format.redMax == 0xFF &&
+      s->format.greenMax == 0xFF && s->format.blueMax == 0xFF) {
+    f->cutZeros = true;
     return 24;
   } else {
-    cutZeros = false;
+    f->cutZeros = false;
   }
+#else
+  (void) s;
 #endif
 
   return BPP;
 }
 
 static void
-FilterCopyBPP (size_t numRows, CARDBPP *dst)
+FilterCopyBPP (Session *s, struct TightFilter *f, const uint8_t *src, size_t numRows,
+               CARDBPP *dst)
 {
 #if BPP == 32
   size_t x, y;
 
-  if (cutZeros) {
+  if (f->cutZeros) {
     for (y = 0; y < numRows; y++) {
-      for (x = 0; x < rectWidth; x++) {
-        dst[y*rectWidth+x] =
-          RGB24_TO_PIXEL32(buffer[(y*rectWidth+x)*3],
-                           buffer[(y*rectWidth+x)*3+1],
-                           buffer[(y*rectWidth+x)*3+2]);
+      for (x = 0; x < f->rectWidth; x++) {
+        dst[y*f->rectWidth+x] =
+          RGB24_TO_PIXEL32(src[(y*f->rectWidth+x)*3],
+                           src[(y*f->rectWidth+x)*3+1],
+                           src[(y*f->rectWidth+x)*3+2]);
       }
     }
     return;
   }
+#else
+  (void) s;
 #endif
 
-  memcpy (dst, buffer, numRows * rectWidth * (BPP / 8));
+  memcpy (dst, src, numRows * f->rectWidth * (BPP / 8));
 }
 
 static uint_fast8_t
-InitFilterGradientBPP (uint32_t rw, uint32_t rh)
+InitFilterGradientBPP (Session *s, struct TightFilter *f, uint32_t rw, uint32_t rh)
 {
   uint_fast8_t bits;
 
-  bits = InitFilterCopyBPP(rw, rh);
-  if (cutZeros)
-    memset(tightPrevRow, 0, rw * 3);
+  bits = InitFilterCopyBPP(s, f, rw, rh);
+  if (f->cutZeros)
+    memset(f->tightPrevRow, 0, rw * 3);
   else
-    memset(tightPrevRow, 0, rw * 3 * sizeof(uint16_t));
+    memset(f->tightPrevRow, 0, rw * 3 * sizeof(uint16_t));
 
   return bits;
 }
@@ -363,7 +411,8 @@ InitFilterGradientBPP (uint32_t rw, uint32_t rh)
 #if BPP == 32
 
 static void
-FilterGradient24 (size_t numRows, uint32_t *dst)
+FilterGradient24 (Session *s, struct TightFilter *f, const uint8_t *src, size_t numRows,
+                  uint32_t *dst)
 {
   size_t x, y, c;
   uint8_t thisRow[2048*3];
@@ -374,39 +423,40 @@ FilterGradient24 (size_t numRows, uint32_t *dst)
 
     /* First pixel in a row */
     for (c = 0; c < 3; c++) {
-      pix[c] = (uint8_t) (tightPrevRow[c] + buffer[y*rectWidth*3+c]);
+      pix[c] = (uint8_t) (f->tightPrevRow[c] + src[y*f->rectWidth*3+c]);
       thisRow[c] = pix[c];
     }
-    dst[y*rectWidth] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+    dst[y*f->rectWidth] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
 
     /* Remaining pixels of a row */
-    for (x = 1; x < rectWidth; x++) {
+    for (x = 1; x < f->rectWidth; x++) {
       for (c = 0; c < 3; c++) {
-        est[c] = (int)tightPrevRow[x*3+c] + (int)pix[c] -
-                 (int)tightPrevRow[(x-1)*3+c];
+        est[c] = (int)f->tightPrevRow[x*3+c] + (int)pix[c] -
+                 (int)f->tightPrevRow[(x-1)*3+c];
         if (est[c] > 0xFF) {
           est[c] = 0xFF;
         } else if (est[c] < 0x00) {
           est[c] = 0x00;
         }
-        pix[c] = (uint8_t)(est[c] + buffer[(y*rectWidth+x)*3+c]);
+        pix[c] = (uint8_t)(est[c] + src[(y*f->rectWidth+x)*3+c]);
         thisRow[x*3+c] = pix[c];
       }
-      dst[y*rectWidth+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
+      dst[y*f->rectWidth+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
     }
 
-    memcpy(tightPrevRow, thisRow, rectWidth * 3);
+    memcpy(f->tightPrevRow, thisRow, f->rectWidth * 3);
   }
 }
 
 #endif
 
 static void
-FilterGradientBPP (size_t numRows, CARDBPP *dst)
+FilterGradientBPP (Session *s, struct TightFilter *f, const uint8_t *srcBytes,
+                   size_t numRows, CARDBPP *dst)
 {
   size_t x, y, c;
-  CARDBPP *src = (CARDBPP *)buffer;
-  uint16_t *thatRow = (uint16_t *)tightPrevRow;
+  const CARDBPP *src = (const CARDBPP *)srcBytes;
+  uint16_t *thatRow = (uint16_t *)f->tightPrevRow;
   uint16_t thisRow[2048*3];
   uint16_t pix[3];
   uint16_t max[3];
@@ -414,32 +464,32 @@ FilterGradientBPP (size_t numRows, CARDBPP *dst)
   int est[3];
 
 #if BPP == 32
-  if (cutZeros) {
-    FilterGradient24(numRows, dst);
+  if (f->cutZeros) {
+    FilterGradient24(s, f, srcBytes, numRows, dst);
 
     return;
   }
 #endif
 
-  max[0] = myFormat.redMax;
-  max[1] = myFormat.greenMax;
-  max[2] = myFormat.blueMax;
+  max[0] = s->format.redMax;
+  max[1] = s->format.greenMax;
+  max[2] = s->format.blueMax;
 
-  shift[0] = myFormat.redShift;
-  shift[1] = myFormat.greenShift;
-  shift[2] = myFormat.blueShift;
+  shift[0] = s->format.redShift;
+  shift[1] = s->format.greenShift;
+  shift[2] = s->format.blueShift;
 
   for (y = 0; y < numRows; y++) {
 
     /* First pixel in a row */
     for (c = 0; c < 3; c++) {
-      pix[c] = (uint16_t)(((src[y*rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
+      pix[c] = (uint16_t)(((src[y*f->rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
       thisRow[c] = pix[c];
     }
-    dst[y*rectWidth] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
+    dst[y*f->rectWidth] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
 
     /* Remaining pixels of a row */
-    for (x = 1; x < rectWidth; x++) {
+    for (x = 1; x < f->rectWidth; x++) {
       for (c = 0; c < 3; c++) {
         est[c] = (int)thatRow[x*3+c] + (int)pix[c] - (int)thatRow[(x-1)*3+c];
         if (est[c] > (int)max[c]) {
@@ -447,73 +497,74 @@ FilterGradientBPP (size_t numRows, CARDBPP *dst)
         } else if (est[c] < 0) {
           est[c] = 0;
         }
-        pix[c] = (uint16_t)(((src[y*rectWidth+x] >> shift[c]) + (uint16_t)est[c]) & max[c]);
+        pix[c] = (uint16_t)(((src[y*f->rectWidth+x] >> shift[c]) + (uint16_t)est[c]) & max[c]);
         thisRow[x*3+c] = pix[c];
       }
-      dst[y*rectWidth+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
+      dst[y*f->rectWidth+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
     }
-    memcpy(thatRow, thisRow, rectWidth * 3 * sizeof(uint16_t));
+    memcpy(thatRow, thisRow, f->rectWidth * 3 * sizeof(uint16_t));
   }
 }
 
 static uint_fast8_t
-InitFilterPaletteBPP (uint32_t rw, uint32_t rh)
+InitFilterPaletteBPP (Session *s, struct TightFilter *f, uint32_t rw, uint32_t rh)
 {
   (void) rh;
 
-  rectWidth = rw;
+  f->rectWidth = rw;
 
   uint8_t numColors;
-  if (!ReadFromRFBServer((uint8_t*)&numColors, 1))
+  if (!ReadFromRFBServer(s, (uint8_t*)&numColors, 1))
     return 0;
 
-  rectColors = (int)numColors;
-  if (++rectColors < 2)
+  f->rectColors = (int)numColors;
+  if (++f->rectColors < 2)
     return 0;
 
 #if BPP == 32
-  CARDBPP *palette = (CARDBPP *)tightPalette;
-  if (myFormat.depth == 24 && myFormat.redMax == 0xFF &&
-      myFormat.greenMax == 0xFF && myFormat.blueMax == 0xFF) {
-    if (!ReadFromRFBServer((uint8_t*)&tightPalette, rectColors * 3))
+  CARDBPP *palette = (CARDBPP *)f->tightPalette;
+  if (s->format.depth == 24 && s->format.redMax == 0xFF &&
+      s->format.greenMax == 0xFF && s->format.blueMax == 0xFF) {
+    if (!ReadFromRFBServer(s, (uint8_t*)&f->tightPalette, f->rectColors * 3))
       return 0;
-    for (ssize_t i = rectColors - 1; i >= 0; i--) {
-      palette[i] = RGB24_TO_PIXEL32(tightPalette[i*3],
-                                    tightPalette[i*3+1],
-                                    tightPalette[i*3+2]);
+    for (ssize_t i = f->rectColors - 1; i >= 0; i--) {
+      palette[i] = RGB24_TO_PIXEL32(f->tightPalette[i*3],
+                                    f->tightPalette[i*3+1],
+                                    f->tightPalette[i*3+2]);
     }
-    return (rectColors == 2) ? 1 : 8;
+    return (f->rectColors == 2) ? 1 : 8;
   }
 #endif
 
-  if (!ReadFromRFBServer((uint8_t*)&tightPalette, rectColors * (BPP / 8)))
+  if (!ReadFromRFBServer(s, (uint8_t*)&f->tightPalette, f->rectColors * (BPP / 8)))
     return 0;
 
-  return (rectColors == 2) ? 1 : 8;
+  return (f->rectColors == 2) ? 1 : 8;
 }
 
 static void
-FilterPaletteBPP (size_t numRows, CARDBPP *dst)
+FilterPaletteBPP (Session *s, struct TightFilter *f, const uint8_t *src, size_t numRows,
+                  CARDBPP *dst)
 {
   size_t x, y, w;
-  uint8_t *src = (uint8_t *)buffer;
-  CARDBPP *palette = (CARDBPP *)tightPalette;
+  CARDBPP *palette = (CARDBPP *)f->tightPalette;
+  (void) s;
 
-  if (rectColors == 2) {
-    w = (rectWidth + 7) / 8;
+  if (f->rectColors == 2) {
+    w = (f->rectWidth + 7) / 8;
     for (y = 0; y < numRows; y++) {
-      for (x = 0; x < rectWidth / 8; x++) {
+      for (x = 0; x < f->rectWidth / 8; x++) {
         for (int b = 7; b >= 0; b--)
-          dst[y*rectWidth+x*8+7-(size_t)b] = palette[src[y*w+x] >> b & 1];
+          dst[y*f->rectWidth+x*8+7-(size_t)b] = palette[src[y*w+x] >> b & 1];
       }
-      for (int b = 7; b >= (int)(8 - rectWidth % 8); b--) {
-        dst[y*rectWidth+x*8+7-(size_t)b] = palette[src[y*w+x] >> b & 1];
+      for (int b = 7; b >= (int)(8 - f->rectWidth % 8); b--) {
+        dst[y*f->rectWidth+x*8+7-(size_t)b] = palette[src[y*w+x] >> b & 1];
       }
     }
   } else {
     for (y = 0; y < numRows; y++)
-      for (x = 0; x < rectWidth; x++)
-        dst[y*rectWidth+x] = palette[(int)src[y*rectWidth+x]];
+      for (x = 0; x < f->rectWidth; x++)
+        dst[y*f->rectWidth+x] = palette[(int)src[y*f->rectWidth+x]];
   }
 }
 
@@ -526,80 +577,123 @@ FilterPaletteBPP (size_t numRows, CARDBPP *dst)
  */
 
 /*
-   The following variables are defined in rfbproto.c:
-     static bool jpegError;
-     static struct jpeg_source_mgr jpegSrcManager;
-     static JOCTET *jpegBufferPtr;
-     static size_t *jpegBufferLen;
+   QueueJpegRectBPP() reads a JPEG rectangle's compressed data and queues
+   it to be decoded by DecompressJpegRectBPP(), which keeps its decompressor
+   and JPEG source manager in the thread's struct TightJpeg. The frame
+   buffer holds the same RGB bytes libjpeg produces, whatever the pixel
+   format, so the pixels are decoded straight into it.
 */
 
 static bool
-DecompressJpegRectBPP(uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+QueueJpegRectBPP(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
-  struct jpeg_decompress_struct cinfo;
-  struct jpeg_error_mgr jerr;
+  struct Decoders *d = s->decoders;
+  struct JpegRect *jr;
   int compressedLen;
-  uint8_t *compressedData;
-  CARDBPP *pixelPtr;
-  JSAMPROW rowPointer[1];
 
-  compressedLen = (int)ReadCompactLen();
+  compressedLen = (int)ReadCompactLen(s);
   if (compressedLen <= 0) {
     fprintf(stderr, "Incorrect data received from the server.\n");
     return false;
   }
 
-  compressedData = malloc((size_t)compressedLen);
-  if (compressedData == NULL) {
+  jr = malloc(sizeof(struct JpegRect) + (size_t)compressedLen);
+  if (jr == NULL) {
     fprintf(stderr, "Memory allocation error.\n");
     return false;
   }
-
-  if (!ReadFromRFBServer((uint8_t*)compressedData, (size_t)compressedLen)) {
-    free(compressedData);
+  jr->x = x;
+  jr->y = y;
+  jr->w = w;
+  jr->h = h;
+  jr->length = (size_t)compressedLen;
+
+  if (!ReadFromRFBServer(s, jr->data, jr->length)) {
+    free(jr);
     return false;
   }
 
-  cinfo.err = jpeg_std_error(&jerr);
-  jpeg_create_decompress(&cinfo);
+  return DispatchDecodeJob(s, d->jpegQueue, DecompressJpegRectBPP, jr, x, y, w, h);
+}
+
+static bool
+DecompressJpegRectBPP(Session *s, void *data, void *scratch, bool *black)
+{
+  struct JpegRect *jr = data;
+  struct TightJpeg *tj = scratch;
+  struct jpeg_decompress_struct *cinfo = &tj->cinfo;
+  size_t bytesPerPixel = ScreenBytesPerPixel(s);
+  bool direct = bytesPerPixel == 3;
+
+  if (!tj->created) {
+    cinfo->err = jpeg_std_error(&tj->jerr);
+    jpeg_create_decompress(cinfo);
+    tj->created = true;
+  }
+  if (tj->rowsSize < jr->h) {
+    JSAMPROW *rows = realloc(tj->rows, jr->h * sizeof(JSAMPROW));
+    if (rows == NULL) {
+      fprintf(stderr, "Memory allocation error.\n");
+      return false;
+    }
+    tj->rows = rows;
+    tj->rowsSize = jr->h;
+  }
 
-  JpegSetSrcManager(&cinfo, compressedData, (size_t)compressedLen);
+  JpegSetSrcManager(cinfo, &tj->src, jr->data, jr->length);
 
-  jpeg_read_header(&cinfo, TRUE);
-  cinfo.out_color_space = JCS_RGB;
+  jpeg_read_header(cinfo, TRUE);
+  cinfo->out_color_space = JCS_RGB;
+#ifdef JCS_EXTENSIONS
+  if (!direct) {
+    cinfo->out_color_space = JCS_EXT_RGBX;
+    direct = true;
+  }
+#endif
 
-  jpeg_start_decompress(&cinfo);
-  if (cinfo.output_width != (unsigned int) w || cinfo.output_height != (unsigned int) h ||
-      cinfo.output_components != 3) {
+  jpeg_start_decompress(cinfo);
+  if (cinfo->output_width != (unsigned int) jr->w ||
+      cinfo->output_height != (unsigned int) jr->h ||
+      cinfo->output_components != (direct ? (int) bytesPerPixel : 3)) {
     fprintf(stderr, "Tight Encoding: Wrong JPEG data received.\n");
-    jpeg_destroy_decompress(&cinfo);
-    free(compressedData);
+    jpeg_abort_decompress(cinfo);
     return false;
   }
 
-  rowPointer[0] = (JSAMPROW)buffer;
-  uint32_t dy = 0;
-  while (cinfo.output_scanline < cinfo.output_height) {
-    jpeg_read_scanlines(&cinfo, rowPointer, 1);
-    if (jpegError) {
-      break;
+  /* Let libjpeg have every row left at once, so that it can return all
+     it has decoded in one call. */
+  ScreenRows(s, (uint8_t **)tj->rows, jr->x, jr->y, jr->h);
+  while (cinfo->output_scanline < cinfo->output_height && !tj->src.error) {
+    JDIMENSION row = cinfo->output_scanline;
+
+    if (direct) {
+      jpeg_read_scanlines(cinfo, &tj->rows[row], cinfo->output_height - row);
     }
-    pixelPtr = (CARDBPP *)&buffer[BUFFER_SIZE / 2];
-    for (size_t dx = 0; dx < w; dx++) {
-      *pixelPtr++ =
-        RGB24_TO_PIXEL(BPP, buffer[dx*3], buffer[dx*3+1], buffer[dx*3+2]);
+#ifndef JCS_EXTENSIONS
+    else {
+      JSAMPROW rgbRows[JPEG_MAX_ROWS];
+      JDIMENSION n = (JDIMENSION) (BUFFER_SIZE / ((size_t)jr->w * 3));
+
+      if (n > JPEG_MAX_ROWS)
+        n = JPEG_MAX_ROWS;
+      for (JDIMENSION i = 0; i < n; i++)
+        rgbRows[i] = &tj->buffer[(size_t)i * jr->w * 3];
+      n = jpeg_read_scanlines(cinfo, rgbRows, n);
+      for (JDIMENSION i = 0; i < n; i++)
+        UnpackRGB(tj->rows[row + i], rgbRows[i], jr->w);
     }
-    CopyDataToScreen(&buffer[BUFFER_SIZE / 2], x, y + dy, w, 1);
-    dy++;
+#endif
   }
 
-  if (!jpegError)
-    jpeg_finish_decompress(&cinfo);
-
-  jpeg_destroy_decompress(&cinfo);
-  free(compressedData);
+  if (tj->src.error) {
+    jpeg_abort_decompress(cinfo);
+    return false;
+  }
+  jpeg_finish_decompress(cinfo);
 
-  return !jpegError;
+  if (*black)
+    *black = ScreenRectangleIsBlack(s, jr->x, jr->y, jr->w, jr->h);
+  return true;
 }
 
 #endif
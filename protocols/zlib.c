@@ -37,8 +37,9 @@
 #endif
 
 static bool
-HandleZlibBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
+HandleZlibBPP (Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
 {
+  struct Decoders *d = s->decoders;
   rfbZlibHeader hdr;
   size_t remaining;
   int inflateResult;
@@ -51,46 +52,46 @@ HandleZlibBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
    * first update.
    */
   size_t requested_size = (size_t)(( rw * rh ) * ( BPP / 8 ));
-  if ( raw_buffer_size < requested_size) {
+  if ( d->raw_buffer_size < requested_size) {
 
-    if ( raw_buffer != NULL ) {
+    if ( d->raw_buffer != NULL ) {
 
-      free( raw_buffer );
+      free( d->raw_buffer );
 
     }
 
-    raw_buffer_size = requested_size;
-    raw_buffer = (uint8_t*) malloc( raw_buffer_size );
+    d->raw_buffer_size = requested_size;
+    d->raw_buffer = (uint8_t*) malloc( d->raw_buffer_size );
 
   }
 
-  if (!ReadFromRFBServer((uint8_t *)&hdr, sz_rfbZlibHeader))
+  if (!ReadFromRFBServer(s, (uint8_t *)&hdr, sz_rfbZlibHeader))
     return false;
 
   remaining = Swap32IfLE(hdr.nBytes);
 
   /* Need to initialize the decompressor state. */
-  decompStream.next_in   = ( Bytef * )buffer;
-  decompStream.avail_in  = 0;
-  decompStream.next_out  = ( Bytef * )raw_buffer;
-  decompStream.avail_out = (uInt) raw_buffer_size;
-  assert(decompStream.avail_out == raw_buffer_size);
-  decompStream.data_type = Z_BINARY;
+  d->decompStream.next_in   = ( Bytef * )d->buffer;
+  d->decompStream.avail_in  = 0;
+  d->decompStream.next_out  = ( Bytef * )d->raw_buffer;
+  d->decompStream.avail_out = (uInt) d->raw_buffer_size;
+  assert(d->decompStream.avail_out == d->raw_buffer_size);
+  d->decompStream.data_type = Z_BINARY;
 
   /* Initialize the decompression stream structures on the first invocation. */
-  if ( decompStreamInited == false ) {
+  if ( d->decompStreamInited == false ) {
 
-    inflateResult = inflateInit( &decompStream );
+    inflateResult = inflateInit( &d->decompStream );
 
     if ( inflateResult != Z_OK ) {
       fprintf(stderr,
               "inflateInit returned error: %d, msg: %s\n",
               inflateResult,
-              decompStream.msg);
+              d->decompStream.msg);
       return false;
     }
 
-    decompStreamInited = true;
+    d->decompStreamInited = true;
 
   }
 
@@ -110,15 +111,15 @@ HandleZlibBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
     }
 
     /* Fill the buffer, obtaining data from the server. */
-    if (!ReadFromRFBServer(buffer,toRead))
+    if (!ReadFromRFBServer(s, d->buffer,toRead))
       return false;
 
-    decompStream.next_in  = ( Bytef * )buffer;
-    decompStream.avail_in = (uInt) toRead;
-    assert(decompStream.avail_in == toRead);
+    d->decompStream.next_in  = ( Bytef * )d->buffer;
+    d->decompStream.avail_in = (uInt) toRead;
+    assert(d->decompStream.avail_in == toRead);
 
     /* Need to uncompress buffer full. */
-    inflateResult = inflate( &decompStream, Z_SYNC_FLUSH );
+    inflateResult = inflate( &d->decompStream, Z_SYNC_FLUSH );
 
     /* We never supply a dictionary for compression. */
     if ( inflateResult == Z_NEED_DICT ) {
@@ -129,15 +130,15 @@ HandleZlibBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
       fprintf(stderr,
               "zlib inflate returned error: %d, msg: %s\n",
               inflateResult,
-              decompStream.msg);
+              d->decompStream.msg);
       return false;
     }
 
     /* Result buffer allocated to be at least large enough.  We should
      * never run out of space!
      */
-    if (( decompStream.avail_in > 0 ) &&
-        ( decompStream.avail_out <= 0 )) {
+    if (( d->decompStream.avail_in > 0 ) &&
+        ( d->decompStream.avail_out <= 0 )) {
       fprintf(stderr,"zlib inflate ran out of space!\n");
       return false;
     }
@@ -149,7 +150,7 @@ HandleZlibBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
   if ( inflateResult == Z_OK ) {
 
     /* Put the uncompressed contents of the update on the screen. */
-    CopyDataToScreen(raw_buffer, rx, ry, rw, rh);
+    CopyDataToScreen(s, d->raw_buffer, rx, ry, rw, rh);
 
   }
   else {
@@ -157,7 +158,7 @@ HandleZlibBPP (uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh)
     fprintf(stderr,
             "zlib inflate returned error: %d, msg: %s\n",
             inflateResult,
-            decompStream.msg);
+            d->decompStream.msg);
     return false;
 
   }
@@ -0,0 +1,145 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * qoiwrite.c - write a QOI ("Quite OK Image") file.
+ *
+ * QOI is a lossless format that a single pass of a few comparisons per
+ * pixel encodes, many times faster than even the quickest PNG settings,
+ * with files usually not much larger for screen content. Each pixel is
+ * written as a run of the previous pixel, an index into a table of
+ * recently seen pixels, a small difference from the previous pixel, or in
+ * full. See https://qoiformat.org/qoi-specification.pdf.
+ */
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vncsnapshot.h"
+
+#define QOI_OP_INDEX 0x00   /* 00xxxxxx */
+#define QOI_OP_DIFF  0x40   /* 01xxxxxx */
+#define QOI_OP_LUMA  0x80   /* 10xxxxxx */
+#define QOI_OP_RUN   0xc0   /* 11xxxxxx */
+#define QOI_OP_RGB   0xfe
+
+#define QOI_HASH(r, g, b) (((r) * 3 + (g) * 5 + (b) * 7 + 255 * 11) % 64)
+
+#define OUT_BUFFER_SIZE 65536
+
+static void PutUint32(uint8_t *p, uint32_t value);
+
+
+/*
+ * write_QOI() writes a packed RGB image to filename as a QOI file.
+ */
+
+void
+write_QOI(char *filename, uint8_t *image, uint32_t width, uint32_t height)
+{
+    static const uint8_t end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    uint8_t out[OUT_BUFFER_SIZE];
+    uint8_t seen[64][3] = { { 0 } };
+    uint8_t pr = 0, pg = 0, pb = 0;     /* previous pixel */
+    size_t pixels = (size_t)width * height;
+    size_t len = 0, i;
+    unsigned int run = 0;
+    FILE *outfile;
+
+    outfile = fopen(filename, "wb");
+    if (!outfile) err(1, "couldn't fopen %s", filename);
+
+    /* The decoder's table starts out transparent black, which no pixel of
+     * ours is, but an all-zero table here would match opaque black. */
+    seen[QOI_HASH(0, 0, 0)][0] = 1;
+
+    memcpy(out, "qoif", 4);
+    PutUint32(out + 4, width);
+    PutUint32(out + 8, height);
+    out[12] = 3;        /* RGB */
+    out[13] = 0;        /* sRGB with linear alpha */
+    len = 14;
+
+    for (i = 0; i < pixels; i++) {
+        uint8_t r = image[i * 3], g = image[i * 3 + 1], b = image[i * 3 + 2];
+
+        /* Room for the longest op and a run left pending */
+        if (len > OUT_BUFFER_SIZE - 8) {
+            if (fwrite(out, 1, len, outfile) != len) err(1, "couldn't write %s", filename);
+            len = 0;
+        }
+
+        if (r == pr && g == pg && b == pb) {
+            if (++run == 62) {
+                out[len++] = (uint8_t) (QOI_OP_RUN | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out[len++] = (uint8_t) (QOI_OP_RUN | (run - 1));
+            run = 0;
+        }
+
+        unsigned int index = (unsigned int) QOI_HASH(r, g, b);
+        if (seen[index][0] == r && seen[index][1] == g && seen[index][2] == b) {
+            out[len++] = (uint8_t) (QOI_OP_INDEX | index);
+        } else {
+            /* Differences wrap around, as the decoder's sums do */
+            int dr = (int8_t) (r - pr), dg = (int8_t) (g - pg), db = (int8_t) (b - pb);
+            int drg = dr - dg, dbg = db - dg;
+
+            seen[index][0] = r;
+            seen[index][1] = g;
+            seen[index][2] = b;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out[len++] = (uint8_t) (QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                out[len++] = (uint8_t) (QOI_OP_LUMA | (dg + 32));
+                out[len++] = (uint8_t) ((drg + 8) << 4 | (dbg + 8));
+            } else {
+                out[len++] = QOI_OP_RGB;
+                out[len++] = r;
+                out[len++] = g;
+                out[len++] = b;
+            }
+        }
+        pr = r;
+        pg = g;
+        pb = b;
+    }
+    if (run > 0) {
+        out[len++] = (uint8_t) (QOI_OP_RUN | (run - 1));
+    }
+
+    if (fwrite(out, 1, len, outfile) != len ||
+        fwrite(end, 1, sizeof(end), outfile) != sizeof(end)) {
+        err(1, "couldn't write %s", filename);
+    }
+    (void) fclose(outfile);
+}
+
+static void
+PutUint32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t) (value >> 24);
+    p[1] = (uint8_t) (value >> 16);
+    p[2] = (uint8_t) (value >> 8);
+    p[3] = (uint8_t) value;
+}
@@ -48,7 +48,7 @@ enum { DEFAULT_BUF_SIZE = 8192,
        MIN_BULK_SIZE = 1024 };
 
 FdInStream::FdInStream(int fd_, int timeout_, size_t bufSize_)
-  : fd(fd_), timeout(timeout_), blockCallback(0), blockCallbackArg(0),
+  : fd(fd_), recordFd(-1), timeout(timeout_), blockCallback(0), blockCallbackArg(0),
     timeWaitedIn100us(5), timedKbits(0),
     bufSize(bufSize_ ? bufSize_ : DEFAULT_BUF_SIZE), offset(0)
 {
@@ -57,7 +57,7 @@ FdInStream::FdInStream(int fd_, int timeout_, size_t bufSize_)
 
 FdInStream::FdInStream(int fd_, void (*blockCallback_)(void*),
                        void* blockCallbackArg_, size_t bufSize_)
-  : fd(fd_), timeout(0), blockCallback(blockCallback_),
+  : fd(fd_), recordFd(-1), timeout(0), blockCallback(blockCallback_),
     blockCallbackArg(blockCallbackArg_),
     timeWaitedIn100us(5), timedKbits(0),
     bufSize(bufSize_ ? bufSize_ : DEFAULT_BUF_SIZE), offset(0)
@@ -164,5 +164,27 @@ size_t FdInStream::readWithTimeoutOrCallback(void* buf, size_t len)
 
   if (n_read < 0) throw SystemException("read",errno);
   if (n_read == 0) throw EndOfStream();
+  if (recordFd >= 0) writeRecord(buf, n_read);
   return n_read;
 }
+
+void FdInStream::record(int recordFd_)
+{
+  recordFd = recordFd_;
+  writeRecord(ptr, end - ptr);
+}
+
+void FdInStream::writeRecord(const void* buf, size_t len)
+{
+  const uint8_t* data = (const uint8_t*)buf;
+
+  while (len > 0) {
+    ssize_t n = ::write(recordFd, data, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw SystemException("write",errno);
+    }
+    data += n;
+    len -= n;
+  }
+}
@@ -43,6 +43,11 @@ namespace rdr {
     void readBytes(void* data, size_t length);
     size_t bytesInBuf() { return end - ptr; }
 
+    // record() copies everything read from now on, starting with any data
+    // already buffered, to the file descriptor recordFd.
+
+    void record(int recordFd);
+
     void startTiming();
     void stopTiming();
     unsigned int kbitsPerSecond();
@@ -54,8 +59,10 @@ namespace rdr {
   private:
     int checkReadable(int fd, int timeout);
     size_t readWithTimeoutOrCallback(void* buf, size_t len);
+    void writeRecord(const void* buf, size_t len);
 
     int fd;
+    int recordFd;
     int timeout;
     void (*blockCallback)(void*);
     void* blockCallbackArg;
@@ -0,0 +1,57 @@
+//
+// Copyright (C) 2002 RealVNC Ltd.  All Rights Reserved.
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this software; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+// USA.
+
+//
+// rdr::MemInStream is an InStream which streams from a given memory buffer.
+// The buffer is not copied, so it must outlive the stream.
+//
+
+#ifndef __RDR_MEMINSTREAM_H__
+#define __RDR_MEMINSTREAM_H__
+
+#include "InStream.h"
+#include "Exception.h"
+
+namespace rdr {
+
+  class MemInStream : public InStream {
+
+  public:
+
+    MemInStream(const void* data, size_t len) {
+      ptr = start = (const uint8_t*)data;
+      end = start + len;
+    }
+
+    size_t pos() { return ptr - start; }
+
+    size_t bytesLeft() { return end - ptr; }
+
+  private:
+
+    size_t overrun(size_t itemSize, size_t nItems) {
+      (void) itemSize; (void) nItems;
+      throw EndOfStream();
+    }
+
+    const uint8_t* start;
+  };
+
+}
+
+#endif
@@ -128,3 +128,44 @@ void ZlibInStream::decompress()
   end = zs->next_out;
   underlying->setptr(zs->next_in);
 }
+
+size_t ZlibInStream::decompressTo(uint8_t* data, size_t length)
+{
+  if (!underlying)
+    throw Exception("ZlibInStream decompressTo: no underlying stream");
+  assert(ptr == end);
+
+  zs->next_out = data;
+  zs->avail_out = (uInt) length;
+  assert(zs->avail_out == length);
+
+  // Input may be consumed without any output; once it has all gone, zlib
+  // may still hold some output back.
+  while (zs->avail_out == length) {
+    if (bytesIn > 0) {
+      underlying->check(1);
+      zs->next_in = (uint8_t*)underlying->getptr();
+      ptrdiff_t avail_in = underlying->getend() - underlying->getptr();
+      zs->avail_in = (uInt) avail_in;
+      assert(zs->avail_in == avail_in);
+      if ((size_t)zs->avail_in > bytesIn) {
+        zs->avail_in = (uInt) bytesIn;
+      }
+    } else {
+      zs->avail_in = 0;
+    }
+
+    int rc = inflate(zs, Z_SYNC_FLUSH);
+    if (rc == Z_BUF_ERROR && bytesIn == 0)
+      break;
+    if (rc != Z_OK)
+      throw Exception("ZlibInStream: inflate failed");
+
+    if (bytesIn > 0) {
+      bytesIn -= zs->next_in - underlying->getptr();
+      underlying->setptr(zs->next_in);
+    }
+  }
+
+  return length - zs->avail_out;
+}
@@ -42,6 +42,13 @@ namespace rdr {
     void reset();
     size_t pos();
 
+    // decompressTo() decompresses straight into the caller's buffer rather
+    // than this stream's own, for data to be read elsewhere.  It returns
+    // the number of bytes written, at most length, and 0 once everything
+    // given to setUnderlying() has been decompressed.
+
+    size_t decompressTo(uint8_t* data, size_t length);
+
   private:
 
     size_t overrun(size_t itemSize, size_t nItems);
@@ -24,11 +24,23 @@
 // BPP should be 8, 16 or 32 depending on the bits per pixel.
 // FILL_RECT
 // IMAGE_RECT
+//
+// The function decodes a rectangle's tiles from zis, its decompressed data,
+// into buf a tile at a time.  The macros paint them into the rectangle,
+// which has been reserved with ReserveScreenRectangle(), clearing black if
+// anything painted is not black; the function returns black at the end.
+//
+// Each tile is parsed with a pointer into zis's buffer rather than a call
+// per byte.  Data whose length is known up front is taken as one span,
+// copied into data (room for a raw tile) if the buffer does not hold all
+// of it; runs are read in place while the buffer holds the longest a run
+// can be, and through zis otherwise.
 
-#include "../rdr/ZlibInStream.h"
 #include "../rdr/InStream.h"
+#include "../rdr/Exception.h"
 #include <assert.h>
 #include <stdbool.h>
+#include <string.h>
 
 using namespace rdr;
 
@@ -43,18 +55,89 @@ using namespace rdr;
 #define PIXEL_T __RFB_CONCAT2E(__RFB_CONCAT2E(uint,BPP),_t)
 #ifdef CPIXEL
 #define READ_PIXEL __RFB_CONCAT2E(readOpaque,CPIXEL)
+#define LOAD_PIXEL __RFB_CONCAT2E(zrleLoad,CPIXEL)
+#define UNPACK_PIXELS __RFB_CONCAT2E(zrleUnpack,CPIXEL)
+#define PIXEL_BYTES 3
 #define ZRLE_DECODE_BPP __RFB_CONCAT2E(zrleDecode,CPIXEL)
 #else
 #define READ_PIXEL __RFB_CONCAT2E(readOpaque,BPP)
+#define LOAD_PIXEL __RFB_CONCAT2E(zrleLoad,BPP)
+#define PIXEL_BYTES (BPP / 8)
 #define ZRLE_DECODE_BPP __RFB_CONCAT2E(zrleDecode,BPP)
 #endif
 
-void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
-                      rdr::ZlibInStream* zis, PIXEL_T* buf)
+#ifndef __RFB_ZRLE_DECODE_COMMON
+#define __RFB_ZRLE_DECODE_COMMON
+
+// zrleLoadN() reads a pixel from decompressed data as readOpaqueN() would.
+
+static inline uint8_t zrleLoad8(const uint8_t* p) { return *p; }
+static inline uint16_t zrleLoad16(const uint8_t* p) {
+  uint16_t r; memcpy(&r, p, 2); return r;
+}
+static inline uint32_t zrleLoad32(const uint8_t* p) {
+  uint32_t r; memcpy(&r, p, 4); return r;
+}
+static inline uint32_t zrleLoad24A(const uint8_t* p) {
+  uint32_t r = 0; memcpy(&r, p, 3); return r;
+}
+static inline uint32_t zrleLoad24B(const uint8_t* p) {
+  uint32_t r = 0; memcpy((uint8_t*)&r + 1, p, 3); return r;
+}
+
+// zrleUnpack24A/B() read n pixels into dst as readOpaque24A/B() would.
+// Writing a byte at a time is much faster than zrleLoad24A/B() in a loop,
+// which puts each pixel together in memory and reads it straight back.
+
+static inline void zrleUnpack24A(uint32_t* dst, const uint8_t* src, int n) {
+  for (uint8_t* d = (uint8_t*)dst; n > 0; n--, d += 4, src += 3) {
+    d[0] = src[0]; d[1] = src[1]; d[2] = src[2]; d[3] = 0;
+  }
+}
+static inline void zrleUnpack24B(uint32_t* dst, const uint8_t* src, int n) {
+  for (uint8_t* d = (uint8_t*)dst; n > 0; n--, d += 4, src += 3) {
+    d[0] = 0; d[1] = src[0]; d[2] = src[1]; d[3] = src[2];
+  }
+}
+
+// zrleSpan() returns the next length bytes of zis in one piece: in place
+// if its buffer holds them all, or else read into data.
+
+static inline const uint8_t* zrleSpan(rdr::InStream* zis, size_t length,
+                                      uint8_t* data)
+{
+  const uint8_t* p = zis->getptr();
+  if ((size_t)(zis->getend() - p) >= length) {
+    zis->setptr(p + length);
+    return p;
+  }
+  zis->readBytes(data, length);
+  return data;
+}
+
+// zrleFill() sets the pixels from ptr up to end to pix, and returns end.
+// Runs are often long, so it writes a few pixels at a time.
+
+template<class T>
+static inline T* zrleFill(T* ptr, T* end, T pix)
 {
-  int length = is->readU32();
-  zis->setUnderlying(is, length);
+  for (; end - ptr >= 4; ptr += 4) {
+    ptr[0] = pix; ptr[1] = pix; ptr[2] = pix; ptr[3] = pix;
+  }
+  while (ptr < end) *ptr++ = pix;
+  return end;
+}
 
+// The most bytes a run in a tile can take besides its pixel or index: one
+// of 255 for each 255 pixels, and the last.
+#define ZRLE_MAX_RUN_BYTES (rfbZRLETileWidth * rfbZRLETileHeight / 255 + 1)
+
+#endif
+
+bool ZRLE_DECODE_BPP (Session* s, int x, int y, int w, int h,
+                      rdr::InStream* zis, PIXEL_T* buf, uint8_t* data,
+                      bool black)
+{
   for (int ty = y; ty < y+h; ty += rfbZRLETileHeight) {
     int th = rfbZRLETileHeight;
     if (th > y+h-ty) th = y+h-ty;
@@ -66,11 +149,15 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
       bool rle = mode & 128;
       int palSize = mode & 127;
       PIXEL_T palette[128];
+      const PIXEL_T* pixels = buf;
 
       //        fprintf(stderr,"rle %d palSize %d\n",rle,palSize);
 
-      for (int i = 0; i < palSize; i++) {
-        palette[i] = zis->READ_PIXEL();
+      if (palSize > 0) {
+        const uint8_t* p = zrleSpan(zis, palSize * PIXEL_BYTES, data);
+        for (int i = 0; i < palSize; i++, p += PIXEL_BYTES) {
+          palette[i] = LOAD_PIXEL(p);
+        }
       }
 
       if (palSize == 1) {
@@ -85,11 +172,10 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
           // raw
 
 #ifdef CPIXEL
-          for (PIXEL_T* ptr = buf; ptr < buf+tw*th; ptr++) {
-            *ptr = zis->READ_PIXEL();
-          }
+          UNPACK_PIXELS(buf, zrleSpan(zis, tw * th * PIXEL_BYTES, data), tw * th);
 #else
-          zis->readBytes(buf, tw * th * (BPP / 8));
+          pixels = (const PIXEL_T*) zrleSpan(zis, tw * th * PIXEL_BYTES,
+                                             (uint8_t*) buf);
 #endif
 
         } else {
@@ -97,49 +183,104 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
           // packed pixels
           int bppp = ((palSize > 16) ? 8 :
                       ((palSize > 4) ? 4 : ((palSize > 2) ? 2 : 1)));
+          int rowBytes = (tw * bppp + 7) / 8;
 
+          const uint8_t* p = zrleSpan(zis, th * rowBytes, data);
           PIXEL_T* ptr = buf;
 
+          // A byte's pixels are copied from those of each value of its
+          // nibbles, looked up here once for the tile; at 4 bits per pixel
+          // these are the palette itself.
+          PIXEL_T nibbles[16][4];
+          if (bppp < 4) {
+            for (int n = 0; n < 16; n++) {
+              for (int j = 0; j < 4 / bppp; j++) {
+                nibbles[n][j] = palette[(n >> (4 - bppp * (j + 1))) &
+                                        ((1 << bppp) - 1)];
+              }
+            }
+          }
+
           for (int i = 0; i < th; i++) {
             PIXEL_T* eol = ptr + tw;
-            uint8_t byte = 0;
-            uint8_t nbits = 0;
 
-            while (ptr < eol) {
-              if (nbits == 0) {
-                byte = zis->readU8();
-                nbits = 8;
+            switch (bppp) {
+            case 1:
+              for (; eol - ptr >= 8; ptr += 8, p++) {
+                memcpy(ptr, nibbles[*p >> 4], 4 * sizeof(PIXEL_T));
+                memcpy(ptr + 4, nibbles[*p & 15], 4 * sizeof(PIXEL_T));
+              }
+              break;
+            case 2:
+              for (; eol - ptr >= 4; ptr += 4, p++) {
+                memcpy(ptr, nibbles[*p >> 4], 2 * sizeof(PIXEL_T));
+                memcpy(ptr + 2, nibbles[*p & 15], 2 * sizeof(PIXEL_T));
+              }
+              break;
+            case 4:
+              for (; eol - ptr >= 2; ptr += 2, p++) {
+                ptr[0] = palette[*p >> 4];
+                ptr[1] = palette[*p & 15];
+              }
+              break;
+            default:
+              while (ptr < eol) *ptr++ = palette[*p++ & 127];
+            }
+
+            // The first pixels of the row's last byte
+            if (ptr < eol) {
+              uint8_t byte = *p++;
+              int nbits = 8;
+              while (ptr < eol) {
+                nbits -= bppp;
+                *ptr++ = palette[(byte >> nbits) & ((1 << bppp) - 1)];
               }
-              nbits = (uint8_t) (nbits - bppp);
-              uint8_t index = (byte >> nbits) & ((1 << bppp) - 1) & 127;
-              *ptr++ = palette[index];
             }
           }
         }
 
 #ifdef FAVOUR_FILL_RECT
        //fprintf(stderr,"copying data to screen %dx%d at %d,%d\n",tw,th,tx,ty);
-        IMAGE_RECT(tx,ty,tw,th,buf);
+        IMAGE_RECT(tx,ty,tw,th,pixels);
 #endif
 
       } else {
 
+        // Runs are read in place, or through zis when its buffer may end
+        // part of the way through one.
+        const uint8_t* p = zis->getptr();
+        const uint8_t* pend = zis->getend();
+
         if (palSize == 0) {
 
           // plain RLE
 
           PIXEL_T* ptr = buf;
-          PIXEL_T* end = ptr + th * tw;	    
+          PIXEL_T* end = ptr + th * tw;
           while (ptr < end) {
-            PIXEL_T pix = zis->READ_PIXEL();
+            PIXEL_T pix;
             int len = 1;
             int b;
-            do {
-              b = zis->readU8();
-              len += b;
-            } while (b == 255);
+            if (pend - p >= PIXEL_BYTES + ZRLE_MAX_RUN_BYTES) {
+              pix = LOAD_PIXEL(p);
+              p += PIXEL_BYTES;
+              do {
+                b = *p++;
+                len += b;
+              } while (b == 255 && len <= end - ptr);
+            } else {
+              zis->setptr(p);
+              pix = zis->READ_PIXEL();
+              do {
+                b = zis->readU8();
+                len += b;
+              } while (b == 255 && len <= end - ptr);
+              p = zis->getptr();
+              pend = zis->getend();
+            }
 
-            assert(len <= end - ptr);
+            if (len > end - ptr)
+              throw rdr::Exception("ZRLE run overflows its tile");
 
 #ifdef FAVOUR_FILL_RECT
             int i = ptr - buf;
@@ -167,7 +308,7 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
               FILL_RECT(tx+runX, ty+runY, len, 1, pix);
             }
 #else
-            while (len-- > 0) *ptr++ = pix;
+            ptr = zrleFill(ptr, ptr + len, pix);
 #endif
 
           }
@@ -178,18 +319,33 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
           PIXEL_T* ptr = buf;
           PIXEL_T* end = ptr + th * tw;
           while (ptr < end) {
-            int index = zis->readU8();
+            int index;
             int len = 1;
-            if (index & 128) {
-              int b;
-              do {
-                b = zis->readU8();
-                len += b;
-              } while (b == 255);
-
-              assert(len <= end - ptr);
+            int b;
+            if (pend - p >= 1 + ZRLE_MAX_RUN_BYTES) {
+              index = *p++;
+              if (index & 128) {
+                do {
+                  b = *p++;
+                  len += b;
+                } while (b == 255 && len <= end - ptr);
+              }
+            } else {
+              zis->setptr(p);
+              index = zis->readU8();
+              if (index & 128) {
+                do {
+                  b = zis->readU8();
+                  len += b;
+                } while (b == 255 && len <= end - ptr);
+              }
+              p = zis->getptr();
+              pend = zis->getend();
             }
 
+            if (len > end - ptr)
+              throw rdr::Exception("ZRLE run overflows its tile");
+
             index &= 127;
 
             PIXEL_T pix = palette[index];
@@ -220,22 +376,27 @@ void ZRLE_DECODE_BPP (int x, int y, int w, int h, rdr::InStream* is,
               FILL_RECT(tx+runX, ty+runY, len, 1, pix);
             }
 #else
-            while (len-- > 0) *ptr++ = pix;
+            ptr = zrleFill(ptr, ptr + len, pix);
 #endif
           }
         }
+
+        zis->setptr(p);
       }
 
 #ifndef FAVOUR_FILL_RECT
       //fprintf(stderr,"copying data to screen %dx%d at %d,%d\n",tw,th,tx,ty);
-      IMAGE_RECT(tx,ty,tw,th,buf);
+      IMAGE_RECT(tx,ty,tw,th,pixels);
 #endif
     }
   }
 
-  zis->reset();
+  return black;
 }
 
 #undef ZRLE_DECODE_BPP
 #undef READ_PIXEL
+#undef LOAD_PIXEL
+#undef UNPACK_PIXELS
+#undef PIXEL_BYTES
 #undef PIXEL_T
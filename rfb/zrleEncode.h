@@ -46,13 +46,13 @@ using namespace rdr;
 #endif
 
 #ifdef CPIXEL
-#define PIXEL_T __RFB_CONCAT2E(rdr::U,BPP)
+#define PIXEL_T __RFB_CONCAT2E(__RFB_CONCAT2E(uint,BPP),_t)
 #define WRITE_PIXEL __RFB_CONCAT2E(writeOpaque,CPIXEL)
 #define ZRLE_ENCODE __RFB_CONCAT2E(zrleEncode,CPIXEL)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT2E(zrleEncodeTile,CPIXEL)
 #define BPPOUT 24
 #else
-#define PIXEL_T __RFB_CONCAT2E(rdr::U,BPP)
+#define PIXEL_T __RFB_CONCAT2E(__RFB_CONCAT2E(uint,BPP),_t)
 #define WRITE_PIXEL __RFB_CONCAT2E(writeOpaque,BPP)
 #define ZRLE_ENCODE __RFB_CONCAT2E(zrleEncode,BPP)
 #define ZRLE_ENCODE_TILE __RFB_CONCAT2E(zrleEncodeTile,BPP)
@@ -78,12 +78,12 @@ public:
     size = 0;
   }
 
-  inline int hash(rdr::U32 pix)
+  inline int hash(uint32_t pix)
   {
-    return (pix ^ (pix >> 17)) & 4095;
+    return (int) ((pix ^ (pix >> 17)) & 4095);
   }
 
-  inline void insert(rdr::U32 pix)
+  inline void insert(uint32_t pix)
   {
     if (size < MAX_SIZE) {
       int i = hash(pix);
@@ -91,14 +91,14 @@ public:
         i++;
       if (index[i] != 255) return;
 
-      index[i] = size;
+      index[i] = (uint8_t) size;
       key[i] = pix;
       palette[size] = pix;
     }
     size++;
   }
 
-  inline int lookup(rdr::U32 pix)
+  inline int lookup(uint32_t pix)
   {
     assert(size <= MAX_SIZE);
     int i = hash(pix);
@@ -108,9 +108,9 @@ public:
     return -1;
   }
 
-  rdr::U32 palette[MAX_SIZE];
-  rdr::U8 index[4096+MAX_SIZE];
-  rdr::U32 key[4096+MAX_SIZE];
+  uint32_t palette[MAX_SIZE];
+  uint8_t index[4096+MAX_SIZE];
+  uint32_t key[4096+MAX_SIZE];
   int size;
 };
 #endif
@@ -151,7 +151,7 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
 
   PIXEL_T* ptr = data;
   PIXEL_T* end = ptr + h * w;
-  *end = ~*(end-1); // one past the end is different so the while loop ends
+  *end = (PIXEL_T) ~*(end-1); // one past the end is different so the while loop ends
 
   while (ptr < end) {
     PIXEL_T pix = *ptr;
@@ -171,7 +171,7 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
 
   if (ph.size == 1) {
     os->writeU8(1);
-    os->WRITE_PIXEL(ph.palette[0]);
+    os->WRITE_PIXEL((PIXEL_T) ph.palette[0]);
     return;
   }
 
@@ -215,10 +215,10 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
 
   if (!usePalette) ph.size = 0;
 
-  os->writeU8((useRle ? 128 : 0) | ph.size);
+  os->writeU8((uint8_t) ((useRle ? 128 : 0) | ph.size));
 
   for (int i = 0; i < ph.size; i++) {
-    os->WRITE_PIXEL(ph.palette[i]);
+    os->WRITE_PIXEL((PIXEL_T) ph.palette[i]);
   }
 
   if (useRle) {
@@ -232,17 +232,17 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
       pix = *ptr++;
       while (*ptr == pix && ptr < end)
         ptr++;
-      int len = ptr - runStart;
+      int len = (int) (ptr - runStart);
       if (len <= 2 && usePalette) {
         int index = ph.lookup(pix);
         if (len == 2)
-          os->writeU8(index);
-        os->writeU8(index);
+          os->writeU8((uint8_t) index);
+        os->writeU8((uint8_t) index);
         continue;
       }
       if (usePalette) {
         int index = ph.lookup(pix);
-        os->writeU8(index | 128);
+        os->writeU8((uint8_t) (index | 128));
       } else {
         os->WRITE_PIXEL(pix);
       }
@@ -251,7 +251,7 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
         os->writeU8(255);
         len -= 255;
       }
-      os->writeU8(len);
+      os->writeU8((uint8_t) len);
     }
 
   } else {
@@ -269,23 +269,23 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, rdr::OutStream* os)
       PIXEL_T* ptr = data;
 
       for (int i = 0; i < h; i++) {
-        U8 nbits = 0;
-        U8 byte = 0;
+        uint8_t nbits = 0;
+        uint8_t byte = 0;
 
         PIXEL_T* eol = ptr + w;
 
         while (ptr < eol) {
           PIXEL_T pix = *ptr++;
-          U8 index = ph.lookup(pix);
-          byte = (byte << bppp) | index;
-          nbits += bppp;
+          uint8_t index = (uint8_t) ph.lookup(pix);
+          byte = (uint8_t) ((byte << bppp) | index);
+          nbits = (uint8_t) (nbits + bppp);
           if (nbits >= 8) {
             os->writeU8(byte);
             nbits = 0;
           }
         }
         if (nbits > 0) {
-          byte <<= 8 - nbits;
+          byte = (uint8_t) (byte << (8 - nbits));
           os->writeU8(byte);
         }
       }
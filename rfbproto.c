@@ -43,6 +43,7 @@
 #endif
 
 #include <errno.h>
+#include <pthread.h>
 
 #include "vncsnapshot.h"
 #include "vncauth.h"
@@ -54,27 +55,32 @@
 
 #include "getpass.h"
 
-/* do not need non-32 bit versions of these */
-static bool HandleRRE32(uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
-static bool HandleCoRRE32(uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
-static bool HandleHextile32(uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
-static bool HandleZlib32(uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
-static bool HandleTight32(uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
+static pthread_mutex_t passwordLock = PTHREAD_MUTEX_INITIALIZER;
 
-static int32_t ReadCompactLen (void);
+/* do not need non-32 bit versions of these */
+static bool HandleRRE32(Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
+static bool HandleCoRRE32(Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
+static bool HandleHextile32(Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
+static bool HandleZlib32(Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
+static bool HandleTight32(Session *s, uint32_t rx, uint32_t ry, uint32_t rw, uint32_t rh);
+
+static int32_t ReadCompactLen (Session *s);
+static bool HandleUpdateRects(Session *s, uint16_t nRects);
+static bool StartTightQueues(Session *s);
+static bool ResetTightStream(Session *s, void *data, void *scratch, bool *black);
+static void FreeTightStream(void *scratch);
+static void FreeTightJpeg(void *scratch);
+static bool WaitForDecodeJobs(Session *s);
+static bool AnswerChallenge(uint8_t *challenge);
 
 /* JPEG */
+struct JpegSource;
 static void JpegInitSource(j_decompress_ptr cinfo);
 static boolean JpegFillInputBuffer(j_decompress_ptr cinfo);
 static void JpegSkipInputData(j_decompress_ptr cinfo, long num_bytes);
 static void JpegTermSource(j_decompress_ptr cinfo);
-static void JpegSetSrcManager(j_decompress_ptr cinfo, uint8_t *compressedData,
-                              size_t compressedLen);
-
-char *desktopName;
-
-rfbPixelFormat myFormat;
-bool pendingFormatChange = false;
+static void JpegSetSrcManager(j_decompress_ptr cinfo, struct JpegSource *src,
+                              uint8_t *compressedData, size_t compressedLen);
 
 /*
  * Macro to compare pixel formats.
@@ -92,60 +98,212 @@ bool pendingFormatChange = false;
                             (x.greenShift == y.greenShift) &&           \
                             (x.blueShift == y.blueShift))))
 
-int currentEncoding = rfbEncodingZRLE;
-bool pendingEncodingChange = false;
 int supportedEncodings[] = {
   rfbEncodingZRLE, rfbEncodingHextile, rfbEncodingCoRRE, rfbEncodingRRE,
   rfbEncodingRaw, rfbEncodingTight
 };
 #define NUM_SUPPORTED_ENCODINGS (sizeof(supportedEncodings)/sizeof(int))
 
-rfbServerInitMsg si;
-uint8_t *serverCutText = NULL;
-bool newServerCutText = false;
-
 /* note that the CoRRE encoding uses this buffer and assumes it is big enough
    to hold 255 * 255 * 32 bits -> 260100 bytes.  640*480 = 307200 bytes */
 /* also hextile assumes it is big enough to hold 16 * 16 * 32 bits */
 #define BUFFER_SIZE (640*480)
-static uint8_t buffer[BUFFER_SIZE];
 
+/*
+ * A Tight rectangle's filter, read before its pixel data.
+ */
+
+struct TightFilter {
+  bool cutZeros;
+  uint32_t rectWidth, rectColors;
+  char tightPalette[256*4];
+  uint8_t tightPrevRow[2048*3*sizeof(uint16_t)];
+};
+
+/*
+ * One of the Tight encoding's four independent zlib streams, with room to
+ * inflate and filter its data in, for the thread decoding the stream.
+ */
+
+struct TightStream {
+  uint8_t buffer[BUFFER_SIZE];  /* first, for alignment */
+  z_stream zs;
+  bool active;
+};
+
+/*
+ * The JPEG source manager reading a rectangle's compressed data, and
+ * whether it ran short.
+ */
+
+struct JpegSource {
+  struct jpeg_source_mgr mgr;
+  JOCTET *bufferPtr;
+  size_t bufferLen;
+  bool error;
+};
+
+/*
+ * Scratch space of a thread decoding Tight JPEG rectangles. Its
+ * decompressor is kept from one rectangle to the next, and writes straight
+ * into the frame buffer's rows.
+ */
 
-/* The zlib encoding requires expansion/decompression/deflation of the
-   compressed data in the "buffer" above into another, result buffer.
-   However, the size of the result buffer can be determined precisely
-   based on the bitsPerPixel, height and width of the rectangle.  We
-   allocate this buffer one time to be the full size of the buffer. */
+#ifndef JCS_EXTENSIONS
+#define JPEG_MAX_ROWS 16        /* rows decoded at once into buffer */
+#endif
 
-static size_t raw_buffer_size = 0;
-static uint8_t *raw_buffer = NULL;
+struct TightJpeg {
+#ifndef JCS_EXTENSIONS
+  uint8_t buffer[BUFFER_SIZE];  /* RGB rows, unpacked for -rgbx */
+#endif
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  bool created;                 /* cinfo has been created */
+  struct JpegSource src;
+  JSAMPROW *rows;               /* the rectangle's rows in the frame buffer */
+  uint32_t rowsSize;
+};
 
-static z_stream decompStream;
-static bool decompStreamInited = false;
+/*
+ * A Tight JPEG rectangle's compressed data, queued to be decoded.
+ */
 
+struct JpegRect {
+  uint32_t x, y, w, h;
+  size_t length;
+  uint8_t data[];
+};
 
 /*
- * Variables for the ``tight'' encoding implementation.
+ * The decoders' state, of which each session has its own.
  */
 
-/* Separate buffer for compressed data. */
-#define ZLIB_BUFFER_SIZE 512
-static char zlib_buffer[ZLIB_BUFFER_SIZE];
+struct Decoders {
+  uint8_t buffer[BUFFER_SIZE];
+
+  /* The zlib encoding requires expansion/decompression/deflation of the
+     compressed data in the "buffer" above into another, result buffer.
+     However, the size of the result buffer can be determined precisely
+     based on the bitsPerPixel, height and width of the rectangle.  We
+     allocate this buffer one time to be the full size of the buffer. */
+
+  size_t raw_buffer_size;
+  uint8_t *raw_buffer;
+
+  z_stream decompStream;
+  bool decompStreamInited;
+
+  /*
+   * Variables for the ``tight'' encoding implementation.
+   */
 
-/* Four independent compression streams for zlib library. */
-static z_stream zlibStream[4];
-static bool zlibStreamActive[4] = {
-  false, false, false, false
+  /* Filter stuff. Should be initialized by filter initialization code. */
+  struct TightFilter tightFilter;
+
+  /* Queues decoding Tight rectangles: one for each of the four zlib
+     streams, so that each stream's rectangles are inflated in order, and
+     one for JPEG rectangles. */
+  bool tightQueuesStarted;
+  int tightQueues[4];
+  int jpegQueue;
+
+  /* The encoding of the rectangles last queued, charged with the time
+     spent waiting for them with -bench */
+  uint32_t queuedEncoding;
 };
 
-/* Filter stuff. Should be initialized by filter initialization code. */
-static bool cutZeros;
-static uint32_t rectWidth, rectColors;
-static char tightPalette[256*4];
-static uint8_t tightPrevRow[2048*3*sizeof(uint16_t)];
 
-/* JPEG decoder state. */
-static bool jpegError;
+/*
+ * NewSession() returns a session with nothing connected yet, or NULL if
+ * there is not enough memory.
+ */
+
+Session *
+NewSession(void)
+{
+  Session *s = calloc(1, sizeof(Session));
+
+  if (s == NULL)
+    return NULL;
+  s->decoders = calloc(1, sizeof(struct Decoders));
+  if (s->decoders == NULL) {
+    free(s);
+    return NULL;
+  }
+  s->sock = -1;
+  s->currentEncoding = rfbEncodingZRLE;
+  return s;
+}
+
+/*
+ * FreeSession() closes a session's connection and frees everything it
+ * holds, the frame buffer included, once any snapshots still queued have
+ * been written.
+ */
+
+void
+FreeSession(Session *s)
+{
+  struct Decoders *d = s->decoders;
+
+  StopDecodeThreads(s);
+  CancelStreamedSnapshot(s);
+  FinishOutput(s);
+  StopSharedScreen(s);
+  CloseRFBConnection(s);
+  FreeSoftCursor(s);
+  FreeBuffer(s);
+  FreeZrleDecoder(s);
+
+  if (d->decompStreamInited)
+    inflateEnd(&d->decompStream);
+  free(d->raw_buffer);
+  free(d);
+
+  free(s->desktopName);
+  free(s->serverCutText);
+  free(s);
+}
+
+
+/*
+ * AnswerChallenge() encrypts a VNC authentication challenge in place with
+ * the password, read from -passwd's file or asked for.
+ */
+
+static bool
+AnswerChallenge(uint8_t *challenge)
+{
+  char *passwd;
+
+  if (appData.passwordFile) {
+    passwd = vncDecryptPasswdFromFile(appData.passwordFile);
+    if (!passwd) {
+      fprintf(stderr,"Cannot read valid password from file \"%s\"\n",
+              appData.passwordFile);
+      return false;
+    }
+  } else {
+    passwd = getpass("Password: ");
+  }
+
+  if ((!passwd) || (strlen(passwd) == 0)) {
+    fprintf(stderr,"Reading password failed\n");
+    return false;
+  }
+  if (strlen(passwd) > 8) {
+    passwd[8] = '\0';
+  }
+
+  vncEncryptBytes(challenge, passwd);
+
+  /* Lose the password from memory */
+  for (ssize_t i = (ssize_t) strlen(passwd); i >= 0; i--) {
+    passwd[i] = '\0';
+  }
+  return true;
+}
 
 
 /*
@@ -153,17 +311,17 @@ static bool jpegError;
  */
 
 bool
-InitialiseRFBConnection()
+InitialiseRFBConnection(Session *s)
 {
   rfbProtocolVersionMsg pv;
   int major,minor;
   uint32_t authScheme, reasonLen, authResult;
   char *reason;
   uint8_t challenge[CHALLENGESIZE];
-  char *passwd;
+  bool answered;
   rfbClientInitMsg ci;
 
-  if (!ReadFromRFBServer((uint8_t*)pv, sz_rfbProtocolVersionMsg)) return false;
+  if (!ReadFromRFBServer(s, (uint8_t*)pv, sz_rfbProtocolVersionMsg)) return false;
 
   pv[sz_rfbProtocolVersionMsg] = 0;
 
@@ -182,20 +340,20 @@ InitialiseRFBConnection()
 
   sprintf(pv,rfbProtocolVersionFormat,major,minor);
 
-  if (!WriteToRFBServer((uint8_t*)pv, sz_rfbProtocolVersionMsg)) return false;
-  if (!ReadFromRFBServer((uint8_t *)&authScheme, 4)) return false;
+  if (!WriteToRFBServer(s, (uint8_t*)pv, sz_rfbProtocolVersionMsg)) return false;
+  if (!ReadFromRFBServer(s, (uint8_t *)&authScheme, 4)) return false;
 
   authScheme = Swap32IfLE(authScheme);
 
   switch (authScheme) {
 
   case rfbConnFailed:
-    if (!ReadFromRFBServer((uint8_t *)&reasonLen, 4)) return false;
+    if (!ReadFromRFBServer(s, (uint8_t *)&reasonLen, 4)) return false;
     reasonLen = Swap32IfLE(reasonLen);
 
     reason = malloc(reasonLen);
 
-    if (!ReadFromRFBServer((uint8_t *)reason, reasonLen)) return false;
+    if (!ReadFromRFBServer(s, (uint8_t *)reason, reasonLen)) return false;
 
     fprintf(stderr,"VNC connection failed: %.*s\n",(int)reasonLen, reason);
     return false;
@@ -207,37 +365,18 @@ InitialiseRFBConnection()
     break;
 
   case rfbVncAuth:
-    if (!ReadFromRFBServer((uint8_t *)challenge, CHALLENGESIZE)) return false;
-
-    if (appData.passwordFile) {
-      passwd = vncDecryptPasswdFromFile(appData.passwordFile);
-      if (!passwd) {
-        fprintf(stderr,"Cannot read valid password from file \"%s\"\n",
-                appData.passwordFile);
-        return false;
-      }
-    } else {
-      passwd = getpass("Password: ");
-    }
-
-    if ((!passwd) || (strlen(passwd) == 0)) {
-      fprintf(stderr,"Reading password failed\n");
-      return false;
-    }
-    if (strlen(passwd) > 8) {
-      passwd[8] = '\0';
-    }
+    if (!ReadFromRFBServer(s, (uint8_t *)challenge, CHALLENGESIZE)) return false;
 
-    vncEncryptBytes(challenge, passwd);
-
-    /* Lose the password from memory */
-    for (ssize_t i = (ssize_t) strlen(passwd); i >= 0; i--) {
-      passwd[i] = '\0';
-    }
+    /* getpass() and the DES key in d3des.c are shared by every session,
+       so only one may answer at a time */
+    pthread_mutex_lock(&passwordLock);
+    answered = AnswerChallenge(challenge);
+    pthread_mutex_unlock(&passwordLock);
+    if (!answered) return false;
 
-    if (!WriteToRFBServer((uint8_t *)challenge, CHALLENGESIZE)) return false;
+    if (!WriteToRFBServer(s, (uint8_t *)challenge, CHALLENGESIZE)) return false;
 
-    if (!ReadFromRFBServer((uint8_t *)&authResult, 4)) return false;
+    if (!ReadFromRFBServer(s, (uint8_t *)&authResult, 4)) return false;
 
     authResult = Swap32IfLE(authResult);
 
@@ -268,43 +407,58 @@ InitialiseRFBConnection()
 
   ci.shared = 1;
 
-  if (!WriteToRFBServer((uint8_t *)&ci, sz_rfbClientInitMsg)) return false;
+  if (!WriteToRFBServer(s, (uint8_t *)&ci, sz_rfbClientInitMsg)) return false;
 
-  if (!ReadFromRFBServer((uint8_t *)&si, sz_rfbServerInitMsg)) return false;
+  if (appData.recordFile && !StartRecording(s, appData.recordFile)) return false;
 
-  si.framebufferWidth = Swap16IfLE(si.framebufferWidth);
-  si.framebufferHeight = Swap16IfLE(si.framebufferHeight);
-  si.format.redMax = Swap16IfLE(si.format.redMax);
-  si.format.greenMax = Swap16IfLE(si.format.greenMax);
-  si.format.blueMax = Swap16IfLE(si.format.blueMax);
-  si.nameLength = Swap32IfLE(si.nameLength);
+  return ReadServerInit(s);
+}
+
+
+/*
+ * ReadServerInit reads the ServerInit message, which describes the
+ * framebuffer and names the desktop.
+ */
+
+bool
+ReadServerInit(Session *s)
+{
+  if (!ReadFromRFBServer(s, (uint8_t *)&s->si, sz_rfbServerInitMsg)) return false;
 
-  desktopName = malloc(si.nameLength + 1);
-  if (!desktopName) {
+  s->si.framebufferWidth = Swap16IfLE(s->si.framebufferWidth);
+  s->si.framebufferHeight = Swap16IfLE(s->si.framebufferHeight);
+  s->si.format.redMax = Swap16IfLE(s->si.format.redMax);
+  s->si.format.greenMax = Swap16IfLE(s->si.format.greenMax);
+  s->si.format.blueMax = Swap16IfLE(s->si.format.blueMax);
+  s->si.nameLength = Swap32IfLE(s->si.nameLength);
+
+  s->desktopName = malloc(s->si.nameLength + 1);
+  if (!s->desktopName) {
     fprintf(stderr, "Error allocating memory for desktop name, %" PRIu32 " bytes\n",
-            si.nameLength);
+            s->si.nameLength);
     return false;
   }
 
-  if (!ReadFromRFBServer((uint8_t *)desktopName, si.nameLength)) return false;
+  if (!ReadFromRFBServer(s, (uint8_t *)s->desktopName, s->si.nameLength)) return false;
 
-  desktopName[si.nameLength] = 0;
+  s->desktopName[s->si.nameLength] = 0;
 
   if (!appData.quiet) {
-    fprintf(stderr,"Desktop name \"%s\"\n",desktopName);
+    fprintf(stderr,"Desktop name \"%s\"\n",s->desktopName);
 
     fprintf(stderr,"Connected to VNC server, using protocol version %d.%d\n",
             rfbProtocolMajorVersion, rfbProtocolMinorVersion);
 
     fprintf(stderr,"VNC server default format:\n");
-    PrintPixelFormat(&si.format);
+    PrintPixelFormat(&s->si.format);
   }
 
   return true;
 }
 
 
-bool SendFramebufferUpdateRequest(uint16_t x, uint16_t y, uint16_t w, uint16_t h, bool incremental)
+bool SendFramebufferUpdateRequest(Session *s, uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                                  bool incremental)
 {
   rfbFramebufferUpdateRequestMsg fur;
 
@@ -315,29 +469,29 @@ bool SendFramebufferUpdateRequest(uint16_t x, uint16_t y, uint16_t w, uint16_t h
   fur.w = Swap16IfLE(w);
   fur.h = Swap16IfLE(h);
 
-  if (!WriteToRFBServer((uint8_t *)&fur, sz_rfbFramebufferUpdateRequestMsg))
+  if (!WriteToRFBServer(s, (uint8_t *)&fur, sz_rfbFramebufferUpdateRequestMsg))
     return false;
 
   return true;
 }
 
 
-bool SendSetPixelFormat()
+bool SendSetPixelFormat(Session *s)
 {
   rfbSetPixelFormatMsg spf;
 
   spf.type = rfbSetPixelFormat;
-  spf.format = myFormat;
+  spf.format = s->format;
   spf.format.redMax = Swap16IfLE(spf.format.redMax);
   spf.format.greenMax = Swap16IfLE(spf.format.greenMax);
   spf.format.blueMax = Swap16IfLE(spf.format.blueMax);
-    PrintPixelFormat(&myFormat);
+    PrintPixelFormat(&s->format);
 
-  return WriteToRFBServer((uint8_t *)&spf, sz_rfbSetPixelFormatMsg);
+  return WriteToRFBServer(s, (uint8_t *)&spf, sz_rfbSetPixelFormatMsg);
 }
 
 
-bool SendSetEncodings()
+bool SendSetEncodings(Session *s)
 {
   uint8_t buf[sz_rfbSetEncodingsMsg + MAX_ENCODINGS * 4];
   rfbSetEncodingsMsg *se = (rfbSetEncodingsMsg *)buf;
@@ -345,6 +499,7 @@ bool SendSetEncodings()
   bool requestCompressLevel = false;
   bool requestQualityLevel = false;
   bool requestLastRectEncoding = false;
+  int32_t qualityLevel = appData.qualityLevel;  /* shared by every session */
 
   se->type = rfbSetEncodings;
   se->nEncodings = 0;
@@ -397,9 +552,9 @@ bool SendSetEncodings()
     }
 
     if (se->nEncodings < MAX_ENCODINGS && requestQualityLevel) {
-      if (appData.qualityLevel < 0 || appData.qualityLevel > 9)
-        appData.qualityLevel = 9;
-      encs[se->nEncodings++] = Swap32IfLE((uint32_t)appData.qualityLevel +
+      if (qualityLevel < 0 || qualityLevel > 9)
+        qualityLevel = 9;
+      encs[se->nEncodings++] = Swap32IfLE((uint32_t)qualityLevel +
                                           rfbEncodingQualityLevel0);
     }
 
@@ -414,26 +569,26 @@ bool SendSetEncodings()
       encs[se->nEncodings++] = Swap32IfLE(rfbEncodingLastRect);
     }
   } else {
-    if (sameMachine) {
+    if (s->sameMachine) {
       if (!tunnelSpecified) {
         if (!appData.quiet) {
           fprintf(stderr,"Same machine: preferring raw encoding\n");
         }
-        currentEncoding = rfbEncodingRaw;
+        s->currentEncoding = rfbEncodingRaw;
       } else {
         if (!appData.quiet) {
           fprintf(stderr,"Tunneling active: preferring tight encoding\n");
         }
-        currentEncoding = rfbEncodingTight;
+        s->currentEncoding = rfbEncodingTight;
       }
     }
 
     encs[se->nEncodings++] = Swap32IfLE(rfbEncodingLastRect);
     
     encs[se->nEncodings++] = Swap32IfLE(rfbEncodingCopyRect);
-    encs[se->nEncodings++] = Swap32IfLE(currentEncoding);
+    encs[se->nEncodings++] = Swap32IfLE(s->currentEncoding);
     for (size_t i = 0; i < NUM_SUPPORTED_ENCODINGS; i++) {
-      if (supportedEncodings[i] != currentEncoding)
+      if (supportedEncodings[i] != s->currentEncoding)
         encs[se->nEncodings++] = Swap32IfLE(supportedEncodings[i]);
     }
 
@@ -449,9 +604,9 @@ bool SendSetEncodings()
     }
 
     if (appData.enableJPEG) {
-      if (appData.qualityLevel < 0 || appData.qualityLevel > 9)
-        appData.qualityLevel = 5;
-      encs[se->nEncodings++] = Swap32IfLE((uint32_t)appData.qualityLevel +
+      if (qualityLevel < 0 || qualityLevel > 9)
+        qualityLevel = 5;
+      encs[se->nEncodings++] = Swap32IfLE((uint32_t)qualityLevel +
                                           rfbEncodingQualityLevel0);
     }
 
@@ -468,7 +623,7 @@ bool SendSetEncodings()
 
   se->nEncodings = Swap16IfLE(se->nEncodings);
 
-  return WriteToRFBServer(buf, len);
+  return WriteToRFBServer(s, buf, len);
 }
 
 
@@ -477,16 +632,16 @@ bool SendSetEncodings()
  */
 
 bool
-SendIncrementalFramebufferUpdateRequest()
+SendIncrementalFramebufferUpdateRequest(Session *s)
 {
-  return SendFramebufferUpdateRequest(0, 0, si.framebufferWidth,
-                                      si.framebufferHeight, true);
+  return SendFramebufferUpdateRequest(s, 0, 0, s->si.framebufferWidth,
+                                      s->si.framebufferHeight, true);
 }
 
-bool RequestNewUpdate()
+bool RequestNewUpdate(Session *s)
 {
-  if (!SendFramebufferUpdateRequest((uint16_t)appData.rectX, (uint16_t)appData.rectY, (uint16_t)appData.rectWidth,
-                                      (uint16_t)appData.rectHeight, true)) {
+  if (!SendFramebufferUpdateRequest(s, (uint16_t)s->rectX, (uint16_t)s->rectY, (uint16_t)s->rectWidth,
+                                      (uint16_t)s->rectHeight, true)) {
       return false;
   }
 
@@ -494,196 +649,292 @@ bool RequestNewUpdate()
 }
 
 /*
- * HandleRFBServerMessage.
+ * HandleUpdateRects() reads and decodes the rectangles of a framebuffer
+ * update, leaving some perhaps still being decoded on other threads.
  */
 
-bool
-HandleRFBServerMessage()
+static bool
+HandleUpdateRects(Session *s, uint16_t nRects)
 {
-  rfbServerToClientMsg msg;
+  rfbFramebufferUpdateRectHeader rect;
 
-  if (!ReadFromRFBServer((uint8_t *)&msg, 1))
-    return false;
-
-  switch (msg.type) {
+  for (size_t i = 0; i < nRects; i++) {
+    if (!ReadFromRFBServer(s, (uint8_t *)&rect, sz_rfbFramebufferUpdateRectHeader))
+      return false;
 
-  case rfbSetColourMapEntries:
-  {
-    fprintf(stderr, "Received unsupported rfbSetColourMapEntries\n");
-    return false; /* unsupported */
-  }
+    rect.encoding = Swap32IfLE(rect.encoding);
+    if (rect.encoding == rfbEncodingLastRect)
+        break;
 
-  case rfbFramebufferUpdate:
-  {
-    rfbFramebufferUpdateRectHeader rect;
+    rect.r.x = Swap16IfLE(rect.r.x);
+    rect.r.y = Swap16IfLE(rect.r.y);
+    rect.r.w = Swap16IfLE(rect.r.w);
+    rect.r.h = Swap16IfLE(rect.r.h);
 
-    if (!ReadFromRFBServer(((uint8_t *)&msg.fu) + 1,
-                           sz_rfbFramebufferUpdateMsg - 1))
+    /* The cursor is drawn over whatever is under it, so that must be
+       finished first. */
+    if ((rect.encoding == rfbEncodingXCursor || rect.encoding == rfbEncodingRichCursor ||
+         rect.encoding == rfbEncodingPointerPos) && !WaitForDecodeJobs(s))
       return false;
 
-    msg.fu.nRects = Swap16IfLE(msg.fu.nRects);
+    if (rect.encoding == rfbEncodingXCursor || rect.encoding == rfbEncodingRichCursor) {
+      if (!HandleCursorShape(s, rect.r.x, rect.r.y, rect.r.w, rect.r.h, rect.encoding)) {
+        return false;
+      }
+      continue;
+    }
 
-    for (size_t i = 0; i < msg.fu.nRects; i++) {
-      if (!ReadFromRFBServer((uint8_t *)&rect, sz_rfbFramebufferUpdateRectHeader))
+    if (rect.encoding == rfbEncodingPointerPos) {
+      if (!HandleCursorPos(s, rect.r.x, rect.r.y)) {
         return false;
+      }
+      s->gotCursorPos = true;
+      continue;
+    }
 
-      rect.encoding = Swap32IfLE(rect.encoding);
-      if (rect.encoding == rfbEncodingLastRect)
-          break;
+    if ((rect.r.x + rect.r.w > s->si.framebufferWidth) ||
+        (rect.r.y + rect.r.h > s->si.framebufferHeight))
+      {
+        fprintf(stderr,"Rect too large: %dx%d at (%d, %d)\n",
+                rect.r.w, rect.r.h, rect.r.x, rect.r.y);
+        return false;
+      }
+
+    if ((rect.r.h * rect.r.w) == 0) {
+      fprintf(stderr,"Zero size rect - ignoring\n");
+      continue;
+    }
+
+    /* Rectangles still being decoded on other threads must be finished
+       before anything is drawn over them. */
+    if (DecodeJobsOverlap(s, rect.r.x, rect.r.y, rect.r.w, rect.r.h) &&
+        !WaitForDecodeJobs(s))
+      return false;
+
+    /* If RichCursor encoding is used, we should prevent collisions
+       between framebuffer updates and cursor drawing operations. */
+    SoftCursorLockArea(s, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+
+    rfbRectangle area = rect.r;   /* the Raw decoder uses up rect.r */
+    uint32_t pixels = (uint32_t) rect.r.w * rect.r.h;
+    int64_t decodeStart = 0;
+    size_t bytesBefore = 0;
+    if (appData.bench) {
+      decodeStart = BenchNanos();
+      bytesBefore = RFBBytesRead(s);
+    }
+
+    switch (rect.encoding) {
 
-      rect.r.x = Swap16IfLE(rect.r.x);
-      rect.r.y = Swap16IfLE(rect.r.y);
-      rect.r.w = Swap16IfLE(rect.r.w);
-      rect.r.h = Swap16IfLE(rect.r.h);
+    case rfbEncodingRaw:
+    {
+      /* Convert the pixels into the frame buffer straight from the input
+         buffer, as much of a row as has arrived at a time. */
+      size_t bytesPerPixel = s->format.bitsPerPixel / 8;
+      uint32_t col = 0;
 
-      if (rect.encoding == rfbEncodingXCursor || rect.encoding == rfbEncodingRichCursor) {
-        if (!HandleCursorShape(rect.r.x, rect.r.y, rect.r.w, rect.r.h, rect.encoding)) {
+      while (rect.r.h > 0) {
+        size_t n;
+        const uint8_t *pixels = ReadBufferedFromRFBServer(s, bytesPerPixel,
+                                                          rect.r.w - col, &n);
+        if (!pixels)
           return false;
+        CopyDataToScreen(s, pixels, rect.r.x + col, rect.r.y, (uint32_t) n, 1);
+
+        col += (uint32_t) n;
+        if (col == rect.r.w) {
+          col = 0;
+          rect.r.h = (uint16_t) (rect.r.h - 1);
+          rect.r.y = (uint16_t) (rect.r.y + 1);
         }
-        continue;
       }
+      break;
+    }
 
-      if (rect.encoding == rfbEncodingPointerPos) {
-        if (!HandleCursorPos(rect.r.x, rect.r.y)) {
-          return false;
-        }
-        appData.gotCursorPos = 1;
-        continue;
+    case rfbEncodingCopyRect:
+    {
+      rfbCopyRect cr;
+
+      if (!ReadFromRFBServer(s, (uint8_t *)&cr, sz_rfbCopyRect))
+        return false;
+
+        if (!BufferWritten(s)) {
+          /* Ignore attempts to do copy-rect when we have nothing to
+           * copy from.
+           */
+          break;
       }
 
-      if ((rect.r.x + rect.r.w > si.framebufferWidth) ||
-          (rect.r.y + rect.r.h > si.framebufferHeight))
+      cr.srcX = Swap16IfLE(cr.srcX);
+      cr.srcY = Swap16IfLE(cr.srcY);
+
+      if ((cr.srcX + rect.r.w > s->si.framebufferWidth) ||
+          (cr.srcY + rect.r.h > s->si.framebufferHeight))
         {
-          fprintf(stderr,"Rect too large: %dx%d at (%d, %d)\n",
-                  rect.r.w, rect.r.h, rect.r.x, rect.r.y);
+          fprintf(stderr,"CopyRect source out of range: %dx%d at (%d, %d)\n",
+                  rect.r.w, rect.r.h, cr.srcX, cr.srcY);
           return false;
         }
 
-      if ((rect.r.h * rect.r.w) == 0) {
-        fprintf(stderr,"Zero size rect - ignoring\n");
-        continue;
-      }
-
-      /* If RichCursor encoding is used, we should prevent collisions
-         between framebuffer updates and cursor drawing operations. */
-      SoftCursorLockArea(rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+      /* The rectangle copied from must be finished too. */
+      if (DecodeJobsOverlap(s, cr.srcX, cr.srcY, rect.r.w, rect.r.h) &&
+          !WaitForDecodeJobs(s))
+        return false;
 
-      switch (rect.encoding) {
+      /* If RichCursor encoding is used, we should extend our
+         "cursor lock area" (previously set to destination
+         rectangle) to the source rectangle as well. */
+      SoftCursorLockArea(s, cr.srcX, cr.srcY, rect.r.w, rect.r.h);
 
-      case rfbEncodingRaw:
-      {
-        size_t bytesPerLine = (size_t)rect.r.w * myFormat.bitsPerPixel / 8;
-        size_t linesToRead = BUFFER_SIZE / bytesPerLine;
+      CopyScreenRectangle(s, cr.srcX, cr.srcY, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
 
-        while (rect.r.h > 0) {
-          if (linesToRead > rect.r.h)
-            linesToRead = rect.r.h;
+      break;
+    }
 
-          if (!ReadFromRFBServer(buffer, bytesPerLine * linesToRead))
-            return false;
-          assert(linesToRead <= UINT32_MAX);
-          CopyDataToScreen(buffer, rect.r.x, rect.r.y, rect.r.w,
-                           (uint32_t) linesToRead);
+    case rfbEncodingRRE:
+    {
+      if (!HandleRRE32(s, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+          return false;
+      break;
+    }
 
-          rect.r.h = (uint16_t) (rect.r.h - linesToRead);
-          rect.r.y = (uint16_t) (rect.r.y + linesToRead);
+    case rfbEncodingCoRRE:
+    {
+      if (!HandleCoRRE32(s, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+        return false;
+      break;
+    }
 
-        }
-        break;
-      }
+    case rfbEncodingHextile:
+    {
+      if (!HandleHextile32(s, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+          return false;
+      break;
+    }
 
-      case rfbEncodingCopyRect:
-      {
-        rfbCopyRect cr;
+    case rfbEncodingZlib:
+    {
+      if (!HandleZlib32(s, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+          return false;
+      break;
+   }
 
-        if (!ReadFromRFBServer((uint8_t *)&cr, sz_rfbCopyRect))
+    case rfbEncodingTight:
+    {
+      if (!HandleTight32(s, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
           return false;
+      break;
+    }
 
-          if (!BufferWritten()) {
-            /* Ignore attempts to do copy-rect when we have nothing to
-             * copy from.
-             */
-            break;
-        }
+    case rfbEncodingZRLE:
+      if (!zrleDecode(s, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+        return false;
+      break;
 
-        cr.srcX = Swap16IfLE(cr.srcX);
-        cr.srcY = Swap16IfLE(cr.srcY);
+    default:
+      fprintf(stderr,"Unknown rect encoding %d\n",
+              (int)rect.encoding);
+      return false;
+    }
 
-        /* If RichCursor encoding is used, we should extend our
-           "cursor lock area" (previously set to destination
-           rectangle) to the source rectangle as well. */
-        SoftCursorLockArea(cr.srcX, cr.srcY, rect.r.w, rect.r.h);
+    if (appData.bench) {
+      BenchRect(rect.encoding, pixels, RFBBytesRead(s) - bytesBefore,
+                BenchNanos() - decodeStart);
+    }
+    /* A rectangle queued to be decoded on another thread, which nothing
+       else queued can overlap, is reported to the streamed snapshot once
+       it is finished. */
+    if (DecodeJobsOverlap(s, area.x, area.y, area.w, area.h))
+      s->decoders->queuedEncoding = rect.encoding;
+    else
+      StreamRectDecoded(s, area.x, area.y, area.w, area.h);
+
+    /* Now we may discard "soft cursor locks", unless the cursor would be
+       drawn over rectangles still being decoded. */
+    if (DecodeJobsQueued(s) == 0)
+      SoftCursorUnlockScreen(s);
+
+      /* Done. Save the screen image. */
+  }
 
-        uint8_t *buffer = CopyScreenToData(cr.srcX, cr.srcY, rect.r.w, rect.r.h);
-        CopyDataToScreen(buffer, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
-        free(buffer);
+  return true;
+}
 
-        break;
-      }
+/*
+ * WaitForDecodeJobs() waits for rectangles being decoded on other threads.
+ */
 
-      case rfbEncodingRRE:
-      {
-        if (!HandleRRE32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-            return false;
-        break;
-      }
+static bool
+WaitForDecodeJobs(Session *s)
+{
+  int64_t start;
+  bool ok;
+
+  if (!appData.bench)
+    return FinishDecodeJobs(s);
+
+  /* Servers stick to one encoding, so what was last queued stands for the
+     lot */
+  start = BenchNanos();
+  ok = FinishDecodeJobs(s);
+  BenchWait(s->decoders->queuedEncoding, BenchNanos() - start);
+  return ok;
+}
 
-      case rfbEncodingCoRRE:
-      {
-        if (!HandleCoRRE32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-          return false;
-        break;
-      }
 
-      case rfbEncodingHextile:
-      {
-        if (!HandleHextile32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-            return false;
-        break;
-      }
+/*
+ * HandleRFBServerMessage.
+ */
 
-      case rfbEncodingZlib:
-      {
-        if (!HandleZlib32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-            return false;
-        break;
-     }
+bool
+HandleRFBServerMessage(Session *s)
+{
+  rfbServerToClientMsg msg;
 
-      case rfbEncodingTight:
-      {
-        if (!HandleTight32(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-            return false;
-        break;
-      }
+  if (!ReadFromRFBServer(s, (uint8_t *)&msg, 1))
+    return false;
 
-      case rfbEncodingZRLE:
-        if (!zrleDecode(rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-          return false;
-        break;
+  switch (msg.type) {
 
-      default:
-        fprintf(stderr,"Unknown rect encoding %d\n",
-                (int)rect.encoding);
-        return false;
-      }
+  case rfbSetColourMapEntries:
+  {
+    fprintf(stderr, "Received unsupported rfbSetColourMapEntries\n");
+    return false; /* unsupported */
+  }
+
+  case rfbFramebufferUpdate:
+  {
+    if (!ReadFromRFBServer(s, ((uint8_t *)&msg.fu) + 1,
+                           sz_rfbFramebufferUpdateMsg - 1))
+      return false;
 
-      /* Now we may discard "soft cursor locks". */
-      SoftCursorUnlockScreen();
+    msg.fu.nRects = Swap16IfLE(msg.fu.nRects);
+
+    /* Rectangles may still be being decoded on other threads even if
+       reading the update failed, and the cursor goes back on top of them
+       only once they are done. */
+    bool ok = HandleUpdateRects(s, msg.fu.nRects);
+    if (!WaitForDecodeJobs(s))
+      ok = false;
+    SoftCursorUnlockScreen(s);
+    if (!ok)
+      return false;
 
-        /* Done. Save the screen image. */
+    if (appData.bench) {
+      BenchUpdate();
     }
 
-      /* RealVNC sometimes returns an initial black screen. */
-      if (BufferIsBlank() && appData.ignoreBlank) {
-          if (!appData.quiet && appData.ignoreBlank != 1) {
-              /* user did not specify either -quiet or -ignoreblank */
-              fprintf(stderr, "Warning: discarding received blank screen (use -allowblank to accept,\n   or -ignoreblank to suppress this message)\n");
-              appData.ignoreBlank = 1;
-          }
-          RequestNewUpdate();
-      } else {
-          return false;
-      }
+    /* RealVNC sometimes returns an initial black screen. */
+    if (BufferIsBlank(s) && appData.ignoreBlank) {
+        if (!appData.quiet && appData.ignoreBlank != 1 && !s->blankWarned) {
+            /* user did not specify either -quiet or -ignoreblank */
+            fprintf(stderr, "Warning: discarding received blank screen (use -allowblank to accept,\n   or -ignoreblank to suppress this message)\n");
+            s->blankWarned = true;
+        }
+        RequestNewUpdate(s);
+    } else {
+        return false;
+    }
 
     break;
   }
@@ -694,23 +945,23 @@ HandleRFBServerMessage()
 
   case rfbServerCutText:
   {
-    if (!ReadFromRFBServer(((uint8_t *)&msg) + 1,
+    if (!ReadFromRFBServer(s, ((uint8_t *)&msg) + 1,
                            sz_rfbServerCutTextMsg - 1))
       return false;
 
     msg.sct.length = Swap32IfLE(msg.sct.length);
 
-    if (serverCutText)
-      free(serverCutText);
+    if (s->serverCutText)
+      free(s->serverCutText);
 
-    serverCutText = malloc(msg.sct.length+1);
+    s->serverCutText = malloc(msg.sct.length+1);
 
-    if (!ReadFromRFBServer(serverCutText, msg.sct.length))
+    if (!ReadFromRFBServer(s, s->serverCutText, msg.sct.length))
       return false;
 
-    serverCutText[msg.sct.length] = 0;
+    s->serverCutText[msg.sct.length] = 0;
 
-    newServerCutText = true;
+    s->newServerCutText = true;
 
     break;
   }
@@ -790,20 +1041,20 @@ PrintPixelFormat(format)
 }
 
 static int32_t
-ReadCompactLen (void)
+ReadCompactLen (Session *s)
 {
   uint32_t len;
   uint8_t b;
 
-  if (!ReadFromRFBServer((uint8_t *)&b, 1))
+  if (!ReadFromRFBServer(s, (uint8_t *)&b, 1))
     return -1;
   len = (uint32_t)b & 0x7F;
   if (b & 0x80) {
-    if (!ReadFromRFBServer((uint8_t *)&b, 1))
+    if (!ReadFromRFBServer(s, (uint8_t *)&b, 1))
       return -1;
     len |= ((uint32_t)b & 0x7F) << 7;
     if (b & 0x80) {
-      if (!ReadFromRFBServer((uint8_t *)&b, 1))
+      if (!ReadFromRFBServer(s, (uint8_t *)&b, 1))
         return -1;
       len |= ((uint32_t)b & 0xFF) << 14;
     }
@@ -812,27 +1063,94 @@ ReadCompactLen (void)
 }
 
 /*
- * JPEG source manager functions for JPEG decompression in Tight decoder.
+ * StartTightQueues() sets up the queues Tight rectangles are decoded on.
+ * With more than one -decodethreads, each zlib stream has a thread of its
+ * own and JPEG rectangles have that many; otherwise all is decoded as it
+ * is read.
+ */
+
+static bool
+StartTightQueues(Session *s)
+{
+  struct Decoders *d = s->decoders;
+  int threads = DecodeThreads();
+
+  for (int i = 0; i < 4; i++) {
+    d->tightQueues[i] = AddDecodeQueue(s, threads > 1 ? 1 : 0, sizeof(struct TightStream),
+                                       FreeTightStream);
+    if (d->tightQueues[i] < 0)
+      return false;
+  }
+  d->jpegQueue = AddDecodeQueue(s, threads > 1 ? threads : 0, sizeof(struct TightJpeg),
+                                FreeTightJpeg);
+  if (d->jpegQueue < 0)
+    return false;
+
+  d->tightQueuesStarted = true;
+  return true;
+}
+
+/*
+ * ResetTightStream() flushes a Tight zlib stream, as a job queued behind
+ * the stream's rectangles.
  */
 
-static struct jpeg_source_mgr jpegSrcManager;
-static JOCTET *jpegBufferPtr;
-static size_t jpegBufferLen;
+static bool
+ResetTightStream(Session *s, void *data, void *scratch, bool *black)
+{
+  struct TightStream *ts = scratch;
+  (void) s;
+  (void) data;
+  (void) black;
+
+  if (ts->active) {
+    if (inflateEnd(&ts->zs) != Z_OK && ts->zs.msg != NULL)
+      fprintf(stderr, "inflateEnd: %s\n", ts->zs.msg);
+    ts->active = false;
+  }
+  return true;
+}
+
+static void
+FreeTightStream(void *scratch)
+{
+  struct TightStream *ts = scratch;
+
+  if (ts->active)
+    inflateEnd(&ts->zs);
+}
+
+static void
+FreeTightJpeg(void *scratch)
+{
+  struct TightJpeg *tj = scratch;
+
+  if (tj->created)
+    jpeg_destroy_decompress(&tj->cinfo);
+  free(tj->rows);
+}
+
+/*
+ * JPEG source manager functions for JPEG decompression in Tight decoder.
+ * The source manager is the decompressor's client_data.
+ */
 
 static void
 JpegInitSource(j_decompress_ptr cinfo)
 {
-  (void) cinfo;
-  jpegError = false;
+  struct JpegSource *src = cinfo->client_data;
+
+  src->error = false;
 }
 
 static boolean
 JpegFillInputBuffer(j_decompress_ptr cinfo)
 {
-  (void) cinfo;
-  jpegError = true;
-  jpegSrcManager.bytes_in_buffer = jpegBufferLen;
-  jpegSrcManager.next_input_byte = (JOCTET *)jpegBufferPtr;
+  struct JpegSource *src = cinfo->client_data;
+
+  src->error = true;
+  src->mgr.bytes_in_buffer = src->bufferLen;
+  src->mgr.next_input_byte = (JOCTET *)src->bufferPtr;
 
   return TRUE;
 }
@@ -840,14 +1158,15 @@ JpegFillInputBuffer(j_decompress_ptr cinfo)
 static void
 JpegSkipInputData(j_decompress_ptr cinfo, long num_bytes)
 {
-  (void) cinfo;
-  if (num_bytes < 0 || (unsigned int) num_bytes > jpegSrcManager.bytes_in_buffer) {
-    jpegError = true;
-    jpegSrcManager.bytes_in_buffer = jpegBufferLen;
-    jpegSrcManager.next_input_byte = (JOCTET *)jpegBufferPtr;
+  struct JpegSource *src = cinfo->client_data;
+
+  if (num_bytes < 0 || (unsigned int) num_bytes > src->mgr.bytes_in_buffer) {
+    src->error = true;
+    src->mgr.bytes_in_buffer = src->bufferLen;
+    src->mgr.next_input_byte = (JOCTET *)src->bufferPtr;
   } else {
-    jpegSrcManager.next_input_byte += (size_t) num_bytes;
-    jpegSrcManager.bytes_in_buffer -= (size_t) num_bytes;
+    src->mgr.next_input_byte += (size_t) num_bytes;
+    src->mgr.bytes_in_buffer -= (size_t) num_bytes;
   }
 }
 
@@ -859,20 +1178,20 @@ JpegTermSource(j_decompress_ptr cinfo)
 }
 
 static void
-JpegSetSrcManager(j_decompress_ptr cinfo, uint8_t *compressedData,
-                  size_t compressedLen)
+JpegSetSrcManager(j_decompress_ptr cinfo, struct JpegSource *src,
+                  uint8_t *compressedData, size_t compressedLen)
 {
-  jpegBufferPtr = (JOCTET *)compressedData;
-  jpegBufferLen = compressedLen;
-
-  jpegSrcManager.init_source = JpegInitSource;
-  jpegSrcManager.fill_input_buffer = JpegFillInputBuffer;
-  jpegSrcManager.skip_input_data = JpegSkipInputData;
-  jpegSrcManager.resync_to_restart = jpeg_resync_to_restart;
-  jpegSrcManager.term_source = JpegTermSource;
-  jpegSrcManager.next_input_byte = jpegBufferPtr;
-  jpegSrcManager.bytes_in_buffer = jpegBufferLen;
-
-  cinfo->src = &jpegSrcManager;
+  src->bufferPtr = (JOCTET *)compressedData;
+  src->bufferLen = compressedLen;
+
+  src->mgr.init_source = JpegInitSource;
+  src->mgr.fill_input_buffer = JpegFillInputBuffer;
+  src->mgr.skip_input_data = JpegSkipInputData;
+  src->mgr.resync_to_restart = jpeg_resync_to_restart;
+  src->mgr.term_source = JpegTermSource;
+  src->mgr.next_input_byte = src->bufferPtr;
+  src->mgr.bytes_in_buffer = src->bufferLen;
+
+  cinfo->src = &src->mgr;
+  cinfo->client_data = src;
 }
-
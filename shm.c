@@ -0,0 +1,285 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * shm.c - publish the screen in POSIX shared memory for local readers.
+ *
+ * With -shm, each snapshot is also copied into one of two frames in a
+ * shared memory object, laid out as vncshm.h describes, so that any number
+ * of programs on this machine can read the screen in place from one VNC
+ * connection. Only the tiles of the damage map drawn in since the frame
+ * being overwritten was published are copied, and the tiles drawn in since
+ * the last frame are published with it as changed rectangles.
+ */
+
+#ifndef WIN32
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vncsnapshot.h"
+#include "vncshm.h"
+
+#define FRAME_ALIGN 4096        /* frames start on a page */
+
+/* A session's shared memory object, while it is mapped */
+struct SharedScreen {
+    VncShmHeader *header;
+    size_t mapSize;
+    size_t frameStride;
+    uint32_t tileColumns, tileRows;
+    uint8_t *lastDamage;    /* tiles drawn in for the last frame */
+};
+
+static void CopyStaleTiles(Session *s, uint8_t *frame, uint64_t generation);
+static uint32_t ChangedRects(Session *s, VncShmRect *rects);
+
+
+/*
+ * StartSharedScreen() creates the shared memory object name, replacing any
+ * left by an earlier run, and maps it for a session. Programs that still
+ * have the old one mapped keep it. If it fails, StopSharedScreen() frees
+ * what it did allocate.
+ */
+
+bool
+StartSharedScreen(Session *s, const char *name)
+{
+    uint32_t width = s->si.framebufferWidth, height = s->si.framebufferHeight;
+    size_t headerSize = (sizeof(VncShmHeader) + FRAME_ALIGN - 1) / FRAME_ALIGN * FRAME_ALIGN;
+    size_t frameSize;
+    struct SharedScreen *sh;
+    VncShmHeader *shared;
+    int fd, i;
+
+    sh = calloc(1, sizeof(struct SharedScreen));
+    if (sh == NULL) {
+        fprintf(stderr, "Failed to allocate memory for shared screen\n");
+        return false;
+    }
+    s->shared = sh;
+
+    sh->frameStride = (size_t)width * ScreenBytesPerPixel(s);
+    frameSize = (sh->frameStride * height + FRAME_ALIGN - 1) / FRAME_ALIGN * FRAME_ALIGN;
+
+    sh->tileColumns = (width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    sh->tileRows = (height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    sh->lastDamage = calloc((size_t)sh->tileColumns * sh->tileRows, 1);
+    if (sh->lastDamage == NULL) {
+        fprintf(stderr, "Failed to allocate memory for shared screen damage\n");
+        return false;
+    }
+
+    (void) shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Cannot create shared memory %s: %s\n",
+                programName, name, strerror(errno));
+        return false;
+    }
+    if (ftruncate(fd, (off_t)(headerSize + 2 * frameSize)) != 0) {
+        fprintf(stderr, "%s: Cannot resize shared memory %s: %s\n",
+                programName, name, strerror(errno));
+        (void) close(fd);
+        return false;
+    }
+    shared = mmap(NULL, headerSize + 2 * frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    (void) close(fd);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "%s: Cannot map shared memory %s: %s\n",
+                programName, name, strerror(errno));
+        return false;
+    }
+    sh->header = shared;
+    sh->mapSize = headerSize + 2 * frameSize;
+
+    /* The object starts out zeroed: no frame published yet */
+    shared->version = VNCSHM_VERSION;
+    shared->width = width;
+    shared->height = height;
+    shared->bytesPerPixel = (uint32_t) ScreenBytesPerPixel(s);
+    shared->stride = (uint32_t) sh->frameStride;
+    for (i = 0; i < 2; i++) {
+        shared->slots[i].offset = headerSize + (size_t)i * frameSize;
+    }
+    __atomic_store_n(&shared->magic, VNCSHM_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * StopSharedScreen() unmaps a session's shared memory object, leaving it
+ * for readers to go on using. It does nothing if there is none.
+ */
+
+void
+StopSharedScreen(Session *s)
+{
+    struct SharedScreen *sh = s->shared;
+
+    if (sh == NULL) {
+        return;
+    }
+    if (sh->header != NULL) {
+        (void) munmap(sh->header, sh->mapSize);
+    }
+    free(sh->lastDamage);
+    free(sh);
+    s->shared = NULL;
+}
+
+/*
+ * PublishSharedScreen() brings the older of the two frames up to date with
+ * the frame buffer and publishes it as the latest. It must be called for
+ * each snapshot, before the damage map is cleared.
+ */
+
+void
+PublishSharedScreen(Session *s)
+{
+    VncShmHeader *shared = s->shared->header;
+    uint64_t generation = shared->generation + 1;
+    VncShmSlot *slot = &shared->slots[generation % 2];
+    uint32_t sequence = slot->sequence;
+
+    /* Readers of the frame held until now see it is being rewritten */
+    __atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    CopyStaleTiles(s, (uint8_t *) shared + slot->offset, generation);
+    slot->numRects = ChangedRects(s, slot->rects);
+    slot->generation = generation;
+
+    __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&shared->generation, generation, __ATOMIC_RELEASE);
+}
+
+/*
+ * CopyStaleTiles() copies into frame the tiles drawn in since the frame it
+ * holds, two frames before generation, was published: those drawn in for
+ * the last frame and for this one. The first two frames are copied whole.
+ * Runs of tiles in a row are copied together.
+ */
+
+static void
+CopyStaleTiles(Session *s, uint8_t *frame, uint64_t generation)
+{
+    struct SharedScreen *sh = s->shared;
+    uint32_t column, row, first;
+
+    if (generation <= 2) {
+        CopyScreenToFrame(s, frame, sh->frameStride, 0, 0,
+                          s->si.framebufferWidth, s->si.framebufferHeight);
+        return;
+    }
+    for (row = 0; row < sh->tileRows; row++) {
+        uint32_t top = row * DAMAGE_TILE_SIZE;
+        uint32_t bottom = top + DAMAGE_TILE_SIZE < s->si.framebufferHeight ?
+                          top + DAMAGE_TILE_SIZE : s->si.framebufferHeight;
+
+        for (column = 0; column < sh->tileColumns; ) {
+            if (!ScreenTileDamaged(s, column, row) &&
+                !sh->lastDamage[row * sh->tileColumns + column]) {
+                column++;
+                continue;
+            }
+            first = column;
+            while (column < sh->tileColumns &&
+                   (ScreenTileDamaged(s, column, row) ||
+                    sh->lastDamage[row * sh->tileColumns + column])) {
+                column++;
+            }
+            uint32_t left = first * DAMAGE_TILE_SIZE;
+            uint32_t right = column * DAMAGE_TILE_SIZE < s->si.framebufferWidth ?
+                             column * DAMAGE_TILE_SIZE : s->si.framebufferWidth;
+            CopyScreenToFrame(s, frame, sh->frameStride, left, top, right - left, bottom - top);
+        }
+    }
+}
+
+/*
+ * ChangedRects() fills rects with the tiles drawn in since the last frame,
+ * as runs of tiles in a row joined with identical runs in the row above,
+ * and remembers those tiles for the next frame. It returns the number of
+ * rectangles, which is one for the whole screen if there would be too many.
+ */
+
+static uint32_t
+ChangedRects(Session *s, VncShmRect *rects)
+{
+    struct SharedScreen *sh = s->shared;
+    uint32_t numRects = 0, rowStart;
+    uint32_t column, row, first, i;
+    bool overflow = false;
+
+    for (row = 0; row < sh->tileRows; row++) {
+        uint16_t top = (uint16_t) (row * DAMAGE_TILE_SIZE);
+        uint16_t height = (uint16_t) (top + DAMAGE_TILE_SIZE < s->si.framebufferHeight ?
+                                      DAMAGE_TILE_SIZE : (uint32_t)s->si.framebufferHeight - top);
+
+        rowStart = numRects;
+        for (column = 0; column < sh->tileColumns; column++) {
+            sh->lastDamage[row * sh->tileColumns + column] = ScreenTileDamaged(s, column, row);
+        }
+        for (column = 0; column < sh->tileColumns && !overflow; ) {
+            if (!ScreenTileDamaged(s, column, row)) {
+                column++;
+                continue;
+            }
+            first = column;
+            while (column < sh->tileColumns && ScreenTileDamaged(s, column, row)) {
+                column++;
+            }
+            uint16_t left = (uint16_t) (first * DAMAGE_TILE_SIZE);
+            uint16_t width = (uint16_t) (column * DAMAGE_TILE_SIZE < s->si.framebufferWidth ?
+                                         (column - first) * DAMAGE_TILE_SIZE :
+                                         (uint32_t)s->si.framebufferWidth - left);
+
+            for (i = 0; i < rowStart; i++) {
+                if (rects[i].x == left && rects[i].w == width && rects[i].y + rects[i].h == top) {
+                    rects[i].h = (uint16_t) (rects[i].h + height);
+                    break;
+                }
+            }
+            if (i < rowStart) {
+                continue;
+            }
+            if (numRects == VNCSHM_MAX_RECTS) {
+                overflow = true;
+                break;
+            }
+            rects[numRects].x = left;
+            rects[numRects].y = top;
+            rects[numRects].w = width;
+            rects[numRects].h = height;
+            numRects++;
+        }
+    }
+
+    if (overflow) {
+        rects[0].x = rects[0].y = 0;
+        rects[0].w = s->si.framebufferWidth;
+        rects[0].h = s->si.framebufferHeight;
+        numRects = 1;
+    }
+    return numRects;
+}
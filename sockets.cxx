@@ -43,13 +43,33 @@ extern "C" {
 
 #include "rdr/FdInStream.h"
 #include "rdr/FdOutStream.h"
+#include "rdr/MemInStream.h"
 #include "rdr/Exception.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+
+
+/* Large enough to take a few rows of Raw pixels in one read. */
+#define IN_BUFFER_SIZE 65536
+
+/* A session's streams. What the server sends is read from the socket
+   stream, when connected, or the recorded session, when replaying; fis is
+   one of these. */
+struct RFBStreams {
+  rdr::InStream* fis;
+  rdr::FdOutStream* fos;        /* NULL when replaying */
+  rdr::FdInStream* sockInStream;
+  rdr::MemInStream* replayInStream;
+  uint8_t* replayData;
+  int recordFd;
+};
 
-int rfbsock;
-rdr::FdInStream* fis;
-rdr::FdOutStream* fos;
-bool sameMachine = false;
+/* A recording is this line followed by everything the server sent from
+   the ServerInit message on. */
+static const char recordingHeader[] = "vncsnapshot RFB recording 1\n";
+
+static pthread_mutex_t resolverLock = PTHREAD_MUTEX_INITIALIZER;
 
 /*static bool rfbsockReady = false;*/
 
@@ -99,7 +119,7 @@ InitializeSockets(void)
  * ConnectToRFBServer.
  */
 
-bool ConnectToRFBServer(const char *hostname, uint16_t port)
+bool ConnectToRFBServer(Session *s, const char *hostname, uint16_t port)
 {
   int sock = ConnectToTcpAddr(hostname, port);
 
@@ -108,15 +128,40 @@ bool ConnectToRFBServer(const char *hostname, uint16_t port)
     return false;
   }
 
-  return SetRFBSock(sock);
+  return SetRFBSock(s, sock);
+}
+
+/*
+ * NewStreams gives a session its (empty) streams, or returns NULL if
+ * there is not enough memory.
+ */
+
+static RFBStreams *NewStreams(Session *s)
+{
+  RFBStreams *streams = (RFBStreams *) calloc(1, sizeof(RFBStreams));
+
+  if (streams == NULL) {
+    fprintf(stderr,"Failed to allocate memory for connection\n");
+    return NULL;
+  }
+  streams->recordFd = -1;
+  s->streams = streams;
+  return streams;
 }
 
-bool SetRFBSock(int sock)
+bool SetRFBSock(Session *s, int sock)
 {
+  RFBStreams *streams = NewStreams(s);
+
+  if (streams == NULL) {
+    close(sock);
+    return false;
+  }
+
   try {
-    rfbsock = sock;
-    fis = new rdr::FdInStream(rfbsock);
-    fos = new rdr::FdOutStream(rfbsock);
+    s->sock = sock;
+    streams->fis = streams->sockInStream = new rdr::FdInStream(sock, 0, IN_BUFFER_SIZE);
+    streams->fos = new rdr::FdOutStream(sock);
 
     struct sockaddr_in peeraddr, myaddr;
     socklen_t addrlen = sizeof(struct sockaddr_in);
@@ -124,7 +169,7 @@ bool SetRFBSock(int sock)
     getpeername(sock, (struct sockaddr *)&peeraddr, &addrlen);
     getsockname(sock, (struct sockaddr *)&myaddr, &addrlen);
 
-    sameMachine = (peeraddr.sin_addr.s_addr == myaddr.sin_addr.s_addr);
+    s->sameMachine = (peeraddr.sin_addr.s_addr == myaddr.sin_addr.s_addr);
 
     return true;
   } catch (rdr::Exception& e) {
@@ -133,10 +178,45 @@ bool SetRFBSock(int sock)
   return false;
 }
 
-bool ReadFromRFBServer(uint8_t *out, size_t n)
+/*
+ * CloseRFBConnection closes the session's connection, or the recording
+ * being replayed, and frees its streams.
+ */
+
+void CloseRFBConnection(Session *s)
+{
+  RFBStreams *streams = s->streams;
+
+  if (streams != NULL) {
+    delete streams->sockInStream;
+    delete streams->fos;
+    delete streams->replayInStream;
+    free(streams->replayData);
+    if (streams->recordFd >= 0)
+      close(streams->recordFd);
+    free(streams);
+    s->streams = NULL;
+  }
+  if (s->sock >= 0) {
+    close(s->sock);
+    s->sock = -1;
+  }
+}
+
+/*
+ * RFBInStream returns the stream the session reads what the server sends
+ * from, for the ZRLE decoder.
+ */
+
+rdr::InStream* RFBInStream(Session *s)
+{
+  return s->streams->fis;
+}
+
+bool ReadFromRFBServer(Session *s, uint8_t *out, size_t n)
 {
   try {
-    fis->readBytes(out, n);
+    s->streams->fis->readBytes(out, n);
     return true;
   } catch (rdr::Exception& e) {
     fprintf(stderr,"ReadFromRFBServer: %s\n",e.str());
@@ -145,12 +225,43 @@ bool ReadFromRFBServer(uint8_t *out, size_t n)
 }
 
 
+/*
+ * ReadBufferedFromRFBServer reads up to maxItems items of itemSize bytes,
+ * at least one, without copying them out of the input buffer. It returns a
+ * pointer to them, valid until the next read, and sets *nItems to how many
+ * there are, or returns NULL on error.
+ */
+
+const uint8_t *ReadBufferedFromRFBServer(Session *s, size_t itemSize, size_t maxItems,
+                                         size_t *nItems)
+{
+  rdr::InStream* fis = s->streams->fis;
+
+  try {
+    *nItems = fis->check(itemSize, maxItems);
+    const uint8_t *data = fis->getptr();
+    fis->setptr(data + *nItems * itemSize);
+    return data;
+  } catch (rdr::Exception& e) {
+    fprintf(stderr,"ReadFromRFBServer: %s\n",e.str());
+  }
+  return NULL;
+}
+
+
 /*
  * Write an exact number of bytes, and don't return until you've sent them.
  */
 
-bool WriteToRFBServer(uint8_t *buf, size_t n)
+bool WriteToRFBServer(Session *s, uint8_t *buf, size_t n)
 {
+  rdr::FdOutStream* fos = s->streams->fos;
+
+  if (!fos) {
+    /* Replaying a recording; there is nobody to tell. */
+    return true;
+  }
+
   try {
     fos->writeBytes(buf, n);
     fos->flush();
@@ -162,6 +273,115 @@ bool WriteToRFBServer(uint8_t *buf, size_t n)
 }
 
 
+/*
+ * StartRecording writes everything read from the server from now on to
+ * the given file, so that the session can be replayed with OpenReplay.
+ */
+
+bool StartRecording(Session *s, const char *filename)
+{
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+  if (fd < 0) {
+    fprintf(stderr,"%s: cannot create %s: %s\n", programName, filename,
+            strerror(errno));
+    return false;
+  }
+
+  try {
+    ssize_t len = (ssize_t) strlen(recordingHeader);
+    if (write(fd, recordingHeader, (size_t) len) != len)
+      throw rdr::SystemException("write",errno);
+    s->streams->sockInStream->record(fd);
+    s->streams->recordFd = fd;
+    return true;
+  } catch (rdr::Exception& e) {
+    fprintf(stderr,"StartRecording: %s\n",e.str());
+  }
+  close(fd);
+  return false;
+}
+
+
+/*
+ * OpenReplay reads a session recorded by StartRecording into memory, and
+ * reads its ServerInit message. Messages from the server are then read
+ * from the recording, and messages to the server are discarded.
+ */
+
+bool OpenReplay(Session *s, const char *filename)
+{
+  RFBStreams *streams;
+  size_t headerLen = strlen(recordingHeader);
+  size_t len = 0, size = 65536;
+  uint8_t *data = (uint8_t *) malloc(size);
+  FILE *file = fopen(filename, "rb");
+  size_t n;
+
+  if (!file) {
+    fprintf(stderr,"%s: cannot open %s: %s\n", programName, filename,
+            strerror(errno));
+    free(data);
+    return false;
+  }
+
+  while (data && (n = fread(data + len, 1, size - len, file)) > 0) {
+    len += n;
+    if (len == size) {
+      size *= 2;
+      data = (uint8_t *) realloc(data, size);
+    }
+  }
+  if (!data || ferror(file)) {
+    fprintf(stderr,"%s: cannot read %s\n", programName, filename);
+    fclose(file);
+    return false;
+  }
+  fclose(file);
+
+  if (len < headerLen || memcmp(data, recordingHeader, headerLen) != 0) {
+    fprintf(stderr,"%s: %s is not a vncsnapshot recording\n", programName,
+            filename);
+    free(data);
+    return false;
+  }
+
+  streams = NewStreams(s);
+  if (streams == NULL) {
+    free(data);
+    return false;
+  }
+  streams->replayData = data;
+  streams->fis = streams->replayInStream =
+    new rdr::MemInStream(data + headerLen, len - headerLen);
+
+  return ReadServerInit(s);
+}
+
+
+/*
+ * ReplayFinished returns true when every message in the recording being
+ * replayed has been read.
+ */
+
+bool ReplayFinished(Session *s)
+{
+  rdr::MemInStream* replayInStream = s->streams->replayInStream;
+
+  return replayInStream != NULL && replayInStream->bytesLeft() == 0;
+}
+
+
+/*
+ * RFBBytesRead returns the number of bytes read from the server so far.
+ */
+
+size_t RFBBytesRead(Session *s)
+{
+  return s->streams->fis->pos();
+}
+
+
 /*
  * ConnectToTcpAddr connects to the given host and port.
  */
@@ -341,12 +561,13 @@ bool StringToIPAddr(const char *str, unsigned int *addr)
   if (*addr != (unsigned int)-1)
     return true;
 
+  /* gethostbyname() returns the same static hostent to every thread */
+  pthread_mutex_lock(&resolverLock);
   hp = gethostbyname(str);
-
   if (hp) {
     *addr = *(unsigned int *)hp->h_addr;
-    return true;
   }
+  pthread_mutex_unlock(&resolverLock);
 
-  return false;
+  return hp != NULL;
 }
@@ -0,0 +1,328 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * stream.c - encode the first snapshot while it is still arriving.
+ *
+ * The first update covers the whole captured rectangle, and servers
+ * usually send it from the top down. Rather than wait for all of it before
+ * encoding, the area covered by each rectangle decoded is added up row by
+ * row, and a thread encodes each row of the image as soon as the rows up to
+ * it are complete: the watermark. A PNG row is filtered and deflated; JPEG
+ * rows are read straight from the frame buffer and compressed as each band
+ * of 8 or 16 is complete, and PPM rows are written out as they are.
+ *
+ * Anything drawn below the watermark after that, such as a later
+ * rectangle overlapping an earlier one or the cursor, would be missing
+ * from the image, so it stops the encoder instead and the snapshot is
+ * written the ordinary way once the update is complete.
+ */
+
+#ifndef WIN32
+#define _XOPEN_SOURCE 600
+#endif
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <png.h>
+
+#include "vncsnapshot.h"
+
+/* A session's snapshot being encoded, while the encoder thread runs */
+struct Stream {
+    bool spoiled;           /* rows were drawn after being encoded */
+    bool complete;          /* every row may be encoded */
+    uint32_t watermark;     /* rows of the rectangle that may be encoded */
+
+    char *filename;
+    uint32_t x, y, width, height;
+    uint32_t *rowCoverage;  /* pixels decoded in each row */
+
+    pthread_t encoderThread;
+    pthread_mutex_t lock;
+    pthread_cond_t rowsReady;
+};
+
+static void *EncoderThread(void *arg);
+static void EncodePNG(Session *s);
+static uint32_t WaitForRows(Session *s, uint32_t y);
+static void EndStream(Session *s);
+static void StopStream(Session *s);
+
+
+/*
+ * StartStreamedSnapshot() starts encoding a rectangle of the screen to
+ * filename as the next update fills it in. It returns false if the
+ * snapshot cannot be streamed, in which case it should be queued as usual.
+ */
+
+bool
+StartStreamedSnapshot(Session *s, const char *filename, uint32_t x, uint32_t y,
+                      uint32_t width, uint32_t height)
+{
+    struct Stream *st;
+
+    /* QOI is not encoded row by row, and the multi-threaded PNG encoder
+     * needs the whole image at once */
+    if (!appData.streamFirst || s->outputFormat == FORMAT_QOI ||
+        (s->outputFormat == FORMAT_PNG && PNGThreads() > 1)) {
+        return false;
+    }
+
+    st = calloc(1, sizeof(struct Stream));
+    if (st == NULL) {
+        return false;
+    }
+    st->rowCoverage = calloc(height, sizeof(uint32_t));
+    st->filename = strdup(filename);
+    if (st->rowCoverage == NULL || st->filename == NULL) {
+        free(st->rowCoverage);
+        free(st->filename);
+        free(st);
+        return false;
+    }
+    st->x = x;
+    st->y = y;
+    st->width = width;
+    st->height = height;
+    pthread_mutex_init(&st->lock, NULL);
+    pthread_cond_init(&st->rowsReady, NULL);
+
+    /* The encoder finds the stream through the session */
+    s->stream = st;
+    if (pthread_create(&st->encoderThread, NULL, EncoderThread, s) != 0) {
+        s->stream = NULL;
+        pthread_mutex_destroy(&st->lock);
+        pthread_cond_destroy(&st->rowsReady);
+        free(st->rowCoverage);
+        free(st->filename);
+        free(st);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * StreamRectDecoded() records that a rectangle of the screen has been
+ * decoded, letting the encoder have any rows now complete.
+ */
+
+void
+StreamRectDecoded(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    struct Stream *st = s->stream;
+    uint32_t left, right, row, last;
+
+    if (st == NULL || st->spoiled) {
+        return;
+    }
+    left = x > st->x ? x : st->x;
+    right = x + w < st->x + st->width ? x + w : st->x + st->width;
+    if (left >= right || y >= st->y + st->height || y + h <= st->y) {
+        return;
+    }
+    row = y > st->y ? y - st->y : 0;
+    last = y + h - st->y < st->height ? y + h - st->y : st->height;
+    for (; row < last; row++) {
+        st->rowCoverage[row] += right - left;
+    }
+
+    row = st->watermark;
+    while (row < st->height && st->rowCoverage[row] >= st->width) {
+        row++;
+    }
+    if (row > st->watermark) {
+        pthread_mutex_lock(&st->lock);
+        st->watermark = row;
+        pthread_cond_signal(&st->rowsReady);
+        pthread_mutex_unlock(&st->lock);
+    }
+}
+
+/*
+ * StreamScreenWritten() is told of everything drawn in the frame buffer
+ * before it is drawn. If that is in rows already handed to the encoder,
+ * the encoder is stopped: the image it is making would be out of date.
+ */
+
+void
+StreamScreenWritten(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+    struct Stream *st = s->stream;
+
+    if (st == NULL || st->spoiled ||
+        y >= st->y + st->watermark || y + h <= st->y ||
+        x >= st->x + st->width || x + w <= st->x) {
+        return;
+    }
+    StopStream(s);
+}
+
+/*
+ * FinishStreamedSnapshot() lets the encoder have the rest of the rows once
+ * the update is complete, and waits for it to finish. It returns false if
+ * the snapshot was spoiled and must be written the ordinary way.
+ */
+
+bool
+FinishStreamedSnapshot(Session *s)
+{
+    struct Stream *st = s->stream;
+
+    if (st == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&st->lock);
+    st->complete = true;
+    pthread_cond_signal(&st->rowsReady);
+    pthread_mutex_unlock(&st->lock);
+
+    EndStream(s);
+    return true;
+}
+
+/*
+ * CancelStreamedSnapshot() stops the encoder, if it is running, without
+ * finishing the snapshot, as when the connection is lost.
+ */
+
+void
+CancelStreamedSnapshot(Session *s)
+{
+    struct Stream *st = s->stream;
+
+    if (st == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&st->lock);
+    st->spoiled = true;
+    pthread_cond_signal(&st->rowsReady);
+    pthread_mutex_unlock(&st->lock);
+
+    EndStream(s);
+}
+
+/* EndStream() waits for the encoder thread and frees the stream. */
+static void
+EndStream(Session *s)
+{
+    struct Stream *st = s->stream;
+
+    pthread_join(st->encoderThread, NULL);
+    s->stream = NULL;
+    pthread_mutex_destroy(&st->lock);
+    pthread_cond_destroy(&st->rowsReady);
+    free(st->rowCoverage);
+    free(st->filename);
+    free(st);
+}
+
+static void
+StopStream(Session *s)
+{
+    /* Nothing may be drawn while the encoder could still be reading */
+    CancelStreamedSnapshot(s);
+    if (!appData.quiet) {
+        fprintf(stderr, "Screen redrawn while being encoded, encoding it again\n");
+    }
+}
+
+static void *
+EncoderThread(void *arg)
+{
+    Session *s = arg;
+    struct Stream *st = s->stream;
+
+    if (WritesFromScreen(s->outputFormat)) {
+        (void) WriteScreenImage(s, st->filename, st->x, st->y, st->width, st->height,
+                                WaitForRows);
+    } else {
+        EncodePNG(s);
+    }
+    return NULL;
+}
+
+/*
+ * WaitForRows() waits until row y of the rectangle may be encoded, and
+ * returns how many rows may be. It returns 0 if the snapshot has been
+ * spoiled instead.
+ */
+
+static uint32_t
+WaitForRows(Session *s, uint32_t y)
+{
+    struct Stream *st = s->stream;
+    uint32_t ready;
+
+    pthread_mutex_lock(&st->lock);
+    while (y >= st->watermark && !st->complete && !st->spoiled) {
+        pthread_cond_wait(&st->rowsReady, &st->lock);
+    }
+    ready = st->spoiled ? 0 : st->complete ? st->height : st->watermark;
+    pthread_mutex_unlock(&st->lock);
+    return ready;
+}
+
+static void
+EncodePNG(Session *s)
+{
+    struct Stream *st = s->stream;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    uint8_t *row = malloc((size_t)st->width * 3);
+    uint32_t y;
+    FILE *outfile;
+
+    if (row == NULL) errx(1, "couldn't allocate PNG row");
+
+    outfile = fopen(st->filename, "wb");
+    if (!outfile) err(1, "couldn't fopen %s", st->filename);
+
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+        (png_voidp) NULL, (png_error_ptr) NULL, (png_error_ptr) NULL);
+    if (!png_ptr) errx(1, "couldn't create PNG write struct");
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) errx(1, "couldn't create PNG info struct");
+
+    png_init_io(png_ptr, outfile);
+    png_set_compression_level(png_ptr, appData.pngLevel);
+    if (appData.pngFilters >= 0) {
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, appData.pngFilters);
+    }
+    if (appData.pngStrategy >= 0) {
+        png_set_compression_strategy(png_ptr, appData.pngStrategy);
+    }
+    png_set_IHDR(png_ptr, info_ptr, st->width, st->height,
+                 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+
+    for (y = 0; y < st->height && WaitForRows(s, y) > y; y++) {
+        CopyScreenToImage(s, row, st->x, st->y + y, st->width, 1);
+        png_write_row(png_ptr, row);
+    }
+    if (y == st->height) {
+        png_write_end(png_ptr, info_ptr);
+    }
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    (void) fclose(outfile);
+    free(row);
+}
@@ -0,0 +1,822 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * testserver.cxx - a minimal VNC server for testing vncsnapshot.
+ *
+ * Serves a synthetic desktop, or an image read from a PNG file, to one
+ * client at a time over loopback, using protocol version 3.3 without
+ * authentication. The framebuffer changes a number of times a second
+ * following one of a few patterns, and incremental update requests are
+ * answered with the changed area as it becomes available, in Raw or ZRLE
+ * encoding; scrolling is sent as a CopyRect where the client allows it.
+ * When a client disconnects, the number of updates and bytes sent and the
+ * time the client took to ask for each following update are reported.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <png.h>
+
+#include "rdr/FdInStream.h"
+#include "rdr/FdOutStream.h"
+#include "rdr/MemOutStream.h"
+#include "rdr/ZlibOutStream.h"
+#include "rdr/Exception.h"
+
+#include "rfb.h"
+
+static const char *programName;
+
+/* Options */
+static int port = 5900;
+static int width = 1024, height = 768;
+static const char *imageFile = NULL;
+static const char *desktopName = "vncsnapshot test server";
+static const char *encodingName = NULL;
+static const char *patternName = "box";
+static int rate = 10;
+static int scrollStep = 16;
+static bool once = false;
+
+enum Pattern { PATTERN_NONE, PATTERN_BOX, PATTERN_SCROLL, PATTERN_PAN };
+static Pattern pattern;
+
+/* Pixels are held as 0x00RRGGBB. 'base' is the unchanging desktop, which
+   the patterns draw over or move. */
+static uint32_t *fb;
+static uint32_t *base;
+
+/* A rectangle, empty when w or h is 0 */
+struct Rect {
+  int x, y, w, h;
+  Rect() : x(0), y(0), w(0), h(0) {}
+  Rect(int x_, int y_, int w_, int h_) : x(x_), y(y_), w(w_), h(h_) {}
+  bool empty() const { return w <= 0 || h <= 0; }
+};
+
+static Rect UnionRect(const Rect &a, const Rect &b);
+static Rect IntersectRect(const Rect &a, const Rect &b);
+
+/* What has changed since the client's last update */
+static Rect dirty;
+static int scrolled;    /* rows scrolled up, not yet in dirty */
+
+/* The connected client */
+struct Client {
+  rdr::FdInStream *is;
+  rdr::FdOutStream *os;
+  rdr::ZlibOutStream zos;
+  rdr::MemOutStream mos;
+  rfbPixelFormat format;
+  int32_t encoding;         /* Raw or ZRLE */
+  bool copyRect;
+  bool updateRequested;
+  bool incremental;
+  Rect requested;
+
+  /* Statistics */
+  unsigned long updates, rects;
+  int64_t updateSent;       /* Nanos() when the last update was sent, or 0 */
+  int64_t totalTurnaround, maxTurnaround;
+};
+
+static void Usage(void);
+static int64_t Nanos(void);
+static void MakeDesktop(void);
+static bool ReadImage(const char *filename);
+static int ListenOnLoopback(int port);
+static void ServeClient(int sock);
+static void Handshake(Client &c);
+static void HandleClientMessage(Client &c);
+static void Tick(unsigned long tick);
+static bool UpdatePending(Client &c);
+static void SendUpdate(Client &c);
+static void SendRect(Client &c, const Rect &r);
+static uint32_t ClientPixel(const rfbPixelFormat &f, uint32_t pixel);
+static void GetImage(Client &c, int x, int y, int w, int h, uint32_t *buf);
+
+/* The ZRLE encoders for 32-bit pixels, taking the client with them */
+#define EXTRA_ARGS , Client &c
+#define GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf) \
+  GetImage(c, tx, ty, tw, th, (uint32_t *)buf);
+#define BPP 32
+#include "rfb/zrleEncode.h"
+#define CPIXEL 24A
+#include "rfb/zrleEncode.h"
+#undef CPIXEL
+#define CPIXEL 24B
+#include "rfb/zrleEncode.h"
+#undef CPIXEL
+#undef BPP
+
+static uint32_t tileBuffer[rfbZRLETileWidth * rfbZRLETileHeight + 1];
+
+
+int
+main(int argc, char **argv)
+{
+  int listenSock;
+
+  programName = argv[0];
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    bool hasValue = i + 1 < argc;
+
+    if (strcmp(arg, "-port") == 0 && hasValue) {
+      port = atoi(argv[++i]);
+    } else if (strcmp(arg, "-width") == 0 && hasValue) {
+      width = atoi(argv[++i]);
+    } else if (strcmp(arg, "-height") == 0 && hasValue) {
+      height = atoi(argv[++i]);
+    } else if (strcmp(arg, "-image") == 0 && hasValue) {
+      imageFile = argv[++i];
+    } else if (strcmp(arg, "-name") == 0 && hasValue) {
+      desktopName = argv[++i];
+    } else if (strcmp(arg, "-encoding") == 0 && hasValue) {
+      encodingName = argv[++i];
+    } else if (strcmp(arg, "-pattern") == 0 && hasValue) {
+      patternName = argv[++i];
+    } else if (strcmp(arg, "-rate") == 0 && hasValue) {
+      rate = atoi(argv[++i]);
+    } else if (strcmp(arg, "-scroll") == 0 && hasValue) {
+      scrollStep = atoi(argv[++i]);
+    } else if (strcmp(arg, "-once") == 0) {
+      once = true;
+    } else {
+      Usage();
+    }
+  }
+
+  if (strcmp(patternName, "none") == 0) {
+    pattern = PATTERN_NONE;
+  } else if (strcmp(patternName, "box") == 0) {
+    pattern = PATTERN_BOX;
+  } else if (strcmp(patternName, "scroll") == 0) {
+    pattern = PATTERN_SCROLL;
+  } else if (strcmp(patternName, "pan") == 0) {
+    pattern = PATTERN_PAN;
+  } else {
+    Usage();
+  }
+  if (encodingName && strcmp(encodingName, "raw") != 0 && strcmp(encodingName, "zrle") != 0) {
+    Usage();
+  }
+  if (rate < 0 || scrollStep < 1) {
+    Usage();
+  }
+
+  if (imageFile && !ReadImage(imageFile)) {
+    return 1;
+  }
+  /* The box pattern needs room for its box */
+  if (width < 64 || height < 64 || width > 65535 || height > 65535) {
+    fprintf(stderr, "%s: the screen must be from 64x64 to 65535x65535\n", programName);
+    return 1;
+  }
+  if (!imageFile) {
+    MakeDesktop();
+  }
+  fb = new uint32_t[(size_t)width * height];
+  memcpy(fb, base, (size_t)width * height * sizeof(uint32_t));
+
+  signal(SIGPIPE, SIG_IGN);
+
+  listenSock = ListenOnLoopback(port);
+  if (listenSock < 0) return 1;
+  fprintf(stderr, "%s: serving %dx%d on port %d\n", programName, width, height, port);
+
+  do {
+    int sock = accept(listenSock, NULL, NULL);
+    if (sock < 0) {
+      if (errno == EINTR) continue;
+      perror("accept");
+      return 1;
+    }
+    ServeClient(sock);
+    close(sock);
+  } while (!once);
+
+  return 0;
+}
+
+static void
+Usage(void)
+{
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  -port <PORT>         listen on 127.0.0.1:<PORT> (default 5900)\n"
+          "  -width <W>           width of the synthetic desktop (default 1024)\n"
+          "  -height <H>          height of the synthetic desktop (default 768)\n"
+          "  -image <PNG-FILE>    serve an image instead of the synthetic desktop\n"
+          "  -name <NAME>         desktop name\n"
+          "  -encoding raw|zrle   encoding to use (default: the client's preference)\n"
+          "  -pattern <PATTERN>   how the screen changes (default box):\n"
+          "                         none    never\n"
+          "                         box     a small box moves across the screen\n"
+          "                         scroll  the screen scrolls up\n"
+          "                         pan     the whole screen moves sideways\n"
+          "  -rate <N>            change the screen <N> times a second (default 10)\n"
+          "  -scroll <ROWS>       rows to scroll each time (default 16)\n"
+          "  -once                exit after the first client disconnects\n",
+          programName);
+  exit(1);
+}
+
+static int64_t
+Nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * MakeDesktop() draws a synthetic desktop: a gradient background with some
+ * windows full of text-like marks, which compresses much like a real one.
+ */
+
+static void
+MakeDesktop(void)
+{
+  uint32_t seed = 12345;
+
+  base = new uint32_t[(size_t)width * height];
+
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      uint32_t g = (uint32_t)(64 + 96 * y / height);
+      base[(size_t)y * width + x] = (g / 4) << 16 | (g / 2) << 8 | g;
+    }
+  }
+
+  for (int n = 0; n < 6; n++) {
+    int ww = width / 3 + n * width / 20;
+    int wh = height / 3 + n * height / 24;
+    int wx = (n * width / 7) % (width - ww);
+    int wy = (n * height / 9 + 8) % (height - wh);
+
+    for (int y = wy; y < wy + wh; y++) {
+      for (int x = wx; x < wx + ww; x++) {
+        uint32_t pixel;
+        if (y < wy + 20) {
+          pixel = 0x3050a0;                 /* title bar */
+        } else if (x == wx || x == wx + ww - 1 || y == wy + wh - 1) {
+          pixel = 0x404040;                 /* border */
+        } else {
+          pixel = 0xf8f8f8;
+        }
+        base[(size_t)y * width + x] = pixel;
+      }
+    }
+
+    /* Lines of "text": glyph-sized marks separated by spaces */
+    for (int ty = wy + 28; ty + 10 < wy + wh; ty += 14) {
+      for (int tx = wx + 6; tx + 6 < wx + ww - 6; tx += 7) {
+        seed = seed * 1103515245 + 12345;
+        if ((seed >> 16) % 6 == 0) continue;
+        uint32_t bits = seed;
+        for (int gy = 0; gy < 9; gy++) {
+          for (int gx = 0; gx < 5; gx++) {
+            if ((bits >> ((gy * 5 + gx) % 31)) & 1) {
+              base[(size_t)(ty + gy) * width + tx + gx] = 0x101010;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/*
+ * ReadImage() loads a PNG file as the desktop.
+ */
+
+static bool
+ReadImage(const char *filename)
+{
+  png_image image;
+  uint8_t *rgb;
+
+  memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_file(&image, filename)) {
+    fprintf(stderr, "%s: cannot read %s: %s\n", programName, filename, image.message);
+    return false;
+  }
+  if (image.width > 65535 || image.height > 65535) {
+    fprintf(stderr, "%s: %s is too large\n", programName, filename);
+    return false;
+  }
+  image.format = PNG_FORMAT_RGB;
+  rgb = new uint8_t[PNG_IMAGE_SIZE(image)];
+  if (!png_image_finish_read(&image, NULL, rgb, 0, NULL)) {
+    fprintf(stderr, "%s: cannot read %s: %s\n", programName, filename, image.message);
+    return false;
+  }
+
+  width = (int)image.width;
+  height = (int)image.height;
+  base = new uint32_t[(size_t)width * height];
+  for (size_t i = 0; i < (size_t)width * height; i++) {
+    base[i] = (uint32_t)rgb[i * 3] << 16 | (uint32_t)rgb[i * 3 + 1] << 8 | rgb[i * 3 + 2];
+  }
+  delete [] rgb;
+  return true;
+}
+
+static int
+ListenOnLoopback(int port)
+{
+  struct sockaddr_in addr;
+  int one = 1;
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (sock < 0) {
+    perror("socket");
+    return -1;
+  }
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 5) < 0) {
+    fprintf(stderr, "%s: cannot listen on port %d: %s\n", programName, port, strerror(errno));
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/*
+ * ServeClient() talks to one client until it disconnects, changing the
+ * screen 'rate' times a second meanwhile.
+ */
+
+static void
+ServeClient(int sock)
+{
+  Client c;
+  int one = 1;
+  int64_t period = rate > 0 ? 1000000000 / rate : 0;
+  int64_t nextTick = 0;
+  unsigned long tick = 0;
+
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+
+  c.is = new rdr::FdInStream(sock);
+  c.os = new rdr::FdOutStream(sock);
+  c.updateRequested = false;
+  c.incremental = false;
+  c.encoding = rfbEncodingRaw;
+  c.copyRect = false;
+  c.updates = c.rects = 0;
+  c.updateSent = 0;
+  c.totalTurnaround = c.maxTurnaround = 0;
+
+  /* A new client starts from the unchanged desktop */
+  memcpy(fb, base, (size_t)width * height * sizeof(uint32_t));
+  dirty = Rect();
+  scrolled = 0;
+
+  try {
+    Handshake(c);
+    nextTick = Nanos() + period;
+
+    while (true) {
+      int64_t now = Nanos();
+
+      if (period > 0 && now >= nextTick) {
+        Tick(++tick);
+        nextTick += period;
+        if (nextTick < now) nextTick = now + period;    /* fell behind */
+      }
+
+      if (c.updateRequested && UpdatePending(c)) {
+        SendUpdate(c);
+      }
+
+      if (c.is->bytesInBuf() == 0) {
+        fd_set rfds;
+        struct timeval tv, *timeout = NULL;
+        if (period > 0) {
+          int64_t wait = nextTick - Nanos();
+          if (wait < 0) wait = 0;
+          tv.tv_sec = (time_t)(wait / 1000000000);
+          tv.tv_usec = (suseconds_t)(wait % 1000000000 / 1000);
+          timeout = &tv;
+        }
+        FD_ZERO(&rfds);
+        FD_SET(sock, &rfds);
+        int n = select(sock + 1, &rfds, NULL, NULL, timeout);
+        if (n < 0 && errno != EINTR) throw rdr::SystemException("select", errno);
+        if (n <= 0) continue;
+      }
+      HandleClientMessage(c);
+    }
+  } catch (rdr::EndOfStream &) {
+    /* client went away */
+  } catch (rdr::Exception &e) {
+    fprintf(stderr, "%s: %s\n", programName, e.str());
+  }
+
+  fprintf(stderr, "%s: client done: %lu updates, %lu rects, %.2f MB sent",
+          programName, c.updates, c.rects, (double)c.os->length() / 1e6);
+  if (c.updates > 1) {
+    fprintf(stderr, "; next request after %.2f ms on average, %.2f ms at most",
+            (double)c.totalTurnaround / 1e6 / (double)(c.updates - 1),
+            (double)c.maxTurnaround / 1e6);
+  }
+  fprintf(stderr, "\n");
+
+  delete c.is;
+  delete c.os;
+}
+
+static void
+Handshake(Client &c)
+{
+  char version[sz_rfbProtocolVersionMsg + 1];
+  size_t nameLength = strlen(desktopName);
+
+  sprintf(version, rfbProtocolVersionFormat, rfbProtocolMajorVersion, rfbProtocolMinorVersion);
+  c.os->writeBytes(version, sz_rfbProtocolVersionMsg);
+  c.os->flush();
+  c.is->readBytes(version, sz_rfbProtocolVersionMsg);
+
+  c.os->writeU32(rfbNoAuth);
+  c.os->flush();
+  c.is->skip(sz_rfbClientInitMsg);  /* shared flag */
+
+  /* Until told otherwise, the client gets our own format */
+  memset(&c.format, 0, sizeof(c.format));
+  c.format.bitsPerPixel = 32;
+  c.format.depth = 24;
+  c.format.bigEndian = 0;
+  c.format.trueColour = 1;
+  c.format.redMax = c.format.greenMax = c.format.blueMax = 255;
+  c.format.redShift = 16;
+  c.format.greenShift = 8;
+  c.format.blueShift = 0;
+
+  c.os->writeU16((uint16_t)width);
+  c.os->writeU16((uint16_t)height);
+  c.os->writeU8(c.format.bitsPerPixel);
+  c.os->writeU8(c.format.depth);
+  c.os->writeU8(c.format.bigEndian);
+  c.os->writeU8(c.format.trueColour);
+  c.os->writeU16(c.format.redMax);
+  c.os->writeU16(c.format.greenMax);
+  c.os->writeU16(c.format.blueMax);
+  c.os->writeU8(c.format.redShift);
+  c.os->writeU8(c.format.greenShift);
+  c.os->writeU8(c.format.blueShift);
+  c.os->pad(3);
+  c.os->writeU32((uint32_t)nameLength);
+  c.os->writeBytes(desktopName, nameLength);
+  c.os->flush();
+}
+
+static void
+HandleClientMessage(Client &c)
+{
+  uint8_t type = c.is->readU8();
+
+  switch (type) {
+
+  case rfbSetPixelFormat:
+    c.is->skip(3);
+    c.format.bitsPerPixel = c.is->readU8();
+    c.format.depth = c.is->readU8();
+    c.format.bigEndian = c.is->readU8();
+    c.format.trueColour = c.is->readU8();
+    c.format.redMax = c.is->readU16();
+    c.format.greenMax = c.is->readU16();
+    c.format.blueMax = c.is->readU16();
+    c.format.redShift = c.is->readU8();
+    c.format.greenShift = c.is->readU8();
+    c.format.blueShift = c.is->readU8();
+    c.is->skip(3);
+    if (c.format.bitsPerPixel != 32 || !c.format.trueColour) {
+      throw rdr::Exception("only 32-bit true colour pixel formats are supported");
+    }
+    break;
+
+  case rfbSetEncodings:
+  {
+    c.is->skip(1);
+    int n = c.is->readU16();
+    bool chosen = false;
+    c.copyRect = false;
+    for (int i = 0; i < n; i++) {
+      int32_t encoding = c.is->readS32();
+      if (encoding == rfbEncodingCopyRect) {
+        c.copyRect = true;
+      } else if (!chosen && encodingName == NULL &&
+                 (encoding == rfbEncodingRaw || encoding == rfbEncodingZRLE)) {
+        c.encoding = encoding;
+        chosen = true;
+      }
+    }
+    if (encodingName != NULL) {
+      c.encoding = strcmp(encodingName, "zrle") == 0 ? rfbEncodingZRLE : rfbEncodingRaw;
+    }
+    break;
+  }
+
+  case rfbFramebufferUpdateRequest:
+  {
+    int64_t now = Nanos();
+    if (c.updateSent != 0) {
+      int64_t turnaround = now - c.updateSent;
+      c.totalTurnaround += turnaround;
+      if (turnaround > c.maxTurnaround) c.maxTurnaround = turnaround;
+      c.updateSent = 0;
+    }
+    c.incremental = c.is->readU8() != 0;
+    c.requested.x = c.is->readU16();
+    c.requested.y = c.is->readU16();
+    c.requested.w = c.is->readU16();
+    c.requested.h = c.is->readU16();
+    c.requested = IntersectRect(c.requested, Rect(0, 0, width, height));
+    c.updateRequested = true;
+    break;
+  }
+
+  case rfbKeyEvent:
+    c.is->skip(7);
+    break;
+
+  case rfbPointerEvent:
+    c.is->skip(5);
+    break;
+
+  case rfbClientCutText:
+    c.is->skip(3);
+    c.is->skip(c.is->readU32());
+    break;
+
+  default:
+    throw rdr::Exception("unknown message type from client");
+  }
+}
+
+/*
+ * Tick() changes the screen following the chosen pattern, and notes what
+ * it changed.
+ */
+
+static void
+Tick(unsigned long tick)
+{
+  switch (pattern) {
+
+  case PATTERN_NONE:
+    break;
+
+  case PATTERN_BOX:
+  {
+    /* A 64x64 box bouncing around, drawn over the desktop */
+    const int size = 64;
+    int rangeX = width - size, rangeY = height - size;
+    /* On a screen no larger than the box, it stays put along that axis */
+    int posX = rangeX > 0 ? (int)(tick * 7 % (unsigned long)(2 * rangeX)) : 0;
+    int posY = rangeY > 0 ? (int)(tick * 5 % (unsigned long)(2 * rangeY)) : 0;
+    static Rect box;
+
+    if (posX > rangeX) posX = 2 * rangeX - posX;
+    if (posY > rangeY) posY = 2 * rangeY - posY;
+
+    for (int y = box.y; y < box.y + box.h; y++) {
+      memcpy(&fb[(size_t)y * width + box.x], &base[(size_t)y * width + box.x],
+             (size_t)box.w * sizeof(uint32_t));
+    }
+    dirty = UnionRect(dirty, box);
+
+    box = Rect(posX, posY, size, size);
+    for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+        uint32_t shade = (uint32_t)((x + y + (int)tick) & 0xff);
+        fb[(size_t)(posY + y) * width + posX + x] = shade << 16 | (255 - shade) << 8 | 0x80;
+      }
+    }
+    dirty = UnionRect(dirty, box);
+    break;
+  }
+
+  case PATTERN_SCROLL:
+  {
+    /* Move everything up, and bring in rows of the desktop from below, so
+       that the screen is always the desktop rotated upwards */
+    int step = scrollStep < height ? scrollStep : height;
+    memmove(fb, fb + (size_t)step * width, (size_t)(height - step) * width * sizeof(uint32_t));
+    for (int y = height - step; y < height; y++) {
+      int from = (int)(((unsigned long)y + tick * (unsigned long)step) % (unsigned long)height);
+      memcpy(&fb[(size_t)y * width], &base[(size_t)from * width], (size_t)width * sizeof(uint32_t));
+    }
+    if (dirty.empty() && scrolled + step < height) {
+      scrolled += step;
+    } else {
+      dirty = Rect(0, 0, width, height);
+      scrolled = 0;
+    }
+    break;
+  }
+
+  case PATTERN_PAN:
+  {
+    /* Every pixel changes: the desktop slides sideways */
+    int shift = (int)(tick * 8 % (unsigned long)width);
+    for (int y = 0; y < height; y++) {
+      uint32_t *row = &fb[(size_t)y * width];
+      const uint32_t *from = &base[(size_t)y * width];
+      memcpy(row, from + shift, (size_t)(width - shift) * sizeof(uint32_t));
+      memcpy(row + width - shift, from, (size_t)shift * sizeof(uint32_t));
+    }
+    dirty = Rect(0, 0, width, height);
+    break;
+  }
+  }
+}
+
+static bool
+UpdatePending(Client &c)
+{
+  if (!c.incremental) return true;
+  return scrolled > 0 || !IntersectRect(dirty, c.requested).empty();
+}
+
+/*
+ * SendUpdate() answers the client's update request: everything it asked
+ * for if the request was not incremental, otherwise what has changed.
+ */
+
+static void
+SendUpdate(Client &c)
+{
+  Rect changed = c.incremental ? IntersectRect(dirty, c.requested) : c.requested;
+  bool full = c.requested.x == 0 && c.requested.y == 0 &&
+              c.requested.w == width && c.requested.h == height;
+  bool copy = c.incremental && scrolled > 0 && c.copyRect && full;
+  int nRects = 0;
+
+  if (c.incremental && scrolled > 0 && !copy) {
+    /* The client can't be told about the scroll, so send it all */
+    changed = c.requested;
+  }
+  if (copy) nRects += 2;
+  if (!changed.empty()) nRects++;
+
+  c.os->writeU8(rfbFramebufferUpdate);
+  c.os->pad(1);
+  c.os->writeU16((uint16_t)nRects);
+
+  if (copy) {
+    c.os->writeU16(0);
+    c.os->writeU16(0);
+    c.os->writeU16((uint16_t)width);
+    c.os->writeU16((uint16_t)(height - scrolled));
+    c.os->writeU32(rfbEncodingCopyRect);
+    c.os->writeU16(0);                      /* source */
+    c.os->writeU16((uint16_t)scrolled);
+    SendRect(c, Rect(0, height - scrolled, width, scrolled));
+    c.rects += 2;
+  }
+  if (!changed.empty()) {
+    SendRect(c, changed);
+    c.rects++;
+  }
+  c.os->flush();
+
+  dirty = Rect();
+  scrolled = 0;
+  c.updateRequested = false;
+  c.updates++;
+  c.updateSent = Nanos();
+}
+
+static void
+SendRect(Client &c, const Rect &r)
+{
+  c.os->writeU16((uint16_t)r.x);
+  c.os->writeU16((uint16_t)r.y);
+  c.os->writeU16((uint16_t)r.w);
+  c.os->writeU16((uint16_t)r.h);
+  c.os->writeU32((uint32_t)c.encoding);
+
+  if (c.encoding == rfbEncodingRaw) {
+    uint32_t *row = new uint32_t[r.w];
+    for (int y = r.y; y < r.y + r.h; y++) {
+      GetImage(c, r.x, y, r.w, 1, row);
+      c.os->writeBytes(row, (size_t)r.w * 4);
+    }
+    delete [] row;
+    return;
+  }
+
+  /* ZRLE, using 3-byte pixels when the colours fit in 3 bytes, as the
+     decoder in zrle.cxx expects */
+  const rfbPixelFormat &f = c.format;
+  bool fitsInLS3Bytes = ((f.redMax   << f.redShift)   < (1<<24) &&
+                         (f.greenMax << f.greenShift) < (1<<24) &&
+                         (f.blueMax  << f.blueShift)  < (1<<24));
+  bool fitsInMS3Bytes = (f.redShift > 7 && f.greenShift > 7 && f.blueShift > 7);
+
+  c.mos.clear();
+  if ((fitsInLS3Bytes && !f.bigEndian) || (fitsInMS3Bytes && f.bigEndian)) {
+    zrleEncode24A(r.x, r.y, r.w, r.h, &c.mos, &c.zos, tileBuffer, c);
+  } else if ((fitsInLS3Bytes && f.bigEndian) || (fitsInMS3Bytes && !f.bigEndian)) {
+    zrleEncode24B(r.x, r.y, r.w, r.h, &c.mos, &c.zos, tileBuffer, c);
+  } else {
+    zrleEncode32(r.x, r.y, r.w, r.h, &c.mos, &c.zos, tileBuffer, c);
+  }
+  c.os->writeU32((uint32_t)c.mos.length());
+  c.os->writeBytes(c.mos.data(), c.mos.length());
+}
+
+/*
+ * ClientPixel() converts one of our pixels to the client's format, in the
+ * client's byte order.
+ */
+
+static uint32_t
+ClientPixel(const rfbPixelFormat &f, uint32_t pixel)
+{
+  uint32_t r = (pixel >> 16) & 0xff, g = (pixel >> 8) & 0xff, b = pixel & 0xff;
+  uint32_t p = ((r * f.redMax + 127) / 255) << f.redShift |
+               ((g * f.greenMax + 127) / 255) << f.greenShift |
+               ((b * f.blueMax + 127) / 255) << f.blueShift;
+  uint32_t out;
+  uint8_t *outBytes = (uint8_t *)&out;
+
+  for (int i = 0; i < 4; i++) {
+    int shift = f.bigEndian ? 24 - 8 * i : 8 * i;
+    outBytes[i] = (uint8_t)(p >> shift);
+  }
+  return out;
+}
+
+static void
+GetImage(Client &c, int x, int y, int w, int h, uint32_t *buf)
+{
+  for (int row = y; row < y + h; row++) {
+    const uint32_t *from = &fb[(size_t)row * width + x];
+    for (int i = 0; i < w; i++) {
+      *buf++ = ClientPixel(c.format, from[i]);
+    }
+  }
+}
+
+static Rect
+UnionRect(const Rect &a, const Rect &b)
+{
+  if (a.empty()) return b;
+  if (b.empty()) return a;
+  int x1 = a.x < b.x ? a.x : b.x;
+  int y1 = a.y < b.y ? a.y : b.y;
+  int x2 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+  int y2 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+  return Rect(x1, y1, x2 - x1, y2 - y1);
+}
+
+static Rect
+IntersectRect(const Rect &a, const Rect &b)
+{
+  int x1 = a.x > b.x ? a.x : b.x;
+  int y1 = a.y > b.y ? a.y : b.y;
+  int x2 = a.x + a.w < b.x + b.w ? a.x + a.w : b.x + b.w;
+  int y2 = a.y + a.h < b.y + b.h ? a.y + a.h : b.y + b.h;
+  if (x2 <= x1 || y2 <= y1) return Rect();
+  return Rect(x1, y1, x2 - x1, y2 - y1);
+}
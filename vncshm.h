@@ -0,0 +1,73 @@
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+/*
+ * vncshm.h - layout of the shared memory written by vncsnapshot -shm, for
+ * programs reading the screen from it.
+ *
+ * The object starts with a VncShmHeader and holds two frames, each a copy
+ * of the whole screen. Frame number g (counting from 1) is published in
+ * slot g % 2, so the other slot, holding the frame before it, stays intact
+ * while the next one is written. To read the latest frame without locking:
+ *
+ *   1. g = header->generation, with acquire ordering; 0 means none yet.
+ *   2. slot = &header->slots[g % 2]; s = slot->sequence, with acquire
+ *      ordering. If s is odd or slot->generation != g, the slot is being
+ *      rewritten: start again.
+ *   3. Read the pixels at (uint8_t *) header + slot->offset, in place.
+ *   4. After an acquire fence, if slot->sequence != s, what was read may
+ *      be torn: start again.
+ *
+ * A reader has the slot to itself for at least one whole interval between
+ * snapshots, since it is only rewritten after the next frame is published.
+ * The rectangles of a frame are those that changed since the frame before
+ * it; a reader that missed a frame should treat the whole screen as
+ * changed.
+ */
+
+#ifndef VNCSHM_H
+#define VNCSHM_H
+
+#include <stdint.h>
+
+#define VNCSHM_MAGIC    0x4d485356  /* "VSHM" in little-endian order */
+#define VNCSHM_VERSION  1
+#define VNCSHM_MAX_RECTS 256        /* more changes are sent as the whole screen */
+
+typedef struct {
+    uint16_t x, y, w, h;
+} VncShmRect;
+
+typedef struct {
+    uint32_t sequence;      /* odd while the slot is being written */
+    uint32_t numRects;      /* rectangles changed since the frame before */
+    uint64_t generation;    /* frame number held */
+    uint64_t offset;        /* of the pixels, from the start of the object */
+    VncShmRect rects[VNCSHM_MAX_RECTS];
+} VncShmSlot;
+
+typedef struct {
+    uint32_t magic;         /* VNCSHM_MAGIC */
+    uint32_t version;       /* VNCSHM_VERSION */
+    uint32_t width, height; /* of the screen */
+    uint32_t bytesPerPixel; /* 3 for R,G,B, or 4 for R,G,B and a byte unused */
+    uint32_t stride;        /* bytes from one row to the next */
+    uint64_t generation;    /* latest frame published */
+    VncShmSlot slots[2];
+} VncShmHeader;
+
+#endif
@@ -21,6 +21,11 @@
  * vncsnapshot.c - the VNC snapshot.
  */
 
+#ifndef WIN32
+#define _XOPEN_SOURCE 600   /* for clock_nanosleep() */
+#endif
+
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -32,236 +37,376 @@
 char *programName;
 
 #ifdef WIN32
-/* On Win32, sleep() doesn't exist, but Sleep() does, and 
- * takes an argument of milliseconds.
+/* On Win32, there is no monotonic clock_gettime(), but GetTickCount()
+ * is monotonic and Sleep() takes an argument of milliseconds.
  */
 #include <windows.h>    /* for Sleep() */
-static void sleep(int seconds)
+static int64_t MonotonicMillis(void)
 {
-    Sleep(seconds * 1000);
+    return (int64_t) GetTickCount();
 }
-#endif
 
-int
-main(int argc, char **argv)
+static void SleepUntil(int64_t deadline)
 {
-  int i = 0;
-  int count = 1;    /* for multiple snapshots,snapshot number */
-  char *filename;   /* output filename; for multiple snapshots, constructed */
-  char *cp;         /* work variable */
-  char *suffix = NULL; /* suffix to follow snapshot number, including . */
-  char *append = NULL; /* point in *filename to put count and suffix */
-  time_t last_time = 0; /* value of time() at last snapshot */
-
-  programName = argv[0];
+    int64_t now = MonotonicMillis();
+    if (deadline > now) {
+        Sleep((DWORD) (deadline - now));
+    }
+}
+#else
+/*
+ * MonotonicMillis() returns a millisecond timestamp that is not affected by
+ * changes to the wall clock; only differences between two values are
+ * meaningful.
+ */
+static int64_t MonotonicMillis(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-  if (!InitializeSockets()) {
-      return 1;
-  }
+/*
+ * SleepUntil() sleeps until the monotonic clock reaches the given
+ * MonotonicMillis() value. Sleeping to an absolute deadline, rather than
+ * for an interval, means time spent grabbing and saving a snapshot does
+ * not accumulate as drift.
+ */
+static void SleepUntil(int64_t deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) (deadline / 1000);
+    ts.tv_nsec = (long) (deadline % 1000) * 1000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+#endif
 
-  /* The -listen option is used to make us a daemon process which listens for
-     incoming connections from servers, rather than actively connecting to a
-     given server. The -tunnel and -via options are useful to create
-     connections tunneled via SSH port forwarding. We must test for the
-     -listen option before invoking any Xt functions - this is because we use
-     forking, and Xt doesn't seem to cope with forking very well. For -listen
-     option, when a successful incoming connection has been accepted,
-     listenForIncomingConnections() returns, setting the listenSpecified
-     flag. */
+/*
+ * SetCaptureRectangle() works out which rectangle of a session's screen
+ * is captured from the one requested with -rect, which applies to every
+ * snapshot. Negative X/Y implies from the opposite edge, and a width or
+ * height of 0 means to the edge.
+ */
+static void SetCaptureRectangle(Session *s)
+{
+  int32_t x = appData.rectX, y = appData.rectY;
+  int32_t width = (int32_t)appData.rectWidth, height = (int32_t)appData.rectHeight;
+  int32_t screenWidth = s->si.framebufferWidth, screenHeight = s->si.framebufferHeight;
 
-  for (i = 1; i < argc; i++) {
-    if (strcmp(argv[i], "-listen") == 0) {
-      listenForIncomingConnections(&argc, argv, i);
-      break;
-    }
-    if (strcmp(argv[i], "-tunnel") == 0 || strcmp(argv[i], "-via") == 0) {
-      if (!createTunnel(&argc, argv, i))
-        exit(1);
-      break;
-    }
+  if (x < 0) {
+    x = screenWidth + x;
+  } else if (appData.rectXNegative) {
+    x = screenWidth - x - width;
+  }
+  if (y < 0) {
+    y = screenHeight + y;
+  } else if (appData.rectYNegative) {
+    y = screenHeight - y - height;
+  }
+  if (x >= screenWidth || x < 0) {
+    fprintf(stderr, "%s: Requested rectangle x <%" PRId32 "> is outside screen width <%" PRId32 ">, using 0\n",
+            programName, x, screenWidth);
+    x = 0;
+  }
+  if (y >= screenHeight || y < 0) {
+    fprintf(stderr, "%s: Requested rectangle y <%" PRId32 "> is outside screen height <%" PRId32 ">, using 0\n",
+            programName, y, screenHeight);
+    y = 0;
   }
 
-  /* Interpret resource specs and process any remaining command-line arguments
-     (i.e. the VNC server name).  If the server name isn't specified on the
-     command line, getArgsAndResources() will complain and exit. */
+  if (width == 0) {
+    width = screenWidth - x;
+  }
+  if (height == 0) {
+    height = screenHeight - y;
+  }
+  if (width <= 0 || width > screenWidth - x) {
+    fprintf(stderr, "%s: Requested rectangle width <%" PRId32 "> plus offset <%" PRId32 "> is wider than screen width <%" PRId32 ">, using %" PRId32 "\n",
+            programName, width, x, screenWidth, screenWidth - x);
+    width = screenWidth - x;
+  }
+  if (height <= 0 || height > screenHeight - y) {
+    fprintf(stderr, "%s: Requested rectangle height <%" PRId32 "> plus offset <%" PRId32 "> is wider than screen height <%" PRId32 ">, using %" PRId32 "\n",
+            programName, height, y, screenHeight, screenHeight - y);
+    height = screenHeight - y;
+  }
 
-  GetArgsAndResources(argc, argv);
+  s->rectX = (uint32_t)x;
+  s->rectY = (uint32_t)y;
+  s->rectWidth = (uint32_t)width;
+  s->rectHeight = (uint32_t)height;
+}
 
-  /* Unless we accepted an incoming connection, make a TCP connection to the
-     given VNC server */
+/*
+ * OutputFormat() returns the FORMAT_* to write filename in, picked by its
+ * extension; PNG if none we know.
+ */
+static int OutputFormat(const char *filename)
+{
+  int format = filename != NULL ? FormatForFilename(filename) : -1;
 
-  if (!listenSpecified) {
-    if (!ConnectToRFBServer(vncServerHost, vncServerPort)) exit(1);
-  }
+  return format < 0 ? FORMAT_PNG : format;
+}
 
-  /* Initialise the VNC connection, including reading the password */
+/*
+ * CaptureScreen() takes the snapshots asked for from a session that has
+ * been connected and initialised, saving them to outputFilename, if not
+ * NULL, and frees the session. It returns the program's exit status: 0 if
+ * all went well. Any number of sessions may be captured at once, each by a
+ * thread of its own.
+ */
+int CaptureScreen(Session *s, const char *outputFilename)
+{
+  int count = 1;    /* for multiple snapshots,snapshot number */
+  char *filename;   /* output filename; for multiple snapshots, constructed */
+  char *allocated = NULL; /* filename, if constructed */
+  const char *cp;   /* work variable */
+  const char *suffix = NULL; /* suffix to follow snapshot number, including . */
+  char *append = NULL; /* point in *filename to put count and suffix */
+  int64_t period;   /* milliseconds between snapshots */
+  int64_t start;    /* MonotonicMillis() when the first snapshot was requested */
+  int64_t tick = 0; /* number of periods from start to current snapshot */
+  int status = 0;
 
-  if (!InitialiseRFBConnection()) exit(1);
+  s->outputFormat = OutputFormat(outputFilename);
 
-  if (!AllocateBuffer()) exit(1);
+  if (!AllocateBuffer(s)) {
+    FreeSession(s);
+    return 1;
+  }
 
   /* Tell the VNC server which pixel format and encodings we want to use */
 
-  SendSetPixelFormat();
-  SendSetEncodings();
+  SendSetPixelFormat(s);
+  SendSetEncodings(s);
 
 
-  /* Set up for mutiple images, if required */
-  if (appData.count > 1) {
-      last_time = time(NULL);
+  /* Set up for mutiple images, if required; -count 0 means no limit */
+  if (appData.count != 1) {
       count = 0;
+  }
+  if (appData.count != 1 && outputFilename != NULL) {
       /* Maximum length of a 32-bit integer is 10 digits plus sign */
-      filename = (char *) malloc(strlen(appData.outputFilename) + 11 + 1);
+      filename = allocated = (char *) malloc(strlen(outputFilename) + 11 + 1);
+      if (filename == NULL) {
+          fprintf(stderr, "Failed to allocate memory for file name\n");
+          FreeSession(s);
+          return 1;
+      }
       /* Determine where to insert number. If the supplied filename
-       * ends in .jpg, or .jpeg (case insensitive), then it goes
-       * before that. If not, it goes at the end, with .jpg appended.
+       * ends in the extension of an output format (case insensitive),
+       * then it goes before that. If not, it goes at the end, with .png
+       * appended.
        */
-      cp = strrchr(appData.outputFilename, '.');
-      /* if (cp != NULL) {
-          char *jpg = "jpg";
-          char *jpeg = "jpeg";
-          int is_jpg = 1;
-          i = 0;
-          while (cp[i+1]) {
-              if (tolower(cp[i+1]) != jpg[i]) {
-                  is_jpg = 0;
-                  break;
-              }
-              i++;
-          }
-          if (!is_jpg) {
-              i = 0;
-              while (cp[i+1]) {
-                  if (tolower(cp[i+1]) != jpeg[i]) {
-                      cp = NULL;
-                      break;
-                  }
-                  i++;
-              }
-          }
-      } */
-      if (cp != NULL) {
-          char *png = "png";
-          i = 0;
-          while (cp[i+1]) {
-              if (tolower(cp[i+1]) != png[i]) {
-                                  cp = NULL;
-                  break;
-              }
-              i++;
-          }
+      cp = strrchr(outputFilename, '.');
+      if (FormatForFilename(outputFilename) < 0) {
+          cp = NULL;
       }
       if (cp != NULL) {
-          strncpy(filename, appData.outputFilename, (size_t)(cp - appData.outputFilename));
-          append = filename + (cp - appData.outputFilename);
+          strncpy(filename, outputFilename, (size_t)(cp - outputFilename));
+          append = filename + (cp - outputFilename);
           suffix = cp;
       } else {
-          strcpy(filename, appData.outputFilename);
+          strcpy(filename, outputFilename);
           suffix = ".png";
           append = filename + strlen(filename);
       }
   } else {
       /* Not doing repetitive snapshots. */
-      filename = appData.outputFilename;
+      filename = (char *) outputFilename;
+  }
+
+  SetCaptureRectangle(s);
+
+  if ((outputFilename != NULL && !StartOutput(s)) ||
+      (appData.shmName != NULL && !StartSharedScreen(s, appData.shmName))) {
+    free(allocated);
+    FreeSession(s);
+    return 1;
+  }
+
+  /* Snapshots are taken every 'period' milliseconds, measured from the
+   * first request; -interval overrides the coarser -fps. A replayed
+   * session already holds every update, so there is nothing to wait for.
+   */
+  period = appData.interval > 0 ? (int64_t) appData.interval : (int64_t) appData.fps * 1000;
+  if (appData.replayFile) {
+      period = 0;
+  }
+  start = MonotonicMillis();
+
+  if (!SendFramebufferUpdateRequest(s, (uint16_t)s->rectX, (uint16_t)s->rectY,
+                                    (uint16_t)s->rectWidth, (uint16_t)s->rectHeight, false)) {
+    free(allocated);
+    FreeSession(s);
+    return 1;
   }
+
   /* Grab image; delay and repeat if requested */
   do {
-    if(appData.count > 1) {
-      sprintf(append, "%05d%s", count, suffix);
+    if (appData.count != 1) {
+      if (append != NULL) {
+        sprintf(append, "%05d%s", count, suffix);
+      }
       count++;
     }
 
+    /* The first snapshot is encoded as it arrives, if it can be. */
+    bool streamed = tick == 0 && filename != NULL &&
+        StartStreamedSnapshot(s, filename, s->rectX, s->rectY, s->rectWidth, s->rectHeight);
+
     /* Now enter the main loop, processing VNC messages. */
 
-    /*
-     * Negative X/Y implies from opposite edge.
-     */
-    if (appData.rectX < 0) {
-      appData.rectX = si.framebufferWidth + appData.rectX;
-    } else if (appData.rectXNegative) {
-      appData.rectX = si.framebufferWidth - appData.rectX - (int32_t)appData.rectWidth;
-    }
-    if (appData.rectY < 0) {
-      appData.rectY = si.framebufferHeight + appData.rectY;
-    } else if (appData.rectYNegative) {
-      appData.rectY = si.framebufferHeight - appData.rectY - (int32_t)appData.rectHeight;
-    }
-    if (appData.rectX >= si.framebufferWidth || appData.rectX < 0) {
-      fprintf(stderr, "%s: Requested rectangle x <%" PRId32 "> is outside screen width <%" PRId16 ">, using 0\n",
-              programName, appData.rectX, si.framebufferWidth);
-      appData.rectX = 0;
-    }
-    if (appData.rectY >= si.framebufferHeight || appData.rectY < 0) {
-      fprintf(stderr, "%s: Requested rectangle y <%" PRId32 "> is outside screen height <%" PRId16 ">, using 0\n",
-              programName, appData.rectY, si.framebufferHeight);
-      appData.rectY = 0;
+    while (1) {
+      if (!HandleRFBServerMessage(s))
+        break;
     }
 
-    /*
-     * Width/height of 0 means to edge.
+    int64_t late = MonotonicMillis() - (start + tick * period);
+
+    /* The snapshot is copied out of the frame buffer and written in the
+     * background, so the frame buffer can take further updates at once.
      */
-    if (appData.rectWidth == 0) {
-      appData.rectWidth = si.framebufferWidth - (uint32_t)appData.rectX;
-    }
-    if (appData.rectHeight == 0) {
-      appData.rectHeight = si.framebufferHeight - (uint32_t)appData.rectY;
+    if (streamed && FinishStreamedSnapshot(s)) {
+      SnapshotStreamed(s, filename, s->rectX, s->rectY, s->rectWidth, s->rectHeight);
+    } else if (filename != NULL) {
+      QueueSnapshot(s, filename, s->rectX, s->rectY, s->rectWidth, s->rectHeight);
     }
-    if (appData.rectWidth <= 0 || (int32_t)appData.rectWidth > (int32_t)si.framebufferWidth - appData.rectX) {
-      fprintf(stderr, "%s: Requested rectangle width <%" PRId32 "> plus offset <%" PRId32 "> is wider than screen width <%" PRId16 ">, using %" PRId32 "\n",
-              programName, appData.rectWidth, appData.rectX, si.framebufferWidth, (int32_t)(si.framebufferWidth - appData.rectX));
-      appData.rectWidth = si.framebufferWidth - (uint32_t)appData.rectX;
+    if (appData.shmName != NULL) {
+      PublishSharedScreen(s);
     }
-    if (appData.rectHeight <= 0 || (int32_t)appData.rectHeight > (int32_t)si.framebufferHeight - appData.rectY) {
-      fprintf(stderr, "%s: Requested rectangle height <%" PRId32 "> plus offset <%" PRId32 "> is wider than screen height <%" PRId16 ">, using %" PRId32 "\n",
-              programName, appData.rectHeight, appData.rectY, si.framebufferHeight, si.framebufferHeight - appData.rectY);
-      appData.rectHeight = si.framebufferHeight - (uint32_t)appData.rectY;
-    }
-    if (!SendFramebufferUpdateRequest((uint16_t)appData.rectX, (uint16_t)appData.rectY, (uint16_t)appData.rectWidth,
-                                      (uint16_t)appData.rectHeight, false)) {
-      exit(1);
-    }
-
-    while (1) {
-      if (!HandleRFBServerMessage())
-        break;
-    }
-
-    /* shrink buffer to requested rectangle */
-    ShrinkBuffer((uint32_t)appData.rectX, (uint32_t)appData.rectY, appData.rectWidth, appData.rectHeight);
-    write_PNG(filename, 0 /* don't interlace */, appData.rectWidth, appData.rectHeight);
+    ClearScreenDamage(s);    /* count changes from this snapshot on */
     if (!appData.quiet) {
-      fprintf(stderr, "Image saved from %s %" PRId16 "x%" PRId16 " screen to ", vncServerName ? vncServerName : "(local host)",
-              si.framebufferWidth, si.framebufferHeight);
-      if (strcmp(filename, "-") == 0) {
-        fprintf(stderr, "- (stdout)");
-      } else {
-        fprintf(stderr, "%s", filename);
-      }
-      fprintf(stderr, " using %" PRId32 "x%" PRId32 "+%" PRId32 "+%" PRId32 " rectangle\n", appData.rectWidth, appData.rectHeight,
-              appData.rectX, appData.rectY);
-      if (appData.useRemoteCursor != -1 && !appData.gotCursorPos) {
+      if (appData.useRemoteCursor != -1 && !s->gotCursorPos) {
         if (appData.useRemoteCursor) {
           fprintf(stderr, "Warning: -cursor not supported by server, cursor may not be included in image.\n");
         } else {
           fprintf(stderr, "Warning: -nocursor not supported by server, cursor may be included in image.\n");
         }
       }
+      if (appData.count != 1 && period > 0) {
+        fprintf(stderr, "Snapshot %d received %" PRId64 " ms after its scheduled time\n",
+                count, late);
+      }
     }
 
-    if (count < appData.count) {
-        /* Sleep until next snapshot time rolls around. Note
-         * that the period to wait will include the time taken
-         * to grab the snapshot.
+    if (appData.count == 0 || count < appData.count) {
+        /* Sleep until the next snapshot time rolls around. Times are
+         * fixed multiples of the period from the first snapshot, so the
+         * time taken to grab and save a snapshot does not cause drift.
+         * If that took longer than a period, the missed snapshot times
+         * are skipped rather than taken back-to-back to catch up.
          */
-        time_t now = time(NULL);
-        if (now < last_time + appData.fps) {
-            sleep((unsigned int)(last_time + appData.fps - now));
+        int64_t now = MonotonicMillis();
+        tick++;
+        if (period > 0 && now > start + tick * period) {
+            int64_t missed = (now - (start + tick * period)) / period;
+            if (missed > 0) {
+                if (!appData.quiet) {
+                    fprintf(stderr, "Skipped %" PRId64 " missed snapshot time(s)\n", missed);
+                }
+                tick += missed;
+            }
         }
-        last_time = now;
-        /* Request update - incremental is fine here. */
-        SendIncrementalFramebufferUpdateRequest();
+        SleepUntil(start + tick * period);
+
+        /* Request update - incremental is fine here, since the
+         * connection and framebuffer persist between snapshots. It is
+         * received while the previous snapshot is still being written.
+         */
+        if (!RequestNewUpdate(s)) {
+            status = 1;
+            break;
+        }
+    }
+  } while (appData.count == 0 || count < appData.count);
+
+  FinishOutput(s);
+  FreeSession(s);
+  free(allocated);
+
+  return status;
+}
+
+int
+main(int argc, char **argv)
+{
+  int i = 0;
+  Session *s;       /* the connection to the server and its frame buffer */
+
+  programName = argv[0];
+
+  if (!InitializeSockets()) {
+      return 1;
+  }
+
+  /* The -listen option is used to make us a daemon process which listens for
+     incoming connections from servers, rather than actively connecting to a
+     given server. The -tunnel and -via options are useful to create
+     connections tunneled via SSH port forwarding. We must test for the
+     -listen option before invoking any Xt functions - this is because we use
+     forking, and Xt doesn't seem to cope with forking very well. For -listen
+     option, when a successful incoming connection has been accepted,
+     listenForIncomingConnections() returns, setting the listenSpecified
+     flag. */
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-listen") == 0) {
+      listenForIncomingConnections(&argc, argv, i);
+      break;
+    }
+    if (strcmp(argv[i], "-tunnel") == 0 || strcmp(argv[i], "-via") == 0) {
+      if (!createTunnel(&argc, argv, i))
+        exit(1);
+      break;
     }
-  } while (count < appData.count);
+  }
+
+  /* Interpret resource specs and process any remaining command-line arguments
+     (i.e. the VNC server name).  If the server name isn't specified on the
+     command line, getArgsAndResources() will complain and exit. */
+
+  GetArgsAndResources(argc, argv);
+
+  /* Pick the pixel conversions once, before any session uses them */
+  InitPixelKernels();
+
+  /* With -hosts, each server listed is captured by a thread of its own */
+  if (appData.hostsFile != NULL) {
+    return RunHostList();
+  }
+
+  s = NewSession();
+  if (s == NULL) exit(1);
+  s->serverName = vncServerName;
+
+  /* Unless we accepted an incoming connection, make a TCP connection to the
+     given VNC server */
+
+  if (appData.replayFile) {
+    /* Read everything from a recorded session instead */
+    if (!OpenReplay(s, appData.replayFile)) exit(1);
+  } else {
+    if (listenSpecified) {
+      if (!SetRFBSock(s, acceptedSock)) exit(1);
+    } else {
+      if (!ConnectToRFBServer(s, vncServerHost, vncServerPort)) exit(1);
+    }
+
+    /* Initialise the VNC connection, including reading the password */
+
+    if (!InitialiseRFBConnection(s)) exit(1);
+  }
+
+  if (appData.bench) {
+    int status;
+
+    s->outputFormat = OutputFormat(appData.outputFilename);
+    status = AllocateBuffer(s) ? RunBenchmark(s) : 1;
+    FreeSession(s);
+    return status;
+  }
 
-  return 0;
+  return CaptureScreen(s, appData.outputFilename);
 }
@@ -41,6 +41,8 @@
 #define TUNNEL_PORT_OFFSET 5500
 #define SERVER_PORT_OFFSET 5900
 
+#define MAX_SERVER_HOST 256     /* characters in a host name, with the NUL */
+
 #ifdef WIN32
 /* This is for the NetworkSimplicty installation of SSH */
 #define DEFAULT_SSH_CMD "C:\\Program Files\\NetworkSimplicity\\ssh.exe"
@@ -81,11 +83,62 @@ typedef struct {
   uint32_t rectHeight;
   int32_t rectX;
   int32_t rectY;
-  char gotCursorPos;
   int fps;
+  int interval; /* milliseconds between snapshots; overrides fps if set */
   int count;    /* number of snapshots to grab */
+  int queueLength;      /* snapshots that may wait to be written */
+  int writerThreads;    /* threads writing snapshots */
+
+  int pngLevel;         /* zlib compression level for PNG output */
+  char *pngFilterString;
+  char *pngStrategyString;
+  int pngFilters;       /* PNG_FILTER_* mask, or -1 for libpng's choice */
+  int pngStrategy;      /* Z_* strategy, or -1 for libpng's choice */
+  int pngThreads;       /* threads encoding each PNG image, 0 for one per CPU */
+
+  char *recordFile;     /* record the session from the server here */
+  char *replayFile;     /* replay a recorded session instead of connecting */
+  int bench;            /* report decoding and encoding speed of a replay */
+
+  int rgbxBuffer;       /* keep the frame buffer in the server's 32-bit pixels */
+
+  char *unchangedString;
+  int unchangedMode;    /* UNCHANGED_*: what to do when the screen has not changed */
+  int minChange;        /* pixels that must change for the screen to have changed */
+
+  int streamFirst;      /* encode the first snapshot while it arrives */
+
+  int jpegQuality;      /* JPEG output quality, 1..100 */
+  char *jpegSubsampleString;
+  int jpegSubsample;    /* JPEG_SUBSAMPLE_*: chroma resolution */
+  int jpegFastDCT;      /* use libjpeg's fast, less accurate DCT */
+
+  char *frameBufferFile; /* keep the frame buffer mapped from this file */
+  char *shmName;        /* publish each snapshot to this shared memory object */
+
+  char *hostsFile;      /* capture each server listed in this file */
+  int parallel;         /* servers captured at a time from hostsFile */
+
+  int decodeThreads;    /* threads decoding Tight JPEG, 0 for one per CPU */
 } AppData;
 
+/* Values of appData.unchangedMode */
+#define UNCHANGED_WRITE   0     /* write every snapshot regardless */
+#define UNCHANGED_SKIP    1     /* write nothing */
+#define UNCHANGED_LINK    2     /* hard link to the last snapshot written */
+#define UNCHANGED_SYMLINK 3     /* symbolic link to it */
+
+/* Values of Session outputFormat */
+#define FORMAT_PNG 0
+#define FORMAT_QOI 1
+#define FORMAT_JPEG 2
+#define FORMAT_PPM 3
+
+/* Values of appData.jpegSubsample */
+#define JPEG_SUBSAMPLE_444 0    /* full chroma resolution */
+#define JPEG_SUBSAMPLE_422 1    /* half horizontally */
+#define JPEG_SUBSAMPLE_420 2    /* half both ways */
+
 extern AppData appData;
 
 extern char *fallback_resources[];
@@ -99,16 +152,122 @@ extern uint16_t listenPort, flashPort;
 extern void removeArgs(int *argc, char** argv, int idx, int nargs);
 extern void usage(void);
 extern void GetArgsAndResources(int argc, char **argv);
+extern bool SetServerName(const char *name);
+extern bool ParseServerName(const char *name, char *host, uint16_t *port);
+
+/* rfbproto.c */
+
+/*
+ * A Session holds everything belonging to one connection to a VNC server:
+ * the connection, what the server told us, the decoders' state and the
+ * frame buffer updates are drawn into. Every function that talks to the
+ * server or touches the frame buffer is given the session to use, so any
+ * number of them can be used at once, each from a thread of its own.
+ */
+
+typedef struct Session {
+  /* The connection (sockets.cxx) */
+  int sock;
+  bool sameMachine;
+  struct RFBStreams *streams;   /* rdr streams, opaque to C */
+
+  /* The protocol (rfbproto.c) */
+  rfbServerInitMsg si;
+  char *desktopName;
+  rfbPixelFormat format;        /* of the pixels we asked the server for */
+  int currentEncoding;
+  uint8_t *serverCutText;
+  bool newServerCutText;
+  bool gotCursorPos;            /* -cursor, -nocursor worked */
+  bool blankWarned;             /* warned of a blank screen discarded */
+  struct Decoders *decoders;    /* scratch buffers and zlib streams */
+  struct ZrleDecoder *zrle;     /* ZRLE's zlib stream (zrle.cxx) */
+  struct DecodeQueues *decodeQueues;    /* worker threads (decodethreads.c) */
+
+  /* The frame buffer (buffer.c) */
+  uint8_t *frameBuffer;         /* packed RGB, or RGBX with -rgbx */
+  size_t bytesPerPixel;
+  bool blank;                   /* nothing but black drawn yet */
+  bool written;                 /* anything drawn at all */
+  uint8_t *damage;              /* a flag per DAMAGE_TILE_SIZE square */
+  uint32_t damageColumns, damageRows;
+  uint8_t *bufferMap;           /* -fbfile mapping holding frameBuffer */
+  size_t bufferMapSize;
+
+  /* The soft cursor (cursor.c), NULL if no shape has been received */
+  struct SoftCursor *cursor;
+
+  /* What is captured (vncsnapshot.c) */
+  const char *serverName;       /* for messages; NULL if it connected to us */
+  uint32_t rectX, rectY;        /* the rectangle of the screen captured */
+  uint32_t rectWidth, rectHeight;
+  int outputFormat;             /* FORMAT_*, from the output file's extension */
+
+  /* Snapshots waiting to be written (output.c), being encoded as they
+     arrive (stream.c) and published in shared memory (shm.c); NULL when
+     not in use */
+  struct Output *output;
+  struct Stream *stream;
+  struct SharedScreen *shared;
+} Session;
+
+extern Session *NewSession(void);
+extern void FreeSession(Session *s);
+extern bool InitialiseRFBConnection(Session *s);
+extern bool ReadServerInit(Session *s);
+extern bool SendSetPixelFormat(Session *s);
+extern bool SendSetEncodings(Session *s);
+extern bool SendIncrementalFramebufferUpdateRequest(Session *s);
+extern bool RequestNewUpdate(Session *s);
+extern bool SendFramebufferUpdateRequest(Session *s, uint16_t x, uint16_t y,
+                                         uint16_t w, uint16_t h, bool incremental);
+extern bool HandleRFBServerMessage(Session *s);
+
+extern void PrintPixelFormat(rfbPixelFormat *format);
 
 /* buffer.c */
-extern int AllocateBuffer();
-extern void CopyDataToScreen(uint8_t *buffer, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
-extern uint8_t *CopyScreenToData(uint32_t x, uint32_t y, uint32_t w, uint32_t h);
-extern void FillBufferRectangle(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t pixel);
-extern void ShrinkBuffer(uint32_t x, uint32_t y, uint32_t req_width, uint32_t req_height);
-extern void write_PNG (char * filename, int quality, uint32_t width, uint32_t height);
-extern int BufferIsBlank();
-extern int BufferWritten();
+
+#define DAMAGE_TILE_SIZE 64     /* pixels square tracked by the damage map */
+
+extern int AllocateBuffer(Session *s);
+extern void FreeBuffer(Session *s);
+extern void CopyDataToScreen(Session *s, const uint8_t *buffer, uint32_t x, uint32_t y,
+                             uint32_t w, uint32_t h);
+extern uint8_t *CopyScreenToData(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern void CopyScreenRectangle(Session *s, uint32_t srcX, uint32_t srcY, uint32_t x, uint32_t y,
+                                uint32_t w, uint32_t h);
+extern void CopyScreenToImage(Session *s, uint8_t *image, uint32_t x, uint32_t y,
+                              uint32_t w, uint32_t h);
+extern void CopyScreenToFrame(Session *s, uint8_t *frame, size_t stride, uint32_t x, uint32_t y,
+                              uint32_t w, uint32_t h);
+extern size_t ScreenBytesPerPixel(Session *s);
+extern void FillBufferRectangle(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                                uint32_t pixel);
+extern void ReserveScreenRectangle(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern bool PaintFillToScreen(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                              uint32_t pixel);
+extern bool PaintDataToScreen(Session *s, const uint8_t *buffer, uint32_t x, uint32_t y,
+                              uint32_t w, uint32_t h, bool checkBlack);
+extern void ScreenRows(Session *s, uint8_t **rows, uint32_t x, uint32_t y, uint32_t h);
+extern bool ScreenRectangleIsBlack(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern void ScreenRectanglePainted(Session *s, bool black);
+extern void write_PNG (char * filename, int interlace, uint8_t *image,
+                       uint32_t width, uint32_t height);
+extern void write_JPEG(char *filename, uint8_t *image, uint32_t width, uint32_t height);
+extern bool WriteScreenJPEG(Session *s, const char *filename, uint32_t x, uint32_t y,
+                            uint32_t w, uint32_t h,
+                            uint32_t (*rowsReady)(Session *s, uint32_t row));
+extern void write_PPM(char *filename, uint8_t *image, uint32_t width, uint32_t height);
+extern bool WriteScreenPPM(Session *s, const char *filename, uint32_t x, uint32_t y,
+                           uint32_t w, uint32_t h,
+                           uint32_t (*rowsReady)(Session *s, uint32_t row));
+extern uint64_t HashScreenRectangle(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern bool ScreenTileDamaged(Session *s, uint32_t column, uint32_t row);
+extern uint32_t CountScreenDamage(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h,
+                                  uint32_t *tiles);
+extern void ClearScreenDamage(Session *s);
+extern int BufferIsBlank(Session *s);
+extern int BufferWritten(Session *s);
 
 /* colour.c */
 
@@ -117,54 +276,113 @@ extern uint32_t BGR233ToPixel[];
 
 /* cursor.c */
 
-extern bool HandleCursorShape(int xhot, int yhot, int width, int height, uint32_t enc);
-extern bool HandleCursorPos(int x, int y);
-extern void SoftCursorLockArea(int x, int y, int w, int h);
-extern void SoftCursorUnlockScreen(void);
-extern void SoftCursorMove(int x, int y);
+extern bool HandleCursorShape(Session *s, int xhot, int yhot, int width, int height,
+                              uint32_t enc);
+extern bool HandleCursorPos(Session *s, int x, int y);
+extern void SoftCursorLockArea(Session *s, int x, int y, int w, int h);
+extern void SoftCursorUnlockScreen(Session *s);
+extern void SoftCursorMove(Session *s, int x, int y);
+extern void FreeSoftCursor(Session *s);
 
 /* listen.c */
 
+extern int acceptedSock;
+
 extern void listenForIncomingConnections();
 
-/* rfbproto.c */
+/* output.c */
 
-extern bool canUseCoRRE;
-extern bool canUseHextile;
-extern char *desktopName;
-extern rfbPixelFormat myFormat;
-extern rfbServerInitMsg si;
-extern uint8_t *serverCutText;
-extern bool newServerCutText;
-
-extern bool ConnectToRFBServer(const char *hostname, uint16_t port);
-extern bool InitialiseRFBConnection();
-extern bool SendSetPixelFormat();
-extern bool SendSetEncodings();
-extern bool SendIncrementalFramebufferUpdateRequest();
-extern bool SendFramebufferUpdateRequest(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
-                                         bool incremental);
-extern bool SendPointerEvent(int x, int y, int buttonMask);
-extern bool SendKeyEvent(uint32_t key, bool down);
-extern bool SendClientCutText(char *str, int len);
-extern bool HandleRFBServerMessage();
+extern bool StartOutput(Session *s);
+extern void QueueSnapshot(Session *s, const char *filename, uint32_t x, uint32_t y,
+                          uint32_t width, uint32_t height);
+extern void SnapshotStreamed(Session *s, const char *filename, uint32_t x, uint32_t y,
+                             uint32_t width, uint32_t height);
+extern void FinishOutput(Session *s);
+extern int FormatForFilename(const char *filename);
+extern const char *FormatName(int format);
+extern void WriteImage(char *filename, int format, uint8_t *image, uint32_t width,
+                       uint32_t height);
+extern bool WritesFromScreen(int format);
+extern bool WriteScreenImage(Session *s, const char *filename, uint32_t x, uint32_t y,
+                             uint32_t width, uint32_t height,
+                             uint32_t (*rowsReady)(Session *s, uint32_t row));
 
-extern void PrintPixelFormat(rfbPixelFormat *format);
+/* bench.c */
 
-/* sockets.cxx */
+extern int64_t BenchNanos(void);
+extern void BenchRect(uint32_t encoding, uint32_t pixels, size_t bytes, int64_t nanos);
+extern void BenchWait(uint32_t encoding, int64_t nanos);
+extern void BenchUpdate(void);
+extern int RunBenchmark(Session *s);
+
+/* pixels.c */
+
+extern void (*PackRGBX)(uint8_t *dst, const uint8_t *src, size_t n);
+extern void (*UnpackRGB)(uint8_t *dst, const uint8_t *src, size_t n);
+extern bool (*IsBlackRGBX)(const uint8_t *src, size_t n);
+extern void InitPixelKernels(void);
+
+/* stream.c */
+
+extern bool StartStreamedSnapshot(Session *s, const char *filename, uint32_t x, uint32_t y,
+                                  uint32_t width, uint32_t height);
+extern void StreamRectDecoded(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern void StreamScreenWritten(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern bool FinishStreamedSnapshot(Session *s);
+extern void CancelStreamedSnapshot(Session *s);
+
+/* decodethreads.c */
+
+/* Decodes a job's data with a worker's scratch space, drawing with
+ * PaintDataToScreen(); *black says whether to check that all it draws is
+ * black, and is cleared if anything is not. Returns false on error. */
+typedef bool (*DecodeFn)(Session *s, void *data, void *scratch, bool *black);
+
+extern int DecodeThreads(void);
+extern int AddDecodeQueue(Session *s, int threads, size_t scratchSize,
+                          void (*freeScratch)(void *scratch));
+extern bool DecodeQueueThreaded(Session *s, int queue);
+extern bool DispatchDecodeJob(Session *s, int queue, DecodeFn decode, void *data,
+                              uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern bool DecodeJobsOverlap(Session *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+extern uint32_t DecodeJobsQueued(Session *s);
+extern bool FinishDecodeJobs(Session *s);
+extern void StopDecodeThreads(Session *s);
 
-extern bool sameMachine;
-extern int rfbsock;
+/* hosts.c */
+
+extern int RunHostList(void);
+
+/* shm.c */
+
+extern bool StartSharedScreen(Session *s, const char *name);
+extern void StopSharedScreen(Session *s);
+extern void PublishSharedScreen(Session *s);
+
+/* qoiwrite.c */
+
+extern void write_QOI(char *filename, uint8_t *image, uint32_t width, uint32_t height);
+
+/* pngwrite.c */
+
+extern int PNGThreads(void);
+extern void write_PNG_strips(char *filename, uint8_t *image, uint32_t width,
+                             uint32_t height, int threads);
+
+/* sockets.cxx */
 
 extern bool InitializeSockets(void);
-extern bool ConnectToRFBServer(const char *hostname, uint16_t port);
-extern bool SetRFBSock(int sock);
-extern void StartTiming();
-extern void StopTiming();
-extern int KbitsPerSecond();
-extern int TimeWaitedIn100us();
-extern bool ReadFromRFBServer(uint8_t *out, size_t n);
-extern bool WriteToRFBServer(uint8_t *buf, size_t n);
+extern bool ConnectToRFBServer(Session *s, const char *hostname, uint16_t port);
+extern bool SetRFBSock(Session *s, int sock);
+extern void CloseRFBConnection(Session *s);
+extern bool ReadFromRFBServer(Session *s, uint8_t *out, size_t n);
+extern const uint8_t *ReadBufferedFromRFBServer(Session *s, size_t itemSize, size_t maxItems,
+                                                size_t *nItems);
+extern bool StartRecording(Session *s, const char *filename);
+extern bool OpenReplay(Session *s, const char *filename);
+extern bool ReplayFinished(Session *s);
+extern size_t RFBBytesRead(Session *s);
+extern bool WriteToRFBServer(Session *s, uint8_t *buf, size_t n);
 extern int ConnectToTcpAddr(const char* hostname, uint16_t port);
 extern uint16_t FindFreeTcpPort();
 extern int ListenAtTcpPort(uint16_t port);
@@ -183,8 +401,11 @@ extern bool createTunnel(int *argc, char **argv, int tunnelArgIndex);
 
 extern char *programName;
 
+extern int CaptureScreen(Session *s, const char *outputFilename);
+
 /* zrle.cxx */
-extern bool zrleDecode(int x, int y, int w, int h);
+extern bool zrleDecode(Session *s, int x, int y, int w, int h);
+extern void FreeZrleDecoder(Session *s);
 
 /* getpass.c (win32) */
 #ifdef WIN32
@@ -23,6 +23,10 @@
 //
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <new>
 #include "rdr/ZlibInStream.h"
 #include "rdr/FdInStream.h"
 #include "rdr/Exception.h"
@@ -33,19 +37,19 @@ extern "C" {
 
 // Instantiate the decoding function for 8, 16 and 32 BPP
 
-#define IMAGE_RECT(x,y,w,h,data)                \
-    CopyDataToScreen((uint8_t*)data,x,y,w,h);
+#define IMAGE_RECT(x,y,w,h,data)                                        \
+    black = PaintDataToScreen(s,(uint8_t*)data,x,y,w,h,black);
 
 #define FILL_RECT(x,y,w,h,pix)                                          \
-    FillBufferRectangle(x, y, w, h, pix);
+    if (!PaintFillToScreen(s, x, y, w, h, pix)) black = false;
 
 #define BPP 8
 #include "rfb/zrleDecode.h"
 #undef BPP
 
 #undef FILL_RECT
-#define FILL_RECT(x,y,w,h,pix)                          \
-    FillBufferRectangle(x, y, w, h, pix);
+#define FILL_RECT(x,y,w,h,pix)                                          \
+    if (!PaintFillToScreen(s, x, y, w, h, pix)) black = false;
 
 #define BPP 16
 #include "rfb/zrleDecode.h"
@@ -62,55 +66,334 @@ extern "C" {
 
 
 #define BUFFER_SIZE (rfbZRLETileWidth * rfbZRLETileHeight)
-static uint32_t buffer[BUFFER_SIZE];
 
-rdr::ZlibInStream zis;
-extern rdr::FdInStream* fis;
+// Room to decode a tile in: its pixels, and its data when the stream's
+// buffer does not hold all of it, at most that of a raw tile.
+struct ZrleTile {
+  uint32_t buffer[BUFFER_SIZE];
+  uint8_t data[BUFFER_SIZE * 4];
+};
+
+// With -decodethreads, rectangles of at least this many pixels are drawn on
+// a worker thread while the reading thread inflates them, passing the
+// decompressed data through a ring.  Smaller ones are not worth the
+// handover.
+#define PIPELINE_PIXELS (256 * 256)
+
+#define RING_SIZE (256 * 1024)
+#define RING_CHUNK 16384        // most inflated or parsed between handovers
+#define RING_SLACK 4            // largest item the tile parser reads at once
+
+// The ring of decompressed data.  Positions count bytes since the session
+// began; only the reading thread moves written, and only the worker read.
+struct ZrleRing {
+  ZrleRing() : written(0), read(0) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&changed, NULL);
+  }
+  ~ZrleRing() {
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&lock);
+  }
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;       // written or read has moved on
+  size_t written, read;
+  // The first RING_SLACK bytes are repeated at the end, so that an item
+  // wrapping round can be read in place.
+  uint8_t data[RING_SIZE + RING_SLACK];
+};
+
+// A rectangle being drawn on the worker.  The reading thread sets end, and
+// then inflated, once it has put all of its data in the ring.
+struct ZrleJob {
+  ZrleRing* ring;
+  size_t end;
+  bool inflated;
+  int x, y, w, h;
+};
+
+// RingInStream reads a rectangle's data from the ring on the worker,
+// waiting for the reading thread to inflate more as it goes.
+class RingInStream : public rdr::InStream {
+
+public:
+
+  RingInStream(ZrleJob* job_);
 
-bool zrleDecode(int x, int y, int w, int h)
+  size_t pos() { return position - start + (ptr - window); }
+
+  // finish() skips whatever of the rectangle's data is left unread.
+  void finish();
+
+private:
+
+  size_t overrun(size_t itemSize, size_t nItems);
+
+  ZrleJob* job;
+  ZrleRing* ring;
+  size_t start;                 // the rectangle's first byte
+  size_t position;              // that of window
+  const uint8_t* window;
+};
+
+// A session's ZRLE decoder: the zlib stream lasts as long as the
+// connection.
+struct ZrleDecoder {
+  ZrleDecoder() : queue(-1), ring(0) {}
+  ~ZrleDecoder() { delete ring; }
+
+  rdr::ZlibInStream zis;
+  ZrleTile tile;
+  int queue;                    // for large rectangles, or -1 if none
+  ZrleRing* ring;
+};
+
+rdr::InStream* RFBInStream(Session *s);
+
+static ZrleDecoder* NewZrleDecoder(Session *s);
+static void InflateIntoRing(ZrleRing* ring, rdr::ZlibInStream* zis, ZrleJob* job);
+static bool DecodeZrleRect(Session *s, void *data, void *scratch, bool *black);
+static bool DecodeTiles(Session *s, int x, int y, int w, int h,
+                        rdr::InStream* zis, ZrleTile* tile, bool black);
+
+bool zrleDecode(Session *s, int x, int y, int w, int h)
 {
   try {
-    switch (myFormat.bitsPerPixel) {
-
-    case 8:
-      zrleDecode8( x,y,w,h,fis,&zis,(uint8_t*)buffer);
-      break;
-
-    case 16:
-      zrleDecode16(x,y,w,h,fis,&zis,(uint16_t*)buffer);
-      break;
-
-    case 32:
-      bool fitsInLS3Bytes
-        = ((myFormat.redMax   << myFormat.redShift)   < (1<<24) &&
-           (myFormat.greenMax << myFormat.greenShift) < (1<<24) &&
-           (myFormat.blueMax  << myFormat.blueShift)  < (1<<24));
-
-      bool fitsInMS3Bytes = (myFormat.redShift   > 7  &&
-                             myFormat.greenShift > 7  &&
-                             myFormat.blueShift  > 7);
-
-      if ((fitsInLS3Bytes && !myFormat.bigEndian) ||
-          (fitsInMS3Bytes && myFormat.bigEndian))
-      {
-        zrleDecode24A(x,y,w,h,fis,&zis,buffer);
-      }
-      else if ((fitsInLS3Bytes && myFormat.bigEndian) ||
-               (fitsInMS3Bytes && !myFormat.bigEndian))
-      {
-        zrleDecode24B(x,y,w,h,fis,&zis,buffer);
-      }
-      else
-      {
-        zrleDecode32(x,y,w,h,fis,&zis,buffer);
-      }
-      break;
+    ZrleDecoder* zrle = s->zrle ? s->zrle : NewZrleDecoder(s);
+    rdr::InStream* fis = RFBInStream(s);
+    rdr::ZlibInStream* zis = &zrle->zis;
+
+    int length = fis->readU32();
+    zis->setUnderlying(fis, length);
+
+    if (zrle->queue >= 0 && (uint32_t)w * (uint32_t)h >= PIPELINE_PIXELS) {
+      ZrleJob* job = (ZrleJob*)malloc(sizeof(ZrleJob));
+      if (!job)
+        throw std::bad_alloc();
+      job->ring = zrle->ring;
+      job->end = 0;
+      job->inflated = false;
+      job->x = x;
+      job->y = y;
+      job->w = w;
+      job->h = h;
+      if (!DispatchDecodeJob(s, zrle->queue, DecodeZrleRect, job, x, y, w, h))
+        return false;
+      InflateIntoRing(zrle->ring, zis, job);
+    } else {
+      ReserveScreenRectangle(s, x, y, w, h);
+      ScreenRectanglePainted(s, DecodeTiles(s, x, y, w, h, zis, &zrle->tile,
+                                            BufferIsBlank(s)));
     }
 
+    zis->reset();
+
   } catch (rdr::Exception& e) {
     fprintf(stderr,"ZRLE decoder exception: %s\n",e.str());
     return false;
+  } catch (std::bad_alloc&) {
+    fprintf(stderr,"ZRLE decoder: out of memory\n");
+    return false;
   }
 
   return true;
 }
+
+void FreeZrleDecoder(Session *s)
+{
+  delete s->zrle;
+  s->zrle = NULL;
+}
+
+// NewZrleDecoder() creates a session's decoder, with a worker thread to
+// draw large rectangles if there are to be decoding threads.
+
+static ZrleDecoder* NewZrleDecoder(Session *s)
+{
+  ZrleDecoder* zrle = s->zrle = new ZrleDecoder;
+
+  if (DecodeThreads() > 1) {
+    int queue = AddDecodeQueue(s, 1, sizeof(ZrleTile), NULL);
+    if (queue >= 0 && DecodeQueueThreaded(s, queue)) {
+      zrle->ring = new ZrleRing;
+      zrle->queue = queue;
+    }
+  }
+  return zrle;
+}
+
+// InflateIntoRing() inflates a rectangle's data into the ring, as fast as
+// the worker makes room, and then tells it where the data ends.
+
+static void InflateIntoRing(ZrleRing* ring, rdr::ZlibInStream* zis, ZrleJob* job)
+{
+  size_t written = ring->written;
+
+  try {
+    for (;;) {
+      pthread_mutex_lock(&ring->lock);
+      while (written - ring->read == RING_SIZE)
+        pthread_cond_wait(&ring->changed, &ring->lock);
+      size_t space = RING_SIZE - (written - ring->read);
+      pthread_mutex_unlock(&ring->lock);
+
+      size_t index = written % RING_SIZE;
+      if (space > RING_SIZE - index)
+        space = RING_SIZE - index;
+      if (space > RING_CHUNK)
+        space = RING_CHUNK;
+
+      size_t n = zis->decompressTo(&ring->data[index], space);
+      if (n == 0)
+        break;
+      if (index < RING_SLACK)
+        memcpy(&ring->data[RING_SIZE + index], &ring->data[index],
+               n < RING_SLACK - index ? n : RING_SLACK - index);
+      written += n;
+
+      pthread_mutex_lock(&ring->lock);
+      ring->written = written;
+      pthread_cond_broadcast(&ring->changed);
+      pthread_mutex_unlock(&ring->lock);
+    }
+  } catch (...) {
+    // Let the worker give up on what it has
+    pthread_mutex_lock(&ring->lock);
+    job->end = written;
+    job->inflated = true;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+    throw;
+  }
+
+  pthread_mutex_lock(&ring->lock);
+  job->end = written;
+  job->inflated = true;
+  pthread_cond_broadcast(&ring->changed);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+// DecodeZrleRect() draws a rectangle on the worker from the ring.
+
+static bool DecodeZrleRect(Session *s, void *data, void *scratch, bool *black)
+{
+  ZrleJob* job = (ZrleJob*)data;
+  RingInStream ris(job);
+  bool ok = true;
+
+  try {
+    *black = DecodeTiles(s, job->x, job->y, job->w, job->h, &ris,
+                         (ZrleTile*)scratch, *black);
+  } catch (rdr::Exception& e) {
+    fprintf(stderr,"ZRLE decoder exception: %s\n",e.str());
+    ok = false;
+  }
+  ris.finish();
+  return ok;
+}
+
+// DecodeTiles() decodes a rectangle's tiles from its decompressed data with
+// the function for the session's pixel format.
+
+static bool DecodeTiles(Session *s, int x, int y, int w, int h,
+                        rdr::InStream* zis, ZrleTile* tile, bool black)
+{
+  const rfbPixelFormat& myFormat = s->format;
+  uint32_t* buffer = tile->buffer;
+  uint8_t* data = tile->data;
+
+  switch (myFormat.bitsPerPixel) {
+
+  case 8:
+    return zrleDecode8( s,x,y,w,h,zis,(uint8_t*)buffer,data,black);
+
+  case 16:
+    return zrleDecode16(s,x,y,w,h,zis,(uint16_t*)buffer,data,black);
+
+  case 32:
+    bool fitsInLS3Bytes
+      = ((myFormat.redMax   << myFormat.redShift)   < (1<<24) &&
+         (myFormat.greenMax << myFormat.greenShift) < (1<<24) &&
+         (myFormat.blueMax  << myFormat.blueShift)  < (1<<24));
+
+    bool fitsInMS3Bytes = (myFormat.redShift   > 7  &&
+                           myFormat.greenShift > 7  &&
+                           myFormat.blueShift  > 7);
+
+    if ((fitsInLS3Bytes && !myFormat.bigEndian) ||
+        (fitsInMS3Bytes && myFormat.bigEndian))
+    {
+      return zrleDecode24A(s,x,y,w,h,zis,buffer,data,black);
+    }
+    else if ((fitsInLS3Bytes && myFormat.bigEndian) ||
+             (fitsInMS3Bytes && !myFormat.bigEndian))
+    {
+      return zrleDecode24B(s,x,y,w,h,zis,buffer,data,black);
+    }
+    else
+    {
+      return zrleDecode32(s,x,y,w,h,zis,buffer,data,black);
+    }
+  }
+
+  return black;
+}
+
+RingInStream::RingInStream(ZrleJob* job_)
+  : job(job_), ring(job_->ring)
+{
+  pthread_mutex_lock(&ring->lock);
+  start = position = ring->read;
+  pthread_mutex_unlock(&ring->lock);
+  ptr = end = window = &ring->data[position % RING_SIZE];
+}
+
+size_t RingInStream::overrun(size_t itemSize, size_t nItems)
+{
+  if (itemSize > RING_SLACK)
+    throw rdr::Exception("RingInStream overrun: max itemSize exceeded");
+
+  position += ptr - window;
+
+  pthread_mutex_lock(&ring->lock);
+  ring->read = position;
+  pthread_cond_broadcast(&ring->changed);
+  size_t limit = job->inflated ? job->end : ring->written;
+  while (limit - position < itemSize && !job->inflated) {
+    pthread_cond_wait(&ring->changed, &ring->lock);
+    limit = job->inflated ? job->end : ring->written;
+  }
+  pthread_mutex_unlock(&ring->lock);
+
+  if (limit - position < itemSize)
+    throw rdr::Exception("ZRLE rectangle data ends early");
+
+  size_t index = position % RING_SIZE;
+  size_t avail = limit - position;
+  if (avail > RING_SIZE + RING_SLACK - index)
+    avail = RING_SIZE + RING_SLACK - index;
+  if (avail > RING_CHUNK)
+    avail = RING_CHUNK;
+
+  ptr = window = &ring->data[index];
+  end = ptr + avail;
+
+  if (itemSize * nItems > avail)
+    nItems = avail / itemSize;
+  return nItems;
+}
+
+void RingInStream::finish()
+{
+  pthread_mutex_lock(&ring->lock);
+  // Make room for the rest of the rectangle while waiting for it
+  while (!job->inflated) {
+    ring->read = ring->written;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_cond_wait(&ring->changed, &ring->lock);
+  }
+  ring->read = job->end;
+  pthread_cond_broadcast(&ring->changed);
+  pthread_mutex_unlock(&ring->lock);
+}